@@ -0,0 +1,1036 @@
+#ifndef SET_BTREESET_H
+#define SET_BTREESET_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "NodeSearch.h"
+#include "Set.h"
+
+// Selects the B+-tree backend: Set<T, Compare, Allocator, BTreeBalance<>> keeps the keys in
+// sorted arrays inside nodes of about NodeBytes bytes (a few cache lines), so a lookup
+// touches one node per level instead of one per key, and a key costs little more than
+// sizeof(T). Keys live only in the leaves, which are linked for iteration; inner nodes hold
+// copies of keys as separators.
+//
+// Unlike the node based backend, inserting or erasing moves keys between nodes and so
+// invalidates every iterator. T must be copy constructible and nothrow move constructible.
+template <std::size_t NodeBytes = 256>
+struct BTreeBalance {};
+
+namespace set_detail {
+
+// Moves count objects to uninitialized storage, ending their lifetime at the source.
+// The ranges may overlap.
+template <typename T>
+void relocate(T* from, T* to, std::size_t count, std::true_type) {
+    std::memmove(static_cast<void*>(to), static_cast<void const*>(from), count * sizeof(T));
+}
+
+template <typename T>
+void relocate(T* from, T* to, std::size_t count, std::false_type) {
+    if (to < from) {
+        for (std::size_t i = 0; i < count; i++) {
+            new (to + i) T(std::move(from[i]));
+            from[i].~T();
+        }
+    } else {
+        for (std::size_t i = count; i-- > 0;) {
+            new (to + i) T(std::move(from[i]));
+            from[i].~T();
+        }
+    }
+}
+
+template <typename T>
+void relocate(T* from, T* to, std::size_t count) {
+    if (count != 0 && from != to)
+        relocate(from, to, count, std::is_trivially_copyable<T>());
+}
+
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+struct Set<T, Compare, Allocator, BTreeBalance<NodeBytes>> {
+    static_assert(std::is_nothrow_move_constructible<T>::value, "keys are moved between nodes");
+    static_assert(std::is_copy_constructible<T>::value, "inner nodes hold copies of keys");
+
+private:
+    using Slot = typename std::aligned_storage<sizeof(T), alignof(T)>::type;
+    using search = set_detail::NodeSearch<T, Compare>;
+
+    static constexpr std::size_t capacity(std::size_t header, std::size_t per_key) {
+        return NodeBytes > header + 3 * per_key ? (NodeBytes - header) / per_key : 3;
+    }
+
+    static constexpr std::size_t LEAF_CAPACITY = capacity(sizeof(std::size_t) + 2 * sizeof(void*), sizeof(T));
+    static constexpr std::size_t INNER_CAPACITY = capacity(2 * sizeof(std::size_t), sizeof(T) + sizeof(void*));
+    static constexpr std::size_t LEAF_MIN = LEAF_CAPACITY / 2;
+    static constexpr std::size_t INNER_MIN = INNER_CAPACITY / 2;
+    // every inner node but the root has at least two children
+    static constexpr unsigned MAX_HEIGHT = 64;
+
+    struct Node {
+        std::size_t count = 0;
+    };
+
+    struct Leaf : Node {
+        Leaf* prev = nullptr;
+        Leaf* next = nullptr;
+        Slot slots[LEAF_CAPACITY];
+
+        T* keys() { return reinterpret_cast<T*>(slots); }
+        T& key(std::size_t index) { return keys()[index]; }
+    };
+
+    struct Inner : Node {
+        Slot slots[INNER_CAPACITY];
+        Node* children[INNER_CAPACITY + 1];
+
+        T* keys() { return reinterpret_cast<T*>(slots); }
+        T& key(std::size_t index) { return keys()[index]; }
+    };
+
+    using leaf_allocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Leaf>;
+    using leaf_traits = std::allocator_traits<leaf_allocator>;
+    using inner_allocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Inner>;
+    using inner_traits = std::allocator_traits<inner_allocator>;
+
+    template <typename V>
+    struct Iterator;
+public:
+
+    using value_type = T;
+    using key_type = T;
+    using key_compare = Compare;
+    using value_compare = Compare;
+    using allocator_type = Allocator;
+    using size_type = std::size_t;
+
+    Set() noexcept(std::is_nothrow_default_constructible<Compare>::value &&
+                   std::is_nothrow_default_constructible<leaf_allocator>::value) {}
+    explicit Set(Compare const& compare, Allocator const& allocator = Allocator())
+            : compare_(compare), allocator_(allocator) {}
+    explicit Set(Allocator const& allocator) : allocator_(allocator) {}
+    template <typename InputIt>
+    Set(InputIt first, InputIt last, Compare const& compare = Compare(), Allocator const& allocator = Allocator());
+    Set(Set const& other);
+    Set(Set&& other) noexcept;
+    Set &operator=(Set const& other);
+    Set &operator=(Set&& other) noexcept(std::allocator_traits<Allocator>::propagate_on_container_move_assignment::value ||
+                                         std::allocator_traits<Allocator>::is_always_equal::value);
+    ~Set() { clear(); }
+
+    static constexpr std::size_t node_size = sizeof(Leaf);
+
+    using iterator = Iterator<T const>;
+    using const_iterator = iterator;
+    using reverse_iterator = std::reverse_iterator<iterator>;
+    using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+    std::pair<iterator, bool> insert(T const& element) { return insert_impl(element); }
+    std::pair<iterator, bool> insert(T&& element) { return insert_impl(std::move(element)); }
+    template <typename... Args>
+    std::pair<iterator, bool> emplace(Args&&... args);
+    // the hint is not needed: a descent is a few node searches, and appends to the last leaf
+    // already split it unevenly
+    iterator insert(const_iterator, T const& element) { return insert_impl(element).first; }
+    iterator insert(const_iterator, T&& element) { return insert_impl(std::move(element)).first; }
+    template <typename... Args>
+    iterator emplace_hint(const_iterator, Args&&... args) { return emplace(std::forward<Args>(args)...).first; }
+    template <typename InputIt>
+    void insert(InputIt first, InputIt last) { insert_sorted(first, last); }
+    // O(n + size()) when the range is sorted, O(n log n + size()) otherwise
+    template <typename InputIt>
+    void insert_sorted(InputIt first, InputIt last);
+    iterator erase(const_iterator it);
+
+    const_iterator find(T const& element) const;
+    const_iterator lower_bound(T const& element) const;
+    const_iterator upper_bound(T const& element) const;
+    std::pair<const_iterator, const_iterator> equal_range(T const& element) const;
+
+    // Many lookups at once, one result per key in order: the descents of a group of keys go
+    // down a level at a time and prefetch the nodes they visit next.
+    template <typename ForwardIt, typename OutputIt>
+    OutputIt find_batch(ForwardIt first, ForwardIt last, OutputIt out) const;
+    template <typename ForwardIt, typename OutputIt>
+    OutputIt contains_batch(ForwardIt first, ForwardIt last, OutputIt out) const;
+
+    // an immutable copy laid out for fast lookups, O(n); the B-tree has no binary shape to keep,
+    // VanEmdeBoasLayout lays out a balanced one
+    template <typename Layout = EytzingerLayout>
+    FrozenSet<T, Compare, Layout> freeze() const;
+
+    bool empty() const { return root_ == nullptr; }
+    size_type size() const { return size_; }
+    void clear();
+
+    void swap(Set& other);
+
+    allocator_type get_allocator() const { return allocator_type(allocator_); }
+    key_compare key_comp() const { return compare_; }
+    value_compare value_comp() const { return compare_; }
+
+    iterator begin() { return iterator(first_, 0); }
+    const_iterator begin() const { return const_iterator(first_, 0); }
+    iterator end() { return iterator(last_, last_ ? last_->count : 0); }
+    const_iterator end() const { return const_iterator(last_, last_ ? last_->count : 0); }
+
+    reverse_iterator rbegin() { return reverse_iterator(end()); }
+    const_reverse_iterator rbegin() const { return const_reverse_iterator(end()); }
+    reverse_iterator rend() { return reverse_iterator(begin()); }
+    const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
+
+private:
+    Node* root_ = nullptr;
+    Leaf* first_ = nullptr;
+    Leaf* last_ = nullptr;
+    size_type size_ = 0;
+    // levels of inner nodes above the leaves
+    unsigned height_ = 0;
+    Compare compare_;
+    leaf_allocator allocator_;
+
+    Leaf* create_leaf();
+    Inner* create_inner();
+    void destroy(Leaf* leaf);
+    void destroy(Inner* inner);
+    void clear_impl(Node* node, unsigned level);
+    void steal(Set& other) noexcept;
+    void move_assign(Set& other, std::true_type) noexcept;
+    void move_assign(Set& other, std::false_type);
+
+    template <typename InputIt>
+    void build(InputIt first, size_type count);
+    Leaf* descend(T const& element, Inner** path, std::size_t* index) const;
+    static constexpr std::size_t BATCH_GROUP = 16;
+    template <typename ForwardIt>
+    ForwardIt find_group(ForwardIt first, ForwardIt last, const_iterator* found) const;
+    static void prefetch(Node* node);
+    static const_iterator position(Leaf* leaf, std::size_t index);
+
+    template <typename K>
+    std::pair<iterator, bool> insert_impl(K&& element);
+    iterator place(Inner** path, std::size_t* index, Leaf* leaf, std::size_t at, T& value);
+    static void insert_entry(Inner* inner, std::size_t at, T* key, Node* child);
+    static void split_inner(Inner* inner, std::size_t at, T* key, Node* child, Inner* right);
+    static void erase_entry(Inner* inner, std::size_t at);
+    void unlink(Leaf* leaf);
+    void rebalance(Inner** path, std::size_t* index, unsigned level);
+};
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+constexpr std::size_t Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::LEAF_CAPACITY;
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+constexpr std::size_t Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::INNER_CAPACITY;
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+constexpr std::size_t Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::LEAF_MIN;
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+constexpr std::size_t Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::INNER_MIN;
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+constexpr unsigned Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::MAX_HEIGHT;
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+constexpr std::size_t Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::node_size;
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+template <typename InputIt>
+Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::Set(InputIt first, InputIt last, Compare const& compare, Allocator const& allocator)
+        : Set(compare, allocator) {
+    insert_sorted(first, last);
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::Set(Set const& other)
+        : compare_(other.compare_), allocator_(leaf_traits::select_on_container_copy_construction(other.allocator_)) {
+    build(other.begin(), other.size_);
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::Set(Set&& other) noexcept
+        : compare_(std::move(other.compare_)), allocator_(std::move(other.allocator_)) {
+    steal(other);
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>& Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::operator=(Set const &other) {
+    Set temp(other);
+    swap(temp);
+    return *this;
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>& Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::operator=(Set&& other)
+        noexcept(std::allocator_traits<Allocator>::propagate_on_container_move_assignment::value ||
+                 std::allocator_traits<Allocator>::is_always_equal::value) {
+    if (this != &other)
+        move_assign(other, std::integral_constant<bool, leaf_traits::propagate_on_container_move_assignment::value ||
+                                                        leaf_traits::is_always_equal::value>());
+    return *this;
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+void Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::steal(Set &other) noexcept {
+    root_ = other.root_;
+    first_ = other.first_;
+    last_ = other.last_;
+    size_ = other.size_;
+    height_ = other.height_;
+    other.root_ = nullptr;
+    other.first_ = other.last_ = nullptr;
+    other.size_ = 0;
+    other.height_ = 0;
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+void Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::move_assign(Set &other, std::true_type) noexcept {
+    clear();
+    if (leaf_traits::propagate_on_container_move_assignment::value)
+        allocator_ = std::move(other.allocator_);
+    compare_ = std::move(other.compare_);
+    steal(other);
+}
+
+// the nodes cannot change hands between unequal allocators, only the keys can
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+void Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::move_assign(Set &other, std::false_type) {
+    if (allocator_ == other.allocator_) {
+        move_assign(other, std::true_type());
+        return;
+    }
+
+    clear();
+    compare_ = other.compare_;
+    for (Leaf* leaf = other.first_; leaf != nullptr; leaf = leaf->next)
+        for (std::size_t i = 0; i < leaf->count; i++)
+            insert(std::move(leaf->key(i)));
+    other.clear();
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+typename Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::Leaf* Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::create_leaf() {
+    Leaf* leaf = leaf_traits::allocate(allocator_, 1);
+    leaf_traits::construct(allocator_, leaf);
+    return leaf;
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+typename Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::Inner* Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::create_inner() {
+    inner_allocator allocator(allocator_);
+    Inner* inner = inner_traits::allocate(allocator, 1);
+    inner_traits::construct(allocator, inner);
+    return inner;
+}
+
+// Nodes own their keys but not their children.
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+void Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::destroy(Leaf *leaf) {
+    for (std::size_t i = 0; i < leaf->count; i++)
+        leaf->key(i).~T();
+    leaf_traits::destroy(allocator_, leaf);
+    leaf_traits::deallocate(allocator_, leaf, 1);
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+void Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::destroy(Inner *inner) {
+    for (std::size_t i = 0; i < inner->count; i++)
+        inner->key(i).~T();
+    inner_allocator allocator(allocator_);
+    inner_traits::destroy(allocator, inner);
+    inner_traits::deallocate(allocator, inner, 1);
+}
+
+// the recursion is only as deep as the tree, a few levels
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+void Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::clear_impl(Node *node, unsigned level) {
+    if (level == 0) {
+        destroy(static_cast<Leaf*>(node));
+        return;
+    }
+    Inner* inner = static_cast<Inner*>(node);
+    for (std::size_t i = 0; i <= inner->count; i++)
+        clear_impl(inner->children[i], level - 1);
+    destroy(inner);
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+void Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::clear() {
+    if (root_ != nullptr)
+        clear_impl(root_, height_);
+    root_ = nullptr;
+    first_ = last_ = nullptr;
+    size_ = 0;
+    height_ = 0;
+}
+
+// Bulk loads count sorted, distinct keys into the empty tree: the leaves are filled evenly
+// left to right, then every level of inner nodes is built over the one below it.
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+template <typename InputIt>
+void Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::build(InputIt first, size_type count) {
+    if (count == 0)
+        return;
+
+    std::size_t leaves = (count + LEAF_CAPACITY - 1) / LEAF_CAPACITY;
+    std::vector<Node*> level;
+    std::vector<T const*> lows;
+    std::vector<Inner*> inners;
+    try {
+        level.reserve(leaves);
+        lows.reserve(leaves);
+        for (std::size_t i = 0; i < leaves; i++) {
+            Leaf* leaf = create_leaf();
+            leaf->prev = last_;
+            if (last_ != nullptr)
+                last_->next = leaf;
+            else first_ = leaf;
+            last_ = leaf;
+
+            std::size_t take = count / leaves + (i < count % leaves ? 1 : 0);
+            for (; leaf->count < take; ++first) {
+                new (leaf->keys() + leaf->count) T(*first);
+                ++leaf->count;
+            }
+            level.push_back(leaf);
+            lows.push_back(leaf->keys());
+        }
+
+        unsigned height = 0;
+        while (level.size() > 1) {
+            std::size_t groups = (level.size() + INNER_CAPACITY) / (INNER_CAPACITY + 1);
+            std::vector<Node*> parents;
+            std::vector<T const*> parent_lows;
+            parents.reserve(groups);
+            parent_lows.reserve(groups);
+
+            std::size_t next = 0;
+            for (std::size_t group = 0; group < groups; group++) {
+                std::size_t take = level.size() / groups + (group < level.size() % groups ? 1 : 0);
+                inners.push_back(nullptr);
+                Inner* inner = inners.back() = create_inner();
+                inner->children[0] = level[next];
+                for (std::size_t i = 1; i < take; i++) {
+                    new (inner->keys() + i - 1) T(*lows[next + i]);
+                    inner->children[i] = level[next + i];
+                    ++inner->count;
+                }
+                parents.push_back(inner);
+                parent_lows.push_back(lows[next]);
+                next += take;
+            }
+            level.swap(parents);
+            lows.swap(parent_lows);
+            ++height;
+        }
+
+        root_ = level[0];
+        height_ = height;
+        size_ = count;
+    } catch (...) {
+        // every node is reachable from the leaf list or from inners, free them flat
+        for (Inner* inner : inners)
+            if (inner != nullptr)
+                destroy(inner);
+        while (first_ != nullptr) {
+            Leaf* next = first_->next;
+            destroy(first_);
+            first_ = next;
+        }
+        last_ = nullptr;
+        throw;
+    }
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+template <typename InputIt>
+void Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::insert_sorted(InputIt first, InputIt last) {
+    std::vector<T> values(first, last);
+    for (std::size_t i = 1; i < values.size(); i++) {
+        if (!compare_(values[i - 1], values[i])) {
+            std::stable_sort(values.begin(), values.end(), compare_);
+            values.erase(std::unique(values.begin(), values.end(), [this](T const& first, T const& second) {
+                return !compare_(first, second);
+            }), values.end());
+            break;
+        }
+    }
+
+    if (empty()) {
+        build(std::make_move_iterator(values.begin()), values.size());
+        return;
+    }
+    // a few keys are cheaper to insert one by one than to rebuild the whole tree for
+    if (values.size() * 16 < size_) {
+        for (T& value : values)
+            insert(std::move(value));
+        return;
+    }
+
+    // existing keys win over equal new ones
+    std::vector<T> merged;
+    merged.reserve(size_ + values.size());
+    const_iterator it = begin();
+    typename std::vector<T>::iterator value = values.begin();
+    while (it != end() && value != values.end()) {
+        if (compare_(*value, *it)) {
+            merged.push_back(std::move(*value++));
+        } else {
+            if (!compare_(*it, *value))
+                ++value;
+            merged.push_back(*it++);
+        }
+    }
+    for (; it != end(); ++it)
+        merged.push_back(*it);
+    std::move(value, values.end(), std::back_inserter(merged));
+
+    Set temp(compare_, Allocator(allocator_));
+    temp.build(std::make_move_iterator(merged.begin()), merged.size());
+    clear();
+    steal(temp);
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+typename Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::Leaf*
+Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::descend(T const &element, Inner** path, std::size_t* index) const {
+    Node* node = root_;
+    for (unsigned level = 0; level < height_; level++) {
+        Inner* inner = static_cast<Inner*>(node);
+        std::size_t child = search::upper(inner->keys(), inner->count, element, compare_);
+        path[level] = inner;
+        index[level] = child;
+        node = inner->children[child];
+    }
+    return static_cast<Leaf*>(node);
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+template <typename ForwardIt, typename OutputIt>
+OutputIt Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::find_batch(ForwardIt first, ForwardIt last, OutputIt out) const {
+    while (first != last) {
+        const_iterator found[BATCH_GROUP];
+        ForwardIt group_end = find_group(first, last, found);
+        for (std::size_t i = 0; first != group_end; ++first, ++i)
+            *out++ = found[i];
+    }
+    return out;
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+template <typename ForwardIt, typename OutputIt>
+OutputIt Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::contains_batch(ForwardIt first, ForwardIt last, OutputIt out) const {
+    while (first != last) {
+        const_iterator found[BATCH_GROUP];
+        ForwardIt group_end = find_group(first, last, found);
+        for (std::size_t i = 0; first != group_end; ++first, ++i)
+            *out++ = found[i] != end();
+    }
+    return out;
+}
+
+// All leaves are at the same depth, so the descents of a group step through the levels
+// together; each one prefetches the whole node it goes to while the others search theirs.
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+template <typename ForwardIt>
+ForwardIt Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::find_group(ForwardIt first, ForwardIt last,
+                                                                          const_iterator* found) const {
+    ForwardIt keys[BATCH_GROUP];
+    Node* nodes[BATCH_GROUP];
+    std::size_t count = 0;
+    for (; count < BATCH_GROUP && first != last; ++count, ++first) {
+        keys[count] = first;
+        nodes[count] = root_;
+    }
+    if (root_ == nullptr) {
+        std::fill(found, found + count, end());
+        return first;
+    }
+
+    for (unsigned level = 0; level < height_; level++) {
+        for (std::size_t i = 0; i < count; i++) {
+            Inner* inner = static_cast<Inner*>(nodes[i]);
+            nodes[i] = inner->children[search::upper(inner->keys(), inner->count, *keys[i], compare_)];
+            prefetch(nodes[i]);
+        }
+    }
+    for (std::size_t i = 0; i < count; i++) {
+        Leaf* leaf = static_cast<Leaf*>(nodes[i]);
+        std::size_t index = search::lower(leaf->keys(), leaf->count, *keys[i], compare_);
+        found[i] = index < leaf->count && !compare_(*keys[i], leaf->key(index)) ? const_iterator(leaf, index) : end();
+    }
+    return first;
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+void Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::prefetch(Node* node) {
+    char const* bytes = reinterpret_cast<char const*>(node);
+    for (std::size_t offset = 0; offset < NodeBytes; offset += 64)
+        __builtin_prefetch(bytes + offset);
+}
+
+// a position one past the end of a leaf is the start of the next one
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+typename Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::const_iterator
+Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::position(Leaf* leaf, std::size_t index) {
+    if (index == leaf->count && leaf->next != nullptr)
+        return const_iterator(leaf->next, 0);
+    return const_iterator(leaf, index);
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+template <typename K>
+std::pair<typename Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::iterator, bool>
+Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::insert_impl(K&& element) {
+    Inner* path[MAX_HEIGHT];
+    std::size_t index[MAX_HEIGHT];
+    Leaf* leaf = nullptr;
+    std::size_t at = 0;
+    if (root_ != nullptr) {
+        leaf = descend(element, path, index);
+        at = search::lower(leaf->keys(), leaf->count, element, compare_);
+        if (at < leaf->count && !compare_(element, leaf->key(at)))
+            return {iterator(leaf, at), false};
+    }
+
+    T value(std::forward<K>(element));
+    return {place(path, index, leaf, at, value), true};
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+template <typename... Args>
+std::pair<typename Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::iterator, bool>
+Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::emplace(Args&&... args) {
+    // the key only exists once it is constructed
+    T value(std::forward<Args>(args)...);
+    return insert_impl(std::move(value));
+}
+
+// Puts value at position at of leaf, splitting the full nodes on the path. Everything that
+// can throw (the new nodes, the separator copy) happens before the tree is touched.
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+typename Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::iterator
+Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::place(Inner** path, std::size_t* index, Leaf* leaf, std::size_t at, T& value) {
+    if (leaf == nullptr) {
+        leaf = create_leaf();
+        new (leaf->keys()) T(std::move(value));
+        leaf->count = 1;
+        root_ = first_ = last_ = leaf;
+        size_ = 1;
+        return iterator(leaf, 0);
+    }
+
+    if (leaf->count < LEAF_CAPACITY) {
+        set_detail::relocate(leaf->keys() + at, leaf->keys() + at + 1, leaf->count - at);
+        new (leaf->keys() + at) T(std::move(value));
+        ++leaf->count;
+        ++size_;
+        return iterator(leaf, at);
+    }
+
+    unsigned splits = 0;
+    while (splits < height_ && path[height_ - 1 - splits]->count == INNER_CAPACITY)
+        ++splits;
+    unsigned fresh_count = splits + (splits == height_ ? 1 : 0);
+
+    // appending to the last leaf leaves it full, so ascending inserts pack the leaves
+    std::size_t keep = at == LEAF_CAPACITY && leaf->next == nullptr ? LEAF_CAPACITY : (LEAF_CAPACITY + 1) / 2;
+    Leaf* right = create_leaf();
+    Inner* fresh[MAX_HEIGHT + 1];
+    unsigned created = 0;
+    Slot up_slot;
+    T* up = reinterpret_cast<T*>(&up_slot);
+    try {
+        for (; created < fresh_count; created++)
+            fresh[created] = create_inner();
+        new (up) T(at < keep ? leaf->key(keep - 1) : at == keep ? value : leaf->key(keep));
+    } catch (...) {
+        while (created > 0)
+            destroy(fresh[--created]);
+        destroy(right);
+        throw;
+    }
+
+    iterator result;
+    if (at < keep) {
+        set_detail::relocate(leaf->keys() + keep - 1, right->keys(), LEAF_CAPACITY - keep + 1);
+        right->count = LEAF_CAPACITY - keep + 1;
+        leaf->count = keep - 1;
+        set_detail::relocate(leaf->keys() + at, leaf->keys() + at + 1, leaf->count - at);
+        new (leaf->keys() + at) T(std::move(value));
+        ++leaf->count;
+        result = iterator(leaf, at);
+    } else {
+        std::size_t right_at = at - keep;
+        set_detail::relocate(leaf->keys() + keep, right->keys(), right_at);
+        new (right->keys() + right_at) T(std::move(value));
+        set_detail::relocate(leaf->keys() + at, right->keys() + right_at + 1, LEAF_CAPACITY - at);
+        right->count = LEAF_CAPACITY - keep + 1;
+        leaf->count = keep;
+        result = iterator(right, right_at);
+    }
+    right->prev = leaf;
+    right->next = leaf->next;
+    if (leaf->next != nullptr)
+        leaf->next->prev = right;
+    else last_ = right;
+    leaf->next = right;
+    ++size_;
+
+    // carry the separator and the new right node up until a node has room for them
+    Node* child = right;
+    unsigned used = 0;
+    for (unsigned level = height_; level-- > 0;) {
+        Inner* inner = path[level];
+        if (inner->count < INNER_CAPACITY) {
+            insert_entry(inner, index[level], up, child);
+            return result;
+        }
+        Inner* sibling = fresh[used++];
+        split_inner(inner, index[level], up, child, sibling);
+        child = sibling;
+    }
+
+    Inner* root = fresh[used];
+    set_detail::relocate(up, root->keys(), 1);
+    root->children[0] = root_;
+    root->children[1] = child;
+    root->count = 1;
+    root_ = root;
+    ++height_;
+    return result;
+}
+
+// Moves *key into inner at position at, with child to its right.
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+void Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::insert_entry(Inner *inner, std::size_t at, T* key, Node* child) {
+    set_detail::relocate(inner->keys() + at, inner->keys() + at + 1, inner->count - at);
+    set_detail::relocate(key, inner->keys() + at, 1);
+    std::copy_backward(inner->children + at + 1, inner->children + inner->count + 1, inner->children + inner->count + 2);
+    inner->children[at + 1] = child;
+    ++inner->count;
+}
+
+// Splits the full inner while inserting *key and child at position at. The left half keeps
+// INNER_MIN keys, the rest but the middle key go to right, the middle key is left in *key.
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+void Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::split_inner(Inner *inner, std::size_t at, T* key, Node* child, Inner* right) {
+    std::size_t const half = INNER_MIN;
+    Slot incoming_slot;
+    T* incoming = reinterpret_cast<T*>(&incoming_slot);
+
+    if (at == half) {
+        set_detail::relocate(inner->keys() + half, right->keys(), INNER_CAPACITY - half);
+        right->children[0] = child;
+        std::copy(inner->children + half + 1, inner->children + INNER_CAPACITY + 1, right->children + 1);
+        right->count = INNER_CAPACITY - half;
+        inner->count = half;
+    } else if (at < half) {
+        set_detail::relocate(inner->keys() + half, right->keys(), INNER_CAPACITY - half);
+        std::copy(inner->children + half, inner->children + INNER_CAPACITY + 1, right->children);
+        right->count = INNER_CAPACITY - half;
+        set_detail::relocate(key, incoming, 1);
+        set_detail::relocate(inner->keys() + half - 1, key, 1);
+        inner->count = half - 1;
+        insert_entry(inner, at, incoming, child);
+    } else {
+        set_detail::relocate(inner->keys() + half + 1, right->keys(), INNER_CAPACITY - half - 1);
+        std::copy(inner->children + half + 1, inner->children + INNER_CAPACITY + 1, right->children);
+        right->count = INNER_CAPACITY - half - 1;
+        set_detail::relocate(key, incoming, 1);
+        set_detail::relocate(inner->keys() + half, key, 1);
+        inner->count = half;
+        insert_entry(right, at - half - 1, incoming, child);
+    }
+}
+
+// Drops the key at position at, already destroyed or moved out, and the child to its right.
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+void Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::erase_entry(Inner *inner, std::size_t at) {
+    set_detail::relocate(inner->keys() + at + 1, inner->keys() + at, inner->count - at - 1);
+    std::copy(inner->children + at + 2, inner->children + inner->count + 1, inner->children + at + 1);
+    --inner->count;
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+void Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::unlink(Leaf *leaf) {
+    if (leaf->prev != nullptr)
+        leaf->prev->next = leaf->next;
+    else first_ = leaf->next;
+    if (leaf->next != nullptr)
+        leaf->next->prev = leaf->prev;
+    else last_ = leaf->prev;
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+typename Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::iterator Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::erase(const_iterator it) {
+    if (it == end())
+        return end();
+
+    Leaf* leaf = it.leaf;
+    std::size_t at = it.index;
+    Inner* path[MAX_HEIGHT];
+    std::size_t index[MAX_HEIGHT];
+    descend(leaf->key(at), path, index);
+
+    // a leaf about to underflow borrows from or merges with its left sibling, or its right
+    // one if it is the first child; a borrow needs a fresh separator, copied up front
+    Inner* parent = height_ > 0 ? path[height_ - 1] : nullptr;
+    std::size_t child = height_ > 0 ? index[height_ - 1] : 0;
+    bool underflow = parent != nullptr && leaf->count - 1 < LEAF_MIN;
+    Leaf* sibling = nullptr;
+    Slot separator_slot;
+    T* separator = nullptr;
+    if (underflow) {
+        sibling = static_cast<Leaf*>(parent->children[child > 0 ? child - 1 : 1]);
+        if (sibling->count > LEAF_MIN)
+            separator = new (&separator_slot) T(sibling->key(child > 0 ? sibling->count - 1 : 1));
+    }
+
+    leaf->key(at).~T();
+    set_detail::relocate(leaf->keys() + at + 1, leaf->keys() + at, leaf->count - at - 1);
+    --leaf->count;
+    --size_;
+
+    if (!underflow) {
+        if (leaf->count > 0)
+            return position(leaf, at);
+        destroy(leaf);
+        root_ = nullptr;
+        first_ = last_ = nullptr;
+        return end();
+    }
+
+    if (child > 0) {
+        if (separator != nullptr) {
+            set_detail::relocate(leaf->keys(), leaf->keys() + 1, leaf->count);
+            set_detail::relocate(sibling->keys() + sibling->count - 1, leaf->keys(), 1);
+            --sibling->count;
+            ++leaf->count;
+            parent->key(child - 1).~T();
+            set_detail::relocate(separator, parent->keys() + child - 1, 1);
+            return position(leaf, at + 1);
+        }
+        set_detail::relocate(leaf->keys(), sibling->keys() + sibling->count, leaf->count);
+        at += sibling->count;
+        sibling->count += leaf->count;
+        leaf->count = 0;
+        unlink(leaf);
+        destroy(leaf);
+        parent->key(child - 1).~T();
+        erase_entry(parent, child - 1);
+        leaf = sibling;
+    } else {
+        if (separator != nullptr) {
+            set_detail::relocate(sibling->keys(), leaf->keys() + leaf->count, 1);
+            set_detail::relocate(sibling->keys() + 1, sibling->keys(), sibling->count - 1);
+            --sibling->count;
+            ++leaf->count;
+            parent->key(child).~T();
+            set_detail::relocate(separator, parent->keys() + child, 1);
+            return position(leaf, at);
+        }
+        set_detail::relocate(sibling->keys(), leaf->keys() + leaf->count, sibling->count);
+        leaf->count += sibling->count;
+        sibling->count = 0;
+        unlink(sibling);
+        destroy(sibling);
+        parent->key(child).~T();
+        erase_entry(parent, child);
+    }
+
+    rebalance(path, index, height_ - 1);
+    return position(leaf, at);
+}
+
+// Fixes inner nodes that lost a child, from path[level] up: rotate a key through the parent
+// when a sibling can spare one, merge with it otherwise. An empty root is dropped.
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+void Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::rebalance(Inner** path, std::size_t* index, unsigned level) {
+    for (;; --level) {
+        Inner* node = path[level];
+        if (level == 0) {
+            if (node->count == 0) {
+                root_ = node->children[0];
+                destroy(node);
+                --height_;
+            }
+            return;
+        }
+        if (node->count >= INNER_MIN)
+            return;
+
+        Inner* parent = path[level - 1];
+        std::size_t child = index[level - 1];
+        if (child > 0) {
+            Inner* left = static_cast<Inner*>(parent->children[child - 1]);
+            if (left->count > INNER_MIN) {
+                set_detail::relocate(node->keys(), node->keys() + 1, node->count);
+                std::copy_backward(node->children, node->children + node->count + 1, node->children + node->count + 2);
+                set_detail::relocate(parent->keys() + child - 1, node->keys(), 1);
+                node->children[0] = left->children[left->count];
+                set_detail::relocate(left->keys() + left->count - 1, parent->keys() + child - 1, 1);
+                --left->count;
+                ++node->count;
+                return;
+            }
+            set_detail::relocate(parent->keys() + child - 1, left->keys() + left->count, 1);
+            set_detail::relocate(node->keys(), left->keys() + left->count + 1, node->count);
+            std::copy(node->children, node->children + node->count + 1, left->children + left->count + 1);
+            left->count += node->count + 1;
+            node->count = 0;
+            destroy(node);
+            erase_entry(parent, child - 1);
+        } else {
+            Inner* right = static_cast<Inner*>(parent->children[1]);
+            if (right->count > INNER_MIN) {
+                set_detail::relocate(parent->keys(), node->keys() + node->count, 1);
+                node->children[node->count + 1] = right->children[0];
+                set_detail::relocate(right->keys(), parent->keys(), 1);
+                set_detail::relocate(right->keys() + 1, right->keys(), right->count - 1);
+                std::copy(right->children + 1, right->children + right->count + 1, right->children);
+                --right->count;
+                ++node->count;
+                return;
+            }
+            set_detail::relocate(parent->keys(), node->keys() + node->count, 1);
+            set_detail::relocate(right->keys(), node->keys() + node->count + 1, right->count);
+            std::copy(right->children, right->children + right->count + 1, node->children + node->count + 1);
+            node->count += right->count + 1;
+            right->count = 0;
+            destroy(right);
+            erase_entry(parent, 0);
+        }
+    }
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+typename Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::const_iterator
+Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::find(T const &element) const {
+    const_iterator it = lower_bound(element);
+    if (it == end() || compare_(element, *it))
+        return end();
+    return it;
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+typename Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::const_iterator
+Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::lower_bound(T const &element) const {
+    if (root_ == nullptr)
+        return end();
+    Inner* path[MAX_HEIGHT];
+    std::size_t index[MAX_HEIGHT];
+    Leaf* leaf = descend(element, path, index);
+    return position(leaf, search::lower(leaf->keys(), leaf->count, element, compare_));
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+typename Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::const_iterator
+Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::upper_bound(T const &element) const {
+    if (root_ == nullptr)
+        return end();
+    Inner* path[MAX_HEIGHT];
+    std::size_t index[MAX_HEIGHT];
+    Leaf* leaf = descend(element, path, index);
+    return position(leaf, search::upper(leaf->keys(), leaf->count, element, compare_));
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+std::pair<typename Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::const_iterator,
+          typename Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::const_iterator>
+Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::equal_range(T const &element) const {
+    const_iterator lower = lower_bound(element);
+    if (lower == end() || compare_(element, *lower))
+        return {lower, lower};
+    const_iterator upper = lower;
+    return {lower, ++upper};
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+template <typename Layout>
+FrozenSet<T, Compare, Layout> Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::freeze() const {
+    std::vector<T const*> sorted;
+    sorted.reserve(size_);
+    for (Leaf* leaf = first_; leaf != nullptr; leaf = leaf->next)
+        for (std::size_t i = 0; i < leaf->count; i++)
+            sorted.push_back(&leaf->key(i));
+
+    FrozenSet<T, Compare, Layout> frozen(compare_);
+    frozen.layout(sorted);
+    return frozen;
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+void Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::swap(Set &other) {
+    std::swap(root_, other.root_);
+    std::swap(first_, other.first_);
+    std::swap(last_, other.last_);
+    std::swap(size_, other.size_);
+    std::swap(height_, other.height_);
+    std::swap(compare_, other.compare_);
+    set_detail::swap_allocators(allocator_, other.allocator_,
+                                typename leaf_traits::propagate_on_container_swap());
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+template <typename V>
+struct Set<T, Compare, Allocator, BTreeBalance<NodeBytes>>::Iterator {
+    using iterator_category = std::bidirectional_iterator_tag;
+    using difference_type = std::ptrdiff_t;
+    using value_type = V;
+    using pointer = V*;
+    using reference = V&;
+
+    friend struct Set;
+    Iterator() : leaf(nullptr), index(0) {}
+    Iterator(Iterator const&) = default;
+    Iterator& operator=(Iterator const&) = default;
+
+    Iterator& operator++() {
+        if (++index == leaf->count && leaf->next != nullptr) {
+            leaf = leaf->next;
+            index = 0;
+        }
+        return *this;
+    }
+    const Iterator operator++(int) {
+        Iterator temp(*this);
+        ++*this;
+        return temp;
+    }
+    Iterator& operator--() {
+        if (index == 0) {
+            leaf = leaf->prev;
+            index = leaf->count;
+        }
+        --index;
+        return *this;
+    }
+    const Iterator operator--(int) {
+        Iterator temp(*this);
+        --*this;
+        return temp;
+    }
+
+    V& operator*() const { return leaf->key(index); }
+    V* operator->() const { return &leaf->key(index); }
+    friend bool operator==(Iterator const& first, Iterator const& second) {
+        return first.leaf == second.leaf && first.index == second.index;
+    }
+    friend bool operator!=(Iterator const& first, Iterator const& second) { return !(first == second); }
+
+private:
+    Iterator(Leaf const* leaf, std::size_t index) : leaf(const_cast<Leaf*>(leaf)), index(index) {}
+    Leaf* leaf;
+    std::size_t index;
+
+};
+
+#endif //SET_BTREESET_H
@@ -0,0 +1,113 @@
+#ifndef SET_BACKGROUNDRECLAIMER_H
+#define SET_BACKGROUNDRECLAIMER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace set_detail {
+
+// A single process-wide thread that runs teardown jobs handed over by containers, so that
+// freeing a huge structure does not stall the thread that dropped it. The thread starts with
+// the first job; at exit the queue is drained and the thread joined. Jobs submitted after
+// that (from static destructors) run inline.
+class BackgroundReclaimer {
+public:
+    static void submit(std::function<void()> job) {
+        if (shut_down().load(std::memory_order_acquire)) {
+            job();
+            return;
+        }
+        instance().push(std::move(job));
+    }
+
+    // Blocks until every job submitted so far has finished.
+    static void drain() {
+        if (shut_down().load(std::memory_order_acquire))
+            return;
+        BackgroundReclaimer& reclaimer = instance();
+        std::unique_lock<std::mutex> lock(reclaimer.mutex_);
+        reclaimer.idle_.wait(lock, [&reclaimer] { return reclaimer.jobs_.empty() && !reclaimer.busy_; });
+    }
+
+    // Jobs queued or running.
+    static std::size_t pending() {
+        if (shut_down().load(std::memory_order_acquire))
+            return 0;
+        BackgroundReclaimer& reclaimer = instance();
+        std::lock_guard<std::mutex> lock(reclaimer.mutex_);
+        return reclaimer.jobs_.size() + (reclaimer.busy_ ? 1 : 0);
+    }
+
+    BackgroundReclaimer(BackgroundReclaimer const&) = delete;
+    BackgroundReclaimer& operator=(BackgroundReclaimer const&) = delete;
+
+    ~BackgroundReclaimer() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        ready_.notify_one();
+        if (worker_.joinable())
+            worker_.join();
+        shut_down().store(true, std::memory_order_release);
+    }
+
+private:
+    BackgroundReclaimer() = default;
+
+    static BackgroundReclaimer& instance() {
+        static BackgroundReclaimer reclaimer;
+        return reclaimer;
+    }
+
+    static std::atomic<bool>& shut_down() {
+        static std::atomic<bool> flag(false);
+        return flag;
+    }
+
+    void push(std::function<void()> job) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!worker_.joinable())
+            worker_ = std::thread(&BackgroundReclaimer::run, this);
+        jobs_.push_back(std::move(job));
+        ready_.notify_one();
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            ready_.wait(lock, [this] { return stop_ || !jobs_.empty(); });
+            if (jobs_.empty()) {
+                idle_.notify_all();
+                return;
+            }
+
+            std::function<void()> job = std::move(jobs_.front());
+            jobs_.pop_front();
+            busy_ = true;
+            lock.unlock();
+            job();
+            lock.lock();
+            busy_ = false;
+            if (jobs_.empty())
+                idle_.notify_all();
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::condition_variable idle_;
+    std::deque<std::function<void()>> jobs_;
+    bool busy_ = false;
+    bool stop_ = false;
+    std::thread worker_;
+};
+
+}
+
+#endif //SET_BACKGROUNDRECLAIMER_H
@@ -0,0 +1,912 @@
+#ifndef SET_BALANCEPOLICY_H
+#define SET_BALANCEPOLICY_H
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+// A balance policy decides how Set<T, Policy> keeps its tree in shape. Nodes only expose
+// left, right, parent()/set_parent() and a two-bit tag() packed into the parent pointer;
+// the header node is the parent of the root (header->left == root, header->parent() == nullptr).
+//
+// Every policy provides:
+//     void after_insert(Node* header, Node* node);  // node was just linked in as a leaf, tag() == 0
+//     void after_access(Node* header, Node* node);  // node was found by a lookup
+//     void erase(Node* header, Node* node);         // unlink node and restore the invariants
+//     void after_build(Node* header, size_t size);  // the tree was replaced by build_balanced()
+//     void reset();                                 // the tree was emptied
+//     void join(Node* header, Node* left, Node* middle, Node* right);
+//                                                   // make header's tree of left < middle < right
+//     void after_join(Node* header);                // the tree was split or joined
+//
+// join gets two valid trees, either may be empty, whose parent pointers do not matter, and a
+// lone node between them. Split and join in Set are built on it, and so are its set
+// operations, which call join on disjoint trees from several threads at once: join must
+// not change the policy's own state.
+//
+// The calls are resolved at compile time, stateless policies cost nothing.
+//
+// Nodes may carry an augmentation (see OrderStatistics) that is recomputed from the children
+// by node->pull(); every helper here pulls the nodes whose subtrees it changes.
+
+namespace set_detail {
+
+template <typename Node>
+void replace_child(Node* parent, Node* old_child, Node* new_child) {
+    if (parent->left == old_child)
+        parent->left = new_child;
+    else parent->right = new_child;
+}
+
+template <typename Node>
+void rotate_left(Node* node) {
+    Node* pivot = node->right;
+    node->right = pivot->left;
+    if (pivot->left)
+        pivot->left->set_parent(node);
+
+    pivot->set_parent(node->parent());
+    replace_child(node->parent(), node, pivot);
+    pivot->left = node;
+    node->set_parent(pivot);
+    node->pull();
+    pivot->pull();
+}
+
+template <typename Node>
+void rotate_right(Node* node) {
+    Node* pivot = node->left;
+    node->left = pivot->right;
+    if (pivot->right)
+        pivot->right->set_parent(node);
+
+    pivot->set_parent(node->parent());
+    replace_child(node->parent(), node, pivot);
+    pivot->right = node;
+    node->set_parent(pivot);
+    node->pull();
+    pivot->pull();
+}
+
+template <typename Node>
+struct Unlinked {
+    Node* child;         // subtree that took the removed position, may be null
+    Node* parent;        // its parent
+    bool left;           // whether the removed position is the left child of parent
+    unsigned tag;        // tag of the removed position
+};
+
+template <typename Node>
+void pull_path(Node* node) {
+    if (!Node::augmented)
+        return;
+    for (; node->parent() != nullptr; node = node->parent())
+        node->pull();
+}
+
+template <typename Node>
+Unlinked<Node> unlink_impl(Node* node) {
+    Unlinked<Node> result;
+    if (node->left == nullptr || node->right == nullptr) {
+        result.child = node->left ? node->left : node->right;
+        result.parent = node->parent();
+        result.left = result.parent->left == node;
+        result.tag = node->tag();
+        if (result.child)
+            result.child->set_parent(result.parent);
+        replace_child(result.parent, node, result.child);
+        return result;
+    }
+
+    Node* next = node->right;
+    while (next->left != nullptr)
+        next = next->left;
+
+    result.child = next->right;
+    result.tag = next->tag();
+    if (next == node->right) {
+        result.parent = next;
+        result.left = false;
+    } else {
+        result.parent = next->parent();
+        result.left = true;
+        result.parent->left = result.child;
+        if (result.child)
+            result.child->set_parent(result.parent);
+        next->right = node->right;
+        node->right->set_parent(next);
+    }
+
+    next->left = node->left;
+    node->left->set_parent(next);
+    replace_child(node->parent(), node, next);
+    next->set_parent(node->parent());
+    next->set_tag(node->tag());
+    return result;
+}
+
+// Unlinks a node with the plain BST rule. A node with two children is replaced by its
+// in-order successor, which inherits the node's tag, so no value is ever moved.
+template <typename Node>
+Unlinked<Node> unlink(Node* node) {
+    Unlinked<Node> result = unlink_impl(node);
+    pull_path(result.parent);
+    return result;
+}
+
+template <typename Node>
+std::size_t subtree_size(Node* node) {
+    return node == nullptr ? 0 : 1 + subtree_size(node->left) + subtree_size(node->right);
+}
+
+// Turns a subtree into a list linked through right pointers, in order, without allocating.
+template <typename Node>
+std::size_t flatten(Node* root, Node*& head) {
+    Node pseudo;
+    pseudo.right = root;
+    Node* tail = &pseudo;
+    Node* rest = root;
+    std::size_t count = 0;
+
+    while (rest != nullptr) {
+        if (rest->left != nullptr) {
+            Node* left = rest->left;
+            rest->left = left->right;
+            left->right = rest;
+            rest = left;
+            tail->right = left;
+        } else {
+            tail = rest;
+            rest = rest->right;
+            ++count;
+        }
+    }
+
+    head = pseudo.right;
+    return count;
+}
+
+// Builds a perfectly balanced tree from the first count nodes of a right-linked list.
+// All levels but the deepest one are full, the tags are cleared.
+template <typename Node>
+Node* build_balanced(Node*& list, std::size_t count) {
+    if (count == 0)
+        return nullptr;
+
+    Node* left = build_balanced(list, (count - 1) / 2);
+    Node* root = list;
+    list = list->right;
+
+    root->set_tag(0);
+    root->left = left;
+    if (left)
+        left->set_parent(root);
+    Node* right = build_balanced(list, count - 1 - (count - 1) / 2);
+    root->right = right;
+    if (right)
+        right->set_parent(root);
+    root->pull();
+    return root;
+}
+
+template <typename Node>
+void pull_subtree(Node* node) {
+    if (!Node::augmented || node == nullptr)
+        return;
+    pull_subtree(node->left);
+    pull_subtree(node->right);
+    node->pull();
+}
+
+// Puts middle, with left and right as its subtrees, in the left or right slot of parent.
+template <typename Node>
+void attach(Node* parent, bool as_left, Node* left, Node* middle, Node* right) {
+    middle->left = left;
+    middle->right = right;
+    if (left)
+        left->set_parent(middle);
+    if (right)
+        right->set_parent(middle);
+    middle->pull();
+    if (as_left)
+        parent->left = middle;
+    else parent->right = middle;
+    middle->set_parent(parent);
+}
+
+// Returns the size of the subtree.
+template <typename Node>
+std::size_t rebuild(Node* root) {
+    Node* parent = root->parent();
+    Node* list;
+    std::size_t count = flatten(root, list);
+    Node* new_root = build_balanced(list, count);
+    replace_child(parent, root, new_root);
+    new_root->set_parent(parent);
+    return count;
+}
+
+// Node base holding the augmentation, empty unless the policy asks for subtree sizes.
+template <bool Sized>
+struct SubtreeSize {
+    static const bool augmented = false;
+
+    template <typename Node>
+    void pull_size(Node*, Node*) {}
+    void copy_size(SubtreeSize const&) {}
+};
+
+template <>
+struct SubtreeSize<true> {
+    static const bool augmented = true;
+    std::size_t size = 1;
+
+    template <typename Node>
+    void pull_size(Node* left, Node* right) {
+        size = 1 + (left ? left->size : 0) + (right ? right->size : 0);
+    }
+    void copy_size(SubtreeSize const& other) { size = other.size; }
+};
+
+}
+
+struct RedBlackBalance {
+    template <typename Node>
+    void after_insert(Node* header, Node* node);
+    template <typename Node>
+    void after_access(Node*, Node*) {}
+    template <typename Node>
+    void erase(Node* header, Node* node);
+    template <typename Node>
+    void after_build(Node* header, std::size_t size);
+    void reset() {}
+    template <typename Node>
+    void join(Node* header, Node* left, Node* middle, Node* right);
+    template <typename Node>
+    void after_join(Node*) {}
+
+private:
+    static const unsigned RED = 1;
+
+    template <typename Node>
+    static void paint(Node* node, std::size_t depth, std::size_t red_depth);
+
+    template <typename Node>
+    static bool is_red(Node* node) { return node != nullptr && node->tag() == RED; }
+    template <typename Node>
+    static std::size_t black_height(Node* node);
+};
+
+// Balance factor in the tag: 0 balanced, LEFT/RIGHT when that subtree is one level higher.
+struct AvlBalance {
+    template <typename Node>
+    void after_insert(Node* header, Node* node);
+    template <typename Node>
+    void after_access(Node*, Node*) {}
+    template <typename Node>
+    void erase(Node* header, Node* node);
+    template <typename Node>
+    void after_build(Node* header, std::size_t) { set_balance(header->left); }
+    void reset() {}
+    template <typename Node>
+    void join(Node* header, Node* left, Node* middle, Node* right);
+    template <typename Node>
+    void after_join(Node*) {}
+
+private:
+    static const unsigned BALANCED = 0;
+    static const unsigned LEFT = 1;
+    static const unsigned RIGHT = 2;
+
+    template <typename Node>
+    static Node* rotate_twice(Node* node, bool left_heavy);
+    template <typename Node>
+    static std::size_t set_balance(Node* node);
+    template <typename Node>
+    static std::size_t height(Node* node);
+    template <typename Node>
+    static void grow(Node* header, Node* child);
+};
+
+// Priorities are a hash of the node address, so a treap needs no per-node storage.
+struct TreapBalance {
+    template <typename Node>
+    void after_insert(Node* header, Node* node);
+    template <typename Node>
+    void after_access(Node*, Node*) {}
+    template <typename Node>
+    void erase(Node* header, Node* node);
+    template <typename Node>
+    void after_build(Node* header, std::size_t size);
+    void reset() {}
+    template <typename Node>
+    void join(Node* header, Node* left, Node* middle, Node* right);
+    template <typename Node>
+    void after_join(Node*) {}
+
+    static std::uint64_t priority(void const* node) {
+        std::uint64_t x = reinterpret_cast<std::uintptr_t>(node);
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdULL;
+        x ^= x >> 33;
+        x *= 0xc4ceb9fe1a85ec53ULL;
+        x ^= x >> 33;
+        return x;
+    }
+};
+
+// Keeps no per-node data: a too deep insertion rebuilds the smallest alpha-unbalanced
+// ancestor (alpha = 2/3), and erasing down to 2/3 of the historical maximum rebuilds the tree.
+// Without subtree sizes a join cannot tell how unbalanced it is, so split and join rebuild
+// the whole tree once they are done, in O(n).
+struct ScapegoatBalance {
+    template <typename Node>
+    void after_insert(Node* header, Node* node);
+    template <typename Node>
+    void after_access(Node*, Node*) {}
+    template <typename Node>
+    void erase(Node* header, Node* node);
+    template <typename Node>
+    void after_build(Node*, std::size_t size) { size_ = max_size_ = size; }
+    void reset() { size_ = max_size_ = 0; }
+    template <typename Node>
+    void join(Node* header, Node* left, Node* middle, Node* right) { set_detail::attach(header, true, left, middle, right); }
+    template <typename Node>
+    void after_join(Node* header);
+
+private:
+    std::size_t size_ = 0;
+    std::size_t max_size_ = 0;
+};
+
+// Moves every inserted or found node to the root.
+struct SplayBalance {
+    template <typename Node>
+    void after_insert(Node* header, Node* node) { splay(header, node); }
+    template <typename Node>
+    void after_access(Node* header, Node* node) { splay(header, node); }
+    template <typename Node>
+    void erase(Node* header, Node* node);
+    template <typename Node>
+    void after_build(Node*, std::size_t) {}
+    void reset() {}
+    // the next access splays whatever sits deep
+    template <typename Node>
+    void join(Node* header, Node* left, Node* middle, Node* right) { set_detail::attach(header, true, left, middle, right); }
+    template <typename Node>
+    void after_join(Node*) {}
+
+private:
+    template <typename Node>
+    static void splay(Node* top, Node* node);
+};
+
+template <typename Node>
+void RedBlackBalance::after_insert(Node* header, Node* node) {
+    node->set_tag(RED);
+
+    while (node != header->left && is_red(node->parent())) {
+        Node* parent = node->parent();
+        Node* grand = parent->parent();
+
+        if (parent == grand->left) {
+            Node* uncle = grand->right;
+            if (is_red(uncle)) {
+                parent->set_tag(0);
+                uncle->set_tag(0);
+                grand->set_tag(RED);
+                node = grand;
+            } else {
+                if (node == parent->right) {
+                    set_detail::rotate_left(parent);
+                    std::swap(node, parent);
+                }
+                parent->set_tag(0);
+                grand->set_tag(RED);
+                set_detail::rotate_right(grand);
+            }
+        } else {
+            Node* uncle = grand->left;
+            if (is_red(uncle)) {
+                parent->set_tag(0);
+                uncle->set_tag(0);
+                grand->set_tag(RED);
+                node = grand;
+            } else {
+                if (node == parent->left) {
+                    set_detail::rotate_right(parent);
+                    std::swap(node, parent);
+                }
+                parent->set_tag(0);
+                grand->set_tag(RED);
+                set_detail::rotate_left(grand);
+            }
+        }
+    }
+
+    header->left->set_tag(0);
+}
+
+// With both roots black, the lower tree is hung, under a red middle, in place of the first
+// black node of the same black height on the inner spine of the higher one. Only a red-red
+// edge can be wrong then, and the insertion fix-up repairs it: O(difference of the heights).
+template <typename Node>
+void RedBlackBalance::join(Node* header, Node* left, Node* middle, Node* right) {
+    if (is_red(left))
+        left->set_tag(0);
+    if (is_red(right))
+        right->set_tag(0);
+    std::size_t left_height = black_height(left);
+    std::size_t right_height = black_height(right);
+    bool into_left = left_height >= right_height;
+    std::size_t height = into_left ? left_height : right_height;
+    std::size_t target = into_left ? right_height : left_height;
+
+    Node* parent = header;
+    Node* node = into_left ? left : right;
+    header->left = node;
+    if (node)
+        node->set_parent(header);
+    while (node != nullptr && (is_red(node) || height != target)) {
+        if (!is_red(node))
+            --height;
+        parent = node;
+        node = into_left ? node->right : node->left;
+    }
+
+    if (into_left)
+        set_detail::attach(parent, parent == header, node, middle, right);
+    else set_detail::attach(parent, true, left, middle, node);
+    set_detail::pull_path(parent);
+    after_insert(header, middle);
+}
+
+template <typename Node>
+std::size_t RedBlackBalance::black_height(Node* node) {
+    std::size_t height = 0;
+    for (; node != nullptr; node = node->left)
+        height += !is_red(node);
+    return height;
+}
+
+template <typename Node>
+void RedBlackBalance::erase(Node* header, Node* node) {
+    set_detail::Unlinked<Node> removed = set_detail::unlink(node);
+    if (removed.tag == RED)
+        return;
+
+    Node* child = removed.child;
+    Node* parent = removed.parent;
+    bool left = removed.left;
+    while (child != header->left && !is_red(child)) {
+        if (left) {
+            Node* sibling = parent->right;
+            if (is_red(sibling)) {
+                sibling->set_tag(0);
+                parent->set_tag(RED);
+                set_detail::rotate_left(parent);
+                sibling = parent->right;
+            }
+
+            if (!is_red(sibling->left) && !is_red(sibling->right)) {
+                sibling->set_tag(RED);
+                child = parent;
+            } else {
+                if (!is_red(sibling->right)) {
+                    sibling->left->set_tag(0);
+                    sibling->set_tag(RED);
+                    set_detail::rotate_right(sibling);
+                    sibling = parent->right;
+                }
+                sibling->set_tag(parent->tag());
+                parent->set_tag(0);
+                sibling->right->set_tag(0);
+                set_detail::rotate_left(parent);
+                child = header->left;
+            }
+        } else {
+            Node* sibling = parent->left;
+            if (is_red(sibling)) {
+                sibling->set_tag(0);
+                parent->set_tag(RED);
+                set_detail::rotate_right(parent);
+                sibling = parent->left;
+            }
+
+            if (!is_red(sibling->left) && !is_red(sibling->right)) {
+                sibling->set_tag(RED);
+                child = parent;
+            } else {
+                if (!is_red(sibling->left)) {
+                    sibling->right->set_tag(0);
+                    sibling->set_tag(RED);
+                    set_detail::rotate_left(sibling);
+                    sibling = parent->left;
+                }
+                sibling->set_tag(parent->tag());
+                parent->set_tag(0);
+                sibling->left->set_tag(0);
+                set_detail::rotate_right(parent);
+                child = header->left;
+            }
+        }
+
+        parent = child->parent();
+        left = parent->left == child;
+    }
+
+    if (child)
+        child->set_tag(0);
+}
+
+// In a tree whose levels are all full but the deepest one, colouring exactly the deepest
+// level red gives every path the same number of black nodes.
+template <typename Node>
+void RedBlackBalance::after_build(Node* header, std::size_t size) {
+    std::size_t depth = 0;
+    while ((std::size_t(2) << depth) <= size)
+        ++depth;
+    paint(header->left, 0, depth);
+    if (header->left)
+        header->left->set_tag(0);
+}
+
+template <typename Node>
+void RedBlackBalance::paint(Node* node, std::size_t depth, std::size_t red_depth) {
+    if (node == nullptr)
+        return;
+    node->set_tag(depth == red_depth ? RED : 0);
+    paint(node->left, depth + 1, red_depth);
+    paint(node->right, depth + 1, red_depth);
+}
+
+// Rotates the heavy child's inner grandchild up to the place of node and returns it.
+template <typename Node>
+Node* AvlBalance::rotate_twice(Node* node, bool left_heavy) {
+    Node* child = left_heavy ? node->left : node->right;
+    Node* grand = left_heavy ? child->right : child->left;
+    unsigned grand_balance = grand->tag();
+
+    if (left_heavy) {
+        set_detail::rotate_left(child);
+        set_detail::rotate_right(node);
+        node->set_tag(grand_balance == LEFT ? RIGHT : BALANCED);
+        child->set_tag(grand_balance == RIGHT ? LEFT : BALANCED);
+    } else {
+        set_detail::rotate_right(child);
+        set_detail::rotate_left(node);
+        node->set_tag(grand_balance == RIGHT ? LEFT : BALANCED);
+        child->set_tag(grand_balance == LEFT ? RIGHT : BALANCED);
+    }
+    grand->set_tag(BALANCED);
+    return grand;
+}
+
+// Returns the height of the subtree.
+template <typename Node>
+std::size_t AvlBalance::set_balance(Node* node) {
+    if (node == nullptr)
+        return 0;
+    std::size_t left = set_balance(node->left);
+    std::size_t right = set_balance(node->right);
+    node->set_tag(left == right ? BALANCED : left > right ? LEFT : RIGHT);
+    return 1 + (left > right ? left : right);
+}
+
+template <typename Node>
+void AvlBalance::after_insert(Node* header, Node* node) {
+    grow(header, node);
+}
+
+// The subtree of child just got one level higher: walk up until some ancestor absorbs it.
+template <typename Node>
+void AvlBalance::grow(Node* header, Node* child) {
+    Node* parent = child->parent();
+
+    while (parent != header) {
+        bool left = parent->left == child;
+        unsigned grown = left ? LEFT : RIGHT;
+        unsigned other = left ? RIGHT : LEFT;
+
+        if (parent->tag() == other) {
+            parent->set_tag(BALANCED);
+            return;
+        }
+        if (parent->tag() == BALANCED) {
+            parent->set_tag(grown);
+            child = parent;
+            parent = parent->parent();
+            continue;
+        }
+
+        if (child->tag() == other) {
+            rotate_twice(parent, left);
+            return;
+        }
+        if (left)
+            set_detail::rotate_right(parent);
+        else set_detail::rotate_left(parent);
+        if (child->tag() == grown) {
+            parent->set_tag(BALANCED);
+            child->set_tag(BALANCED);
+            return;
+        }
+        // a balanced child, which only a join makes: the rotated subtree is still one higher
+        parent->set_tag(grown);
+        child->set_tag(other);
+        parent = child->parent();
+    }
+}
+
+// The lower tree goes, under middle, in place of the first node on the inner spine of the
+// higher one that is at most one level above it; then that position grew by one level.
+template <typename Node>
+void AvlBalance::join(Node* header, Node* left, Node* middle, Node* right) {
+    std::size_t left_height = height(left);
+    std::size_t right_height = height(right);
+    if (left_height <= right_height + 1 && right_height <= left_height + 1) {
+        set_detail::attach(header, true, left, middle, right);
+        middle->set_tag(left_height == right_height ? BALANCED : left_height > right_height ? LEFT : RIGHT);
+        return;
+    }
+
+    bool into_left = left_height > right_height;
+    std::size_t node_height = into_left ? left_height : right_height;
+    std::size_t target = into_left ? right_height : left_height;
+    unsigned outer = into_left ? LEFT : RIGHT;
+    Node* parent = header;
+    Node* node = into_left ? left : right;
+    header->left = node;
+    node->set_parent(header);
+    while (node_height > target + 1) {
+        node_height -= node->tag() == outer ? 2 : 1;
+        parent = node;
+        node = into_left ? node->right : node->left;
+    }
+
+    unsigned tilt = node_height == target ? BALANCED : outer;
+    if (into_left)
+        set_detail::attach(parent, parent == header, node, middle, right);
+    else set_detail::attach(parent, true, left, middle, node);
+    middle->set_tag(tilt);
+    set_detail::pull_path(parent);
+    grow(header, middle);
+}
+
+template <typename Node>
+std::size_t AvlBalance::height(Node* node) {
+    std::size_t result = 0;
+    for (; node != nullptr; node = node->tag() == LEFT ? node->left : node->right)
+        ++result;
+    return result;
+}
+
+template <typename Node>
+void AvlBalance::erase(Node* header, Node* node) {
+    set_detail::Unlinked<Node> removed = set_detail::unlink(node);
+    Node* parent = removed.parent;
+    bool left = removed.left;
+
+    while (parent != header) {
+        unsigned shrunk = left ? LEFT : RIGHT;
+        unsigned other = left ? RIGHT : LEFT;
+        Node* top;
+
+        if (parent->tag() == shrunk) {
+            parent->set_tag(BALANCED);
+            top = parent;
+        } else if (parent->tag() == BALANCED) {
+            parent->set_tag(other);
+            return;
+        } else {
+            Node* sibling = left ? parent->right : parent->left;
+            if (sibling->tag() == shrunk) {
+                top = rotate_twice(parent, !left);
+            } else {
+                if (left)
+                    set_detail::rotate_left(parent);
+                else set_detail::rotate_right(parent);
+
+                if (sibling->tag() == BALANCED) {
+                    parent->set_tag(other);
+                    sibling->set_tag(shrunk);
+                    return;
+                }
+                parent->set_tag(BALANCED);
+                sibling->set_tag(BALANCED);
+                top = sibling;
+            }
+        }
+
+        parent = top->parent();
+        left = parent->left == top;
+    }
+}
+
+template <typename Node>
+void TreapBalance::after_insert(Node* header, Node* node) {
+    while (node->parent() != header && priority(node) > priority(node->parent())) {
+        if (node == node->parent()->left)
+            set_detail::rotate_right(node->parent());
+        else set_detail::rotate_left(node->parent());
+    }
+}
+
+// middle starts at the root and sinks below every child of a higher priority.
+template <typename Node>
+void TreapBalance::join(Node* header, Node* left, Node* middle, Node* right) {
+    set_detail::attach(header, true, left, middle, right);
+    while (true) {
+        Node* child = middle->left;
+        if (middle->right != nullptr && (child == nullptr || priority(middle->right) > priority(child)))
+            child = middle->right;
+        if (child == nullptr || priority(child) < priority(middle))
+            break;
+        if (child == middle->left)
+            set_detail::rotate_right(middle);
+        else set_detail::rotate_left(middle);
+    }
+}
+
+template <typename Node>
+void TreapBalance::erase(Node*, Node* node) {
+    while (node->left != nullptr && node->right != nullptr) {
+        if (priority(node->left) > priority(node->right))
+            set_detail::rotate_right(node);
+        else set_detail::rotate_left(node);
+    }
+    set_detail::unlink(node);
+}
+
+// A balanced tree is no heap on the priorities: rebuild it as the Cartesian tree of its
+// in-order sequence in O(n), keeping the current right spine on the parent pointers.
+template <typename Node>
+void TreapBalance::after_build(Node* header, std::size_t) {
+    Node* list;
+    set_detail::flatten(header->left, list);
+
+    Node* root = nullptr;
+    Node* last = nullptr;
+    while (list != nullptr) {
+        Node* node = list;
+        list = list->right;
+        node->left = node->right = nullptr;
+
+        Node* child = nullptr;
+        while (last != nullptr && priority(last) < priority(node)) {
+            child = last;
+            last = last->parent();
+        }
+
+        node->left = child;
+        if (child)
+            child->set_parent(node);
+        node->set_parent(last);
+        if (last)
+            last->right = node;
+        else root = node;
+        last = node;
+    }
+
+    header->left = root;
+    if (root)
+        root->set_parent(header);
+    set_detail::pull_subtree(root);
+}
+
+template <typename Node>
+void ScapegoatBalance::after_insert(Node* header, Node* node) {
+    ++size_;
+    if (size_ > max_size_)
+        max_size_ = size_;
+
+    std::size_t depth = 0;
+    for (Node* it = node; it->parent() != header; it = it->parent())
+        ++depth;
+    if (depth <= std::log(static_cast<double>(size_)) / std::log(1.5))
+        return;
+
+    std::size_t size = 1;
+    Node* child = node;
+    while (child->parent() != header) {
+        Node* parent = child->parent();
+        Node* sibling = parent->left == child ? parent->right : parent->left;
+        std::size_t parent_size = size + 1 + set_detail::subtree_size(sibling);
+        if (3 * size > 2 * parent_size) {
+            set_detail::rebuild(parent);
+            return;
+        }
+        size = parent_size;
+        child = parent;
+    }
+}
+
+template <typename Node>
+void ScapegoatBalance::erase(Node* header, Node* node) {
+    set_detail::unlink(node);
+    --size_;
+    if (size_ == 0) {
+        max_size_ = 0;
+    } else if (3 * size_ <= 2 * max_size_) {
+        set_detail::rebuild(header->left);
+        max_size_ = size_;
+    }
+}
+
+// the rebuild counts the nodes on the way
+template <typename Node>
+void ScapegoatBalance::after_join(Node* header) {
+    size_ = max_size_ = header->left != nullptr ? set_detail::rebuild(header->left) : 0;
+}
+
+// Rotates node up until its parent is top.
+template <typename Node>
+void SplayBalance::splay(Node* top, Node* node) {
+    while (node->parent() != top) {
+        Node* parent = node->parent();
+        Node* grand = parent->parent();
+        bool left = parent->left == node;
+
+        if (grand == top) {
+            if (left)
+                set_detail::rotate_right(parent);
+            else set_detail::rotate_left(parent);
+        } else if (left == (grand->left == parent)) {
+            if (left) {
+                set_detail::rotate_right(grand);
+                set_detail::rotate_right(parent);
+            } else {
+                set_detail::rotate_left(grand);
+                set_detail::rotate_left(parent);
+            }
+        } else if (left) {
+            set_detail::rotate_right(parent);
+            set_detail::rotate_left(grand);
+        } else {
+            set_detail::rotate_left(parent);
+            set_detail::rotate_right(grand);
+        }
+    }
+}
+
+template <typename Node>
+void SplayBalance::erase(Node* header, Node* node) {
+    splay(header, node);
+    if (node->left == nullptr) {
+        header->left = node->right;
+        if (node->right)
+            node->right->set_parent(header);
+        return;
+    }
+
+    Node* max = node->left;
+    while (max->right != nullptr)
+        max = max->right;
+    splay(node, max);
+
+    max->right = node->right;
+    if (node->right)
+        node->right->set_parent(max);
+    max->pull();
+    header->left = max;
+    max->set_parent(header);
+}
+
+// Keeps the size of every subtree in its root, on top of any other policy. This costs a word
+// per node and enables Set::rank, Set::nth and Set::count_range in O(log n).
+template <typename Balance>
+struct OrderStatistics : Balance {};
+
+namespace set_detail {
+
+template <typename Balance>
+struct has_subtree_size : std::false_type {};
+
+template <typename Balance>
+struct has_subtree_size<OrderStatistics<Balance>> : std::true_type {};
+
+}
+
+#endif //SET_BALANCEPOLICY_H
@@ -0,0 +1,738 @@
+#ifndef SET_CONCURRENTSET_H
+#define SET_CONCURRENTSET_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "EpochReclaimer.h"
+
+// A set for many threads at once: insert, erase, contains and lower_bound are linearizable
+// and may be called concurrently from any thread, no external lock needed.
+//
+// It is a B+-tree with optimistic lock coupling (Leis et al., "The ART of practical
+// synchronization"). Every node has a version lock, a counter that writers make odd while
+// they change the node. Readers take no locks at all: they note the version of each node
+// before reading it and check it is unchanged before they trust what they read, restarting
+// from the root otherwise; a reader therefore never makes a writer wait. Writers descend
+// the same way and lock only the nodes they change, a leaf, or a node being split or merged
+// and its parent. Full nodes are split on the way down to an insert, and an erase merges an
+// underfull node with a sibling on its way down, so neither has to go back up; a lock is
+// only ever tried, never waited for, so there are no deadlocks.
+//
+// A node merged away is marked obsolete, which sends whoever still reads it back to the
+// root, and goes to the set's EpochReclaimer. Every call pins the epoch, so the node is only
+// freed once no thread can still be looking at it.
+//
+// Keys are read while writers may be changing them, so T must be trivially copyable; they
+// are kept in atomics, and T needs no default constructor. Compare and the allocator are
+// used from several threads at once.
+template <typename T, typename Compare = std::less<T>, typename Allocator = std::allocator<T>,
+          std::size_t NodeBytes = 256>
+struct ConcurrentSet {
+    static_assert(std::is_trivially_copyable<T>::value, "keys are read while they may be written");
+
+private:
+    struct Key;
+    struct Node;
+    struct Leaf;
+    struct Inner;
+    using leaf_allocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Leaf>;
+    using inner_allocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Inner>;
+    using leaf_traits = std::allocator_traits<leaf_allocator>;
+    using inner_traits = std::allocator_traits<inner_allocator>;
+public:
+
+    using value_type = T;
+    using key_type = T;
+    using key_compare = Compare;
+    using value_compare = Compare;
+    using allocator_type = Allocator;
+    using size_type = std::size_t;
+
+    explicit ConcurrentSet(Compare const& compare = Compare(), Allocator const& allocator = Allocator());
+    ConcurrentSet(ConcurrentSet const&) = delete;
+    ConcurrentSet& operator=(ConcurrentSet const&) = delete;
+    ~ConcurrentSet();
+
+    bool insert(T const& element);
+    bool erase(T const& element);
+    bool contains(T const& element) const;
+    // The least element not less than element, if there is one.
+    bool lower_bound(T const& element, T& result) const;
+
+    // exact when no update is running
+    size_type size() const { return size_.load(std::memory_order_relaxed); }
+    bool empty() const { return size() == 0; }
+
+    allocator_type get_allocator() const { return allocator_type(leaf_allocator_); }
+    key_compare key_comp() const { return compare_; }
+    value_compare value_comp() const { return compare_; }
+
+private:
+    static constexpr std::size_t capacity(std::size_t header, std::size_t per_key) {
+        return NodeBytes > header + 4 * per_key ? (NodeBytes - header) / per_key : 4;
+    }
+
+    static constexpr std::size_t LEAF_CAPACITY = capacity(3 * sizeof(std::uint64_t), sizeof(T));
+    static constexpr std::size_t INNER_CAPACITY = capacity(3 * sizeof(std::uint64_t), sizeof(T) + sizeof(void*));
+    // a node with fewer keys is merged with a sibling when they fit in one
+    static constexpr std::size_t LEAF_MIN = LEAF_CAPACITY / 4;
+    static constexpr std::size_t INNER_MIN = INNER_CAPACITY / 4;
+    // the low bit of a version is set while the node is locked, the high one once it is
+    // out of the tree
+    static const std::uint64_t LOCKED = 1;
+    static const std::uint64_t OBSOLETE = std::uint64_t(1) << 63;
+    // how far a reader follows empty leaves with the versions on the stack
+    static const std::size_t VISITED = 16;
+
+    enum Outcome { NO, YES, RESTART };
+
+    std::atomic<Node*> root_;
+    std::atomic<size_type> size_{0};
+    Compare compare_;
+    mutable leaf_allocator leaf_allocator_;
+    mutable inner_allocator inner_allocator_;
+    // after the allocators: it frees the nodes still retired when it goes
+    mutable EpochReclaimer reclaimer_{64, 4096, EpochReclaimer::GROW};
+
+    static bool read_lock(Node* node, std::uint64_t& version);
+    static bool validate(Node* node, std::uint64_t version);
+    static bool upgrade(Node* node, std::uint64_t version);
+    static void unlock(Node* node);
+    static void unlock_obsolete(Node* node);
+    static void backoff(unsigned attempt);
+
+    std::size_t leaf_position(Leaf* leaf, T const& element, std::size_t count) const;
+    std::size_t child_position(Inner* inner, T const& element, std::size_t count) const;
+    Leaf* find_leaf(T const& element, std::uint64_t& version) const;
+    Leaf* find_leaf_merging(T const& element, std::uint64_t& version);
+
+    Outcome try_insert(T const& element);
+    Outcome try_erase(T const& element, bool& underfull);
+    Outcome try_contains(T const& element) const;
+    Outcome try_lower_bound(T const& element, T& result) const;
+    void split(Node* node, Inner* parent);
+    void link(Inner* parent, T const& separator, Node* right);
+    Outcome try_merge(Inner* parent, std::uint64_t parent_version, std::size_t position, Node* child,
+                      std::uint64_t child_version);
+    void merge(Inner* parent, std::size_t position, Node* left, Node* right);
+    void collapse_root(Inner* root, std::uint64_t version);
+    Leaf* new_leaf();
+    Inner* new_inner();
+    void destroy(Node* node);
+    void free_node(Node* node);
+    void retire(Node* node);
+    static void free_retired(void* node, void* set);
+};
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+constexpr std::size_t ConcurrentSet<T, Compare, Allocator, NodeBytes>::LEAF_CAPACITY;
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+constexpr std::size_t ConcurrentSet<T, Compare, Allocator, NodeBytes>::INNER_CAPACITY;
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+constexpr std::size_t ConcurrentSet<T, Compare, Allocator, NodeBytes>::LEAF_MIN;
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+constexpr std::size_t ConcurrentSet<T, Compare, Allocator, NodeBytes>::INNER_MIN;
+
+// A key slot; std::atomic<T> itself would need T to be default constructible.
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+struct ConcurrentSet<T, Compare, Allocator, NodeBytes>::Key {
+    union Value {
+        Value() {}
+        explicit Value(T const& key) : key(key) {}
+        T key;
+    };
+
+    T load(std::memory_order order) const { return value.load(order).key; }
+    void store(T const& key, std::memory_order order) { value.store(Value(key), order); }
+
+    std::atomic<Value> value;
+};
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+struct ConcurrentSet<T, Compare, Allocator, NodeBytes>::Node {
+    explicit Node(bool leaf) : leaf(leaf) {}
+
+    std::atomic<std::uint64_t> version{0};
+    std::atomic<std::size_t> count{0};
+    bool const leaf;
+};
+
+// Leaves are linked left to right for lower_bound.
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+struct ConcurrentSet<T, Compare, Allocator, NodeBytes>::Leaf : Node {
+    Leaf() : Node(true) {}
+
+    std::atomic<Leaf*> next{nullptr};
+    Key keys[LEAF_CAPACITY];
+};
+
+// children[i] holds the keys from keys[i - 1] up to, not including, keys[i].
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+struct ConcurrentSet<T, Compare, Allocator, NodeBytes>::Inner : Node {
+    Inner() : Node(false) {}
+
+    Key keys[INNER_CAPACITY];
+    std::atomic<Node*> children[INNER_CAPACITY + 1];
+};
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+ConcurrentSet<T, Compare, Allocator, NodeBytes>::ConcurrentSet(Compare const& compare, Allocator const& allocator)
+        : compare_(compare), leaf_allocator_(allocator), inner_allocator_(allocator) {
+    root_.store(new_leaf(), std::memory_order_relaxed);
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+ConcurrentSet<T, Compare, Allocator, NodeBytes>::~ConcurrentSet() {
+    destroy(root_.load(std::memory_order_relaxed));
+}
+
+// The nodes in the tree; the ones merged away go with reclaimer_.
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+void ConcurrentSet<T, Compare, Allocator, NodeBytes>::destroy(Node *node) {
+    if (!node->leaf) {
+        Inner* inner = static_cast<Inner*>(node);
+        std::size_t count = inner->count.load(std::memory_order_relaxed);
+        for (std::size_t i = 0; i <= count; i++)
+            destroy(inner->children[i].load(std::memory_order_relaxed));
+    }
+    free_node(node);
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+void ConcurrentSet<T, Compare, Allocator, NodeBytes>::free_node(Node *node) {
+    if (node->leaf) {
+        Leaf* leaf = static_cast<Leaf*>(node);
+        leaf_traits::destroy(leaf_allocator_, leaf);
+        leaf_traits::deallocate(leaf_allocator_, leaf, 1);
+    } else {
+        Inner* inner = static_cast<Inner*>(node);
+        inner_traits::destroy(inner_allocator_, inner);
+        inner_traits::deallocate(inner_allocator_, inner, 1);
+    }
+}
+
+// node is out of the tree and marked obsolete; threads pinned now may still read it.
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+void ConcurrentSet<T, Compare, Allocator, NodeBytes>::retire(Node *node) {
+    reclaimer_.retire(node, &free_retired, this);
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+void ConcurrentSet<T, Compare, Allocator, NodeBytes>::free_retired(void *node, void *set) {
+    static_cast<ConcurrentSet*>(set)->free_node(static_cast<Node*>(node));
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+typename ConcurrentSet<T, Compare, Allocator, NodeBytes>::Leaf* ConcurrentSet<T, Compare, Allocator, NodeBytes>::new_leaf() {
+    Leaf* leaf = leaf_traits::allocate(leaf_allocator_, 1);
+    leaf_traits::construct(leaf_allocator_, leaf);
+    return leaf;
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+typename ConcurrentSet<T, Compare, Allocator, NodeBytes>::Inner* ConcurrentSet<T, Compare, Allocator, NodeBytes>::new_inner() {
+    Inner* inner = inner_traits::allocate(inner_allocator_, 1);
+    inner_traits::construct(inner_allocator_, inner);
+    return inner;
+}
+
+// The version of node, false if it is locked right now or out of the tree.
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+bool ConcurrentSet<T, Compare, Allocator, NodeBytes>::read_lock(Node *node, std::uint64_t& version) {
+    version = node->version.load(std::memory_order_acquire);
+    return (version & (LOCKED | OBSOLETE)) == 0;
+}
+
+// Whether node is unchanged since version was read, and with it everything read from it.
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+bool ConcurrentSet<T, Compare, Allocator, NodeBytes>::validate(Node *node, std::uint64_t version) {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return node->version.load(std::memory_order_relaxed) == version;
+}
+
+// Locks node if it is still at version. The fence orders the writes that follow after the
+// lock for readers, who check the version after their reads.
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+bool ConcurrentSet<T, Compare, Allocator, NodeBytes>::upgrade(Node *node, std::uint64_t version) {
+    if (!node->version.compare_exchange_strong(version, version + LOCKED, std::memory_order_acquire))
+        return false;
+    std::atomic_thread_fence(std::memory_order_release);
+    return true;
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+void ConcurrentSet<T, Compare, Allocator, NodeBytes>::unlock(Node *node) {
+    node->version.fetch_add(LOCKED, std::memory_order_release);
+}
+
+// Unlocks a node that has left the tree: no read of it validates any more, and no lock on
+// it can be taken.
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+void ConcurrentSet<T, Compare, Allocator, NodeBytes>::unlock_obsolete(Node *node) {
+    node->version.fetch_add(LOCKED + OBSOLETE, std::memory_order_release);
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+void ConcurrentSet<T, Compare, Allocator, NodeBytes>::backoff(unsigned attempt) {
+    if (attempt > 8)
+        std::this_thread::yield();
+}
+
+// The first key not less than element; count may be stale, the caller validates.
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+std::size_t ConcurrentSet<T, Compare, Allocator, NodeBytes>::leaf_position(Leaf *leaf, T const &element,
+                                                                         std::size_t count) const {
+    std::size_t low = 0;
+    std::size_t high = count < LEAF_CAPACITY ? count : LEAF_CAPACITY;
+    while (low < high) {
+        std::size_t middle = (low + high) / 2;
+        if (compare_(leaf->keys[middle].load(std::memory_order_relaxed), element))
+            low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+
+// The child that holds element: the number of separators not greater than it.
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+std::size_t ConcurrentSet<T, Compare, Allocator, NodeBytes>::child_position(Inner *inner, T const &element,
+                                                                          std::size_t count) const {
+    std::size_t low = 0;
+    std::size_t high = count < INNER_CAPACITY ? count : INNER_CAPACITY;
+    while (low < high) {
+        std::size_t middle = (low + high) / 2;
+        if (compare_(element, inner->keys[middle].load(std::memory_order_relaxed)))
+            high = middle;
+        else low = middle + 1;
+    }
+    return low;
+}
+
+// Optimistic descent to the leaf for element, nullptr to restart. Each child pointer is
+// only followed once its parent has been validated, and the parent is validated again once
+// the child is locked, or a split of the child in between would go unseen.
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+typename ConcurrentSet<T, Compare, Allocator, NodeBytes>::Leaf*
+ConcurrentSet<T, Compare, Allocator, NodeBytes>::find_leaf(T const &element, std::uint64_t& version) const {
+    // a root split between loading root_ and locking the old root leaves it with half the keys
+    Node* node = root_.load(std::memory_order_acquire);
+    if (!read_lock(node, version) || node != root_.load(std::memory_order_relaxed))
+        return nullptr;
+    while (!node->leaf) {
+        Inner* inner = static_cast<Inner*>(node);
+        std::size_t count = inner->count.load(std::memory_order_relaxed);
+        Node* child = inner->children[child_position(inner, element, count)].load(std::memory_order_relaxed);
+        std::uint64_t child_version;
+        if (!validate(inner, version) || !read_lock(child, child_version) || !validate(inner, version))
+            return nullptr;
+        node = child;
+        version = child_version;
+    }
+    return static_cast<Leaf*>(node);
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+bool ConcurrentSet<T, Compare, Allocator, NodeBytes>::insert(T const &element) {
+    EpochReclaimer::Guard guard(reclaimer_);
+    for (unsigned attempt = 0;; attempt++) {
+        Outcome outcome = try_insert(element);
+        if (outcome != RESTART)
+            return outcome == YES;
+        backoff(attempt);
+    }
+}
+
+// A leaf the erase leaves underfull is merged by one more descent to it, which only merges.
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+bool ConcurrentSet<T, Compare, Allocator, NodeBytes>::erase(T const &element) {
+    EpochReclaimer::Guard guard(reclaimer_);
+    bool underfull = false;
+    Outcome outcome;
+    for (unsigned attempt = 0; (outcome = try_erase(element, underfull)) == RESTART; attempt++)
+        backoff(attempt);
+    if (underfull) {
+        std::uint64_t version;
+        for (unsigned attempt = 0; find_leaf_merging(element, version) == nullptr; attempt++)
+            backoff(attempt);
+    }
+    return outcome == YES;
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+bool ConcurrentSet<T, Compare, Allocator, NodeBytes>::contains(T const &element) const {
+    EpochReclaimer::Guard guard(reclaimer_);
+    for (unsigned attempt = 0;; attempt++) {
+        Outcome outcome = try_contains(element);
+        if (outcome != RESTART)
+            return outcome == YES;
+        backoff(attempt);
+    }
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+bool ConcurrentSet<T, Compare, Allocator, NodeBytes>::lower_bound(T const &element, T& result) const {
+    EpochReclaimer::Guard guard(reclaimer_);
+    for (unsigned attempt = 0;; attempt++) {
+        Outcome outcome = try_lower_bound(element, result);
+        if (outcome != RESTART)
+            return outcome == YES;
+        backoff(attempt);
+    }
+}
+
+// Descends like find_leaf, but splits a full node on the way, with its parent locked too,
+// and starts over after it.
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+typename ConcurrentSet<T, Compare, Allocator, NodeBytes>::Outcome
+ConcurrentSet<T, Compare, Allocator, NodeBytes>::try_insert(T const &element) {
+    Node* node = root_.load(std::memory_order_acquire);
+    std::uint64_t version;
+    if (!read_lock(node, version) || node != root_.load(std::memory_order_relaxed))
+        return RESTART;
+    Inner* parent = nullptr;
+    std::uint64_t parent_version = 0;
+
+    while (true) {
+        std::size_t count = node->count.load(std::memory_order_relaxed);
+        if (count == (node->leaf ? LEAF_CAPACITY : INNER_CAPACITY)) {
+            if (parent != nullptr && !upgrade(parent, parent_version))
+                return RESTART;
+            if (!upgrade(node, version)) {
+                if (parent != nullptr)
+                    unlock(parent);
+                return RESTART;
+            }
+            // a node without a parent has to still be the root
+            if (parent == nullptr && node != root_.load(std::memory_order_relaxed)) {
+                unlock(node);
+                return RESTART;
+            }
+            try {
+                split(node, parent);
+            } catch (...) {
+                unlock(node);
+                if (parent != nullptr)
+                    unlock(parent);
+                throw;
+            }
+            unlock(node);
+            if (parent != nullptr)
+                unlock(parent);
+            return RESTART;
+        }
+        if (node->leaf)
+            break;
+
+        Inner* inner = static_cast<Inner*>(node);
+        Node* child = inner->children[child_position(inner, element, count)].load(std::memory_order_relaxed);
+        std::uint64_t child_version;
+        if (!validate(inner, version) || !read_lock(child, child_version) || !validate(inner, version))
+            return RESTART;
+        parent = inner;
+        parent_version = version;
+        node = child;
+        version = child_version;
+    }
+
+    Leaf* leaf = static_cast<Leaf*>(node);
+    std::size_t count = leaf->count.load(std::memory_order_relaxed);
+    std::size_t position = leaf_position(leaf, element, count);
+    bool found = position < count && !compare_(element, leaf->keys[position].load(std::memory_order_relaxed));
+    if (found)
+        return validate(leaf, version) ? NO : RESTART;
+    if (!upgrade(leaf, version))
+        return RESTART;
+
+    for (std::size_t i = count; i > position; i--)
+        leaf->keys[i].store(leaf->keys[i - 1].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    leaf->keys[position].store(element, std::memory_order_relaxed);
+    leaf->count.store(count + 1, std::memory_order_relaxed);
+    unlock(leaf);
+    size_.fetch_add(1, std::memory_order_relaxed);
+    return YES;
+}
+
+// Moves the upper half of the locked, full node to a new right sibling and links that into
+// the locked parent, or into a new root. Nothing is changed before the allocations succeed.
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+void ConcurrentSet<T, Compare, Allocator, NodeBytes>::split(Node *node, Inner *parent) {
+    Inner* root = nullptr;
+    if (parent == nullptr)
+        parent = root = new_inner();
+    Node* right;
+    try {
+        right = node->leaf ? static_cast<Node*>(new_leaf()) : static_cast<Node*>(new_inner());
+    } catch (...) {
+        if (root != nullptr) {
+            inner_traits::destroy(inner_allocator_, root);
+            inner_traits::deallocate(inner_allocator_, root, 1);
+        }
+        throw;
+    }
+
+    // the first key to go right, or the inner separator that moves up
+    T separator = node->leaf ? static_cast<Leaf*>(node)->keys[LEAF_CAPACITY / 2].load(std::memory_order_relaxed)
+                             : static_cast<Inner*>(node)->keys[INNER_CAPACITY / 2].load(std::memory_order_relaxed);
+    if (node->leaf) {
+        Leaf* leaf = static_cast<Leaf*>(node);
+        Leaf* sibling = static_cast<Leaf*>(right);
+        std::size_t half = LEAF_CAPACITY / 2;
+        for (std::size_t i = half; i < LEAF_CAPACITY; i++)
+            sibling->keys[i - half].store(leaf->keys[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        sibling->count.store(LEAF_CAPACITY - half, std::memory_order_relaxed);
+        sibling->next.store(leaf->next.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        leaf->next.store(sibling, std::memory_order_relaxed);
+        leaf->count.store(half, std::memory_order_relaxed);
+    } else {
+        // the middle separator moves up
+        Inner* inner = static_cast<Inner*>(node);
+        Inner* sibling = static_cast<Inner*>(right);
+        std::size_t half = INNER_CAPACITY / 2;
+        for (std::size_t i = half + 1; i < INNER_CAPACITY; i++)
+            sibling->keys[i - half - 1].store(inner->keys[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        for (std::size_t i = half + 1; i <= INNER_CAPACITY; i++)
+            sibling->children[i - half - 1].store(inner->children[i].load(std::memory_order_relaxed),
+                                                  std::memory_order_relaxed);
+        sibling->count.store(INNER_CAPACITY - half - 1, std::memory_order_relaxed);
+        inner->count.store(half, std::memory_order_relaxed);
+    }
+
+    if (root != nullptr) {
+        root->children[0].store(node, std::memory_order_relaxed);
+        link(root, separator, right);
+        root_.store(root, std::memory_order_release);
+    } else {
+        link(parent, separator, right);
+    }
+}
+
+// Adds separator and its right child to an inner node with room for them.
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+void ConcurrentSet<T, Compare, Allocator, NodeBytes>::link(Inner *parent, T const &separator, Node *right) {
+    std::size_t count = parent->count.load(std::memory_order_relaxed);
+    std::size_t position = child_position(parent, separator, count);
+    for (std::size_t i = count; i > position; i--) {
+        parent->keys[i].store(parent->keys[i - 1].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        parent->children[i + 1].store(parent->children[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+    parent->keys[position].store(separator, std::memory_order_relaxed);
+    parent->children[position + 1].store(right, std::memory_order_relaxed);
+    parent->count.store(count + 1, std::memory_order_relaxed);
+}
+
+// Descends like find_leaf, but merges an underfull child with a sibling under the same
+// parent on the way and starts over after it, as try_insert does with splits. A root left
+// with a single child gives way to it.
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+typename ConcurrentSet<T, Compare, Allocator, NodeBytes>::Leaf*
+ConcurrentSet<T, Compare, Allocator, NodeBytes>::find_leaf_merging(T const &element, std::uint64_t& version) {
+    Node* node = root_.load(std::memory_order_acquire);
+    if (!read_lock(node, version) || node != root_.load(std::memory_order_relaxed))
+        return nullptr;
+    if (!node->leaf && node->count.load(std::memory_order_relaxed) == 0) {
+        collapse_root(static_cast<Inner*>(node), version);
+        return nullptr;
+    }
+    while (!node->leaf) {
+        Inner* inner = static_cast<Inner*>(node);
+        std::size_t count = inner->count.load(std::memory_order_relaxed);
+        std::size_t position = child_position(inner, element, count);
+        Node* child = inner->children[position].load(std::memory_order_relaxed);
+        std::uint64_t child_version;
+        if (!validate(inner, version) || !read_lock(child, child_version) || !validate(inner, version))
+            return nullptr;
+        std::size_t child_count = child->count.load(std::memory_order_relaxed);
+        if (count > 0 && child_count < (child->leaf ? LEAF_MIN : INNER_MIN) &&
+            try_merge(inner, version, position, child, child_version) != NO)
+            return nullptr;
+        node = child;
+        version = child_version;
+    }
+    return static_cast<Leaf*>(node);
+}
+
+// Merges child, at position in parent, with its left sibling, or with its right one if it
+// is the first. NO when the two would not fit in one node; YES, the merge is done, and
+// RESTART both start over.
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+typename ConcurrentSet<T, Compare, Allocator, NodeBytes>::Outcome
+ConcurrentSet<T, Compare, Allocator, NodeBytes>::try_merge(Inner *parent, std::uint64_t parent_version,
+                                                          std::size_t position, Node *child,
+                                                          std::uint64_t child_version) {
+    std::size_t left_position = position > 0 ? position - 1 : 0;
+    Node* sibling = parent->children[position > 0 ? position - 1 : 1].load(std::memory_order_relaxed);
+    std::uint64_t sibling_version;
+    if (!read_lock(sibling, sibling_version) || !validate(parent, parent_version))
+        return RESTART;
+    Node* left = position > 0 ? sibling : child;
+    Node* right = position > 0 ? child : sibling;
+
+    // the counts are checked again by the locks, which fail if either changed
+    std::size_t keys = left->count.load(std::memory_order_relaxed) + right->count.load(std::memory_order_relaxed);
+    if (child->leaf ? keys > LEAF_CAPACITY : keys + 1 > INNER_CAPACITY)
+        return NO;
+
+    if (!upgrade(parent, parent_version))
+        return RESTART;
+    if (!upgrade(left, left == child ? child_version : sibling_version)) {
+        unlock(parent);
+        return RESTART;
+    }
+    if (!upgrade(right, right == child ? child_version : sibling_version)) {
+        unlock(left);
+        unlock(parent);
+        return RESTART;
+    }
+    merge(parent, left_position, left, right);
+    unlock(left);
+    unlock_obsolete(right);
+    unlock(parent);
+    retire(right);
+    return YES;
+}
+
+// Moves everything of right into left, its sibling just before it, and takes right and the
+// separator between them out of the parent. All three are locked and right is then empty.
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+void ConcurrentSet<T, Compare, Allocator, NodeBytes>::merge(Inner *parent, std::size_t position, Node *left,
+                                                           Node *right) {
+    std::size_t left_count = left->count.load(std::memory_order_relaxed);
+    std::size_t right_count = right->count.load(std::memory_order_relaxed);
+    if (left->leaf) {
+        Leaf* to = static_cast<Leaf*>(left);
+        Leaf* from = static_cast<Leaf*>(right);
+        for (std::size_t i = 0; i < right_count; i++)
+            to->keys[left_count + i].store(from->keys[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        to->next.store(from->next.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        to->count.store(left_count + right_count, std::memory_order_relaxed);
+    } else {
+        // the separator comes down between the two
+        Inner* to = static_cast<Inner*>(left);
+        Inner* from = static_cast<Inner*>(right);
+        to->keys[left_count].store(parent->keys[position].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        for (std::size_t i = 0; i < right_count; i++)
+            to->keys[left_count + 1 + i].store(from->keys[i].load(std::memory_order_relaxed),
+                                               std::memory_order_relaxed);
+        for (std::size_t i = 0; i <= right_count; i++)
+            to->children[left_count + 1 + i].store(from->children[i].load(std::memory_order_relaxed),
+                                                   std::memory_order_relaxed);
+        to->count.store(left_count + right_count + 1, std::memory_order_relaxed);
+    }
+
+    std::size_t count = parent->count.load(std::memory_order_relaxed);
+    for (std::size_t i = position + 1; i < count; i++) {
+        parent->keys[i - 1].store(parent->keys[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        parent->children[i].store(parent->children[i + 1].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+    parent->count.store(count - 1, std::memory_order_relaxed);
+}
+
+// The root read at version has no separators left: its one child becomes the root.
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+void ConcurrentSet<T, Compare, Allocator, NodeBytes>::collapse_root(Inner *root, std::uint64_t version) {
+    if (!upgrade(root, version))
+        return;
+    if (root != root_.load(std::memory_order_relaxed)) {
+        unlock(root);
+        return;
+    }
+    root_.store(root->children[0].load(std::memory_order_relaxed), std::memory_order_release);
+    unlock_obsolete(root);
+    retire(root);
+}
+
+// underfull tells whether the leaf was left with too few keys.
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+typename ConcurrentSet<T, Compare, Allocator, NodeBytes>::Outcome
+ConcurrentSet<T, Compare, Allocator, NodeBytes>::try_erase(T const &element, bool& underfull) {
+    std::uint64_t version;
+    Leaf* leaf = find_leaf_merging(element, version);
+    if (leaf == nullptr)
+        return RESTART;
+    std::size_t count = leaf->count.load(std::memory_order_relaxed);
+    std::size_t position = leaf_position(leaf, element, count);
+    bool found = position < count && !compare_(element, leaf->keys[position].load(std::memory_order_relaxed));
+    if (!found)
+        return validate(leaf, version) ? NO : RESTART;
+    if (!upgrade(leaf, version))
+        return RESTART;
+
+    for (std::size_t i = position + 1; i < count; i++)
+        leaf->keys[i - 1].store(leaf->keys[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    leaf->count.store(count - 1, std::memory_order_relaxed);
+    unlock(leaf);
+    size_.fetch_sub(1, std::memory_order_relaxed);
+    underfull = count - 1 < LEAF_MIN;
+    return YES;
+}
+
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+typename ConcurrentSet<T, Compare, Allocator, NodeBytes>::Outcome
+ConcurrentSet<T, Compare, Allocator, NodeBytes>::try_contains(T const &element) const {
+    std::uint64_t version;
+    Leaf* leaf = find_leaf(element, version);
+    if (leaf == nullptr)
+        return RESTART;
+    std::size_t count = leaf->count.load(std::memory_order_relaxed);
+    std::size_t position = leaf_position(leaf, element, count);
+    bool found = position < count && !compare_(element, leaf->keys[position].load(std::memory_order_relaxed));
+    if (!validate(leaf, version))
+        return RESTART;
+    return found ? YES : NO;
+}
+
+// When the leaf for element has nothing as large, the answer is the first key of the next
+// nonempty leaf. All the leaves passed are validated together at the end, so there was a
+// moment when every one of them was as read.
+template <typename T, typename Compare, typename Allocator, std::size_t NodeBytes>
+typename ConcurrentSet<T, Compare, Allocator, NodeBytes>::Outcome
+ConcurrentSet<T, Compare, Allocator, NodeBytes>::try_lower_bound(T const &element, T& result) const {
+    std::pair<Leaf*, std::uint64_t> visited[VISITED];
+    std::vector<std::pair<Leaf*, std::uint64_t>> more;
+    std::size_t passed = 0;
+
+    std::uint64_t version;
+    Leaf* leaf = find_leaf(element, version);
+    if (leaf == nullptr)
+        return RESTART;
+    bool first = true;
+    Outcome outcome = NO;
+    while (leaf != nullptr) {
+        if (passed < VISITED)
+            visited[passed] = {leaf, version};
+        else more.push_back({leaf, version});
+        ++passed;
+
+        std::size_t count = leaf->count.load(std::memory_order_relaxed);
+        std::size_t position = first ? leaf_position(leaf, element, count) : 0;
+        first = false;
+        if (position < count && position < LEAF_CAPACITY) {
+            result = leaf->keys[position].load(std::memory_order_relaxed);
+            outcome = YES;
+            break;
+        }
+        Leaf* next = leaf->next.load(std::memory_order_relaxed);
+        if (!validate(leaf, version))
+            return RESTART;
+        leaf = next;
+        if (leaf != nullptr && !read_lock(leaf, version))
+            return RESTART;
+    }
+
+    for (std::size_t i = 0; i < passed; i++) {
+        std::pair<Leaf*, std::uint64_t> const& seen = i < VISITED ? visited[i] : more[i - VISITED];
+        if (!validate(seen.first, seen.second))
+            return RESTART;
+    }
+    return outcome;
+}
+
+#endif //SET_CONCURRENTSET_H
@@ -0,0 +1,401 @@
+#ifndef SET_EPOCHRECLAIMER_H
+#define SET_EPOCHRECLAIMER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Epoch-based reclamation, for structures that unlink memory while other threads may still
+// be reading it. A thread pins the current epoch while it may hold pointers into the
+// structure; the epoch only moves on once every pinned thread has seen it. Memory retired
+// in epoch e is out of every thread's reach once the epoch is e + 2, and is freed then.
+//
+// Retired memory waits in a limbo list of the thread that retired it, so retiring takes no
+// lock. Every batch retirements the thread tries to move the epoch on and frees what has
+// become old enough. A thread whose list reaches limit, because some thread stays pinned,
+// counts a stall. By default its list then keeps growing; with WAIT a thread that is not
+// pinned itself waits until the list is below limit again, so a thread that never unpins
+// stops the others from retiring. The stats tell how much garbage is pending and how often
+// threads stalled.
+//
+// Pins nest and belong to the thread that took them. The lists of exited threads go to the
+// next thread to turn up; whatever is left is freed with the reclaimer, which must not be
+// pinned or retired into by then.
+class EpochReclaimer {
+    struct Record;
+public:
+    struct Stats {
+        std::uint64_t epoch;
+        // retired and not freed yet
+        std::size_t pending;
+        std::uint64_t retired;
+        std::uint64_t freed;
+        // retirements that found their thread's list full
+        std::uint64_t stalls;
+    };
+
+    // Pins the epoch for its lifetime.
+    class Guard {
+    public:
+        explicit Guard(EpochReclaimer& reclaimer) : reclaimer_(reclaimer) { reclaimer_.pin(); }
+        Guard(Guard const&) = delete;
+        Guard& operator=(Guard const&) = delete;
+        ~Guard() { reclaimer_.unpin(); }
+
+    private:
+        EpochReclaimer& reclaimer_;
+    };
+
+    using Free = void (*)(void* pointer, void* context);
+
+    // what a retirement does when it finds its thread's list full
+    enum Overflow { GROW, WAIT };
+
+    explicit EpochReclaimer(std::size_t batch = 64, std::size_t limit = 4096, Overflow overflow = GROW);
+    EpochReclaimer(EpochReclaimer const&) = delete;
+    EpochReclaimer& operator=(EpochReclaimer const&) = delete;
+    ~EpochReclaimer();
+
+    void pin();
+    void unpin();
+    // free(pointer, context) runs once no thread can reach pointer any more; it must not throw.
+    // pointer has to be unlinked already.
+    void retire(void* pointer, Free free, void* context) noexcept;
+    template <typename T>
+    void retire(T* pointer) noexcept;
+    // Frees what the calling thread retired and no thread can reach any more, returns how much.
+    std::size_t collect();
+
+    Stats stats() const;
+    std::size_t pending() const { return pending_.load(std::memory_order_relaxed); }
+
+private:
+    static const std::uint64_t IDLE = 0;
+
+    struct Retired {
+        void* pointer;
+        Free free;
+        void* context;
+        std::uint64_t epoch;
+    };
+
+    // One per thread that used the reclaimer, handed on to a later thread when it exits.
+    struct Record {
+        std::atomic<std::uint64_t> epoch{IDLE};
+        std::atomic<bool> taken{true};
+        Record* next = nullptr;
+        unsigned depth = 0;
+        std::vector<Retired> limbo;
+    };
+
+    // Which records the thread holds, so it can hand them back on exit; records of a
+    // reclaimer that is gone are skipped by its id.
+    struct Registry;
+    struct Local;
+
+    std::uint64_t const id_;
+    std::size_t const batch_;
+    std::size_t const limit_;
+    Overflow const overflow_;
+    std::atomic<std::uint64_t> epoch_{IDLE + 1};
+    std::atomic<Record*> records_{nullptr};
+    std::atomic<std::size_t> pending_{0};
+    std::atomic<std::uint64_t> retired_{0};
+    std::atomic<std::uint64_t> freed_{0};
+    std::atomic<std::uint64_t> stalls_{0};
+
+    static Registry& registry();
+    Record* record();
+    Record* acquire();
+    std::uint64_t advance();
+    std::size_t collect(Record* record) noexcept;
+    void wait_below_limit(Record* record) noexcept;
+    void free_unpinned(void* pointer, Free free, void* context, std::uint64_t epoch) noexcept;
+};
+
+// std::allocator's memory, except that deallocate retires it into an EpochReclaimer instead
+// of freeing it. With it, Set's erase and clear destroy their nodes at once but leave the
+// memory to readers pinned on reclaimer(); the memory of a node stays valid while they are.
+// Copies and rebinds share the reclaimer, which lives as long as any of them.
+template <typename T>
+struct EpochAllocator {
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+    using is_always_equal = std::false_type;
+    // the reclaimer takes retirements from any thread
+    using is_thread_safe = std::true_type;
+
+    template <typename U>
+    struct rebind {
+        using other = EpochAllocator<U>;
+    };
+
+    EpochAllocator() : reclaimer_(std::make_shared<EpochReclaimer>()) {}
+    explicit EpochAllocator(std::shared_ptr<EpochReclaimer> reclaimer) noexcept : reclaimer_(std::move(reclaimer)) {}
+    EpochAllocator(EpochAllocator const&) = default;
+    template <typename U>
+    EpochAllocator(EpochAllocator<U> const& other) noexcept : reclaimer_(other.reclaimer_) {}
+
+    T* allocate(std::size_t n) {
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* pointer, std::size_t) noexcept {
+        reclaimer_->retire(pointer, &release, nullptr);
+    }
+
+    EpochReclaimer& reclaimer() const { return *reclaimer_; }
+
+private:
+    template <typename U>
+    friend struct EpochAllocator;
+    template <typename First, typename Second>
+    friend bool operator==(EpochAllocator<First> const& first, EpochAllocator<Second> const& second);
+
+    static void release(void* pointer, void*) { ::operator delete(pointer); }
+
+    std::shared_ptr<EpochReclaimer> reclaimer_;
+};
+
+template <typename First, typename Second>
+bool operator==(EpochAllocator<First> const& first, EpochAllocator<Second> const& second) {
+    return first.reclaimer_ == second.reclaimer_;
+}
+
+template <typename First, typename Second>
+bool operator!=(EpochAllocator<First> const& first, EpochAllocator<Second> const& second) {
+    return !(first == second);
+}
+
+// The ids of the live reclaimers. Leaked, so that threads exiting during static destruction
+// still find it.
+struct EpochReclaimer::Registry {
+    std::mutex mutex;
+    std::vector<std::uint64_t> live;
+    std::uint64_t next_id = 0;
+
+    bool alive(std::uint64_t id) const { return std::find(live.begin(), live.end(), id) != live.end(); }
+};
+
+struct EpochReclaimer::Local {
+    struct Held {
+        std::uint64_t id;
+        Record* record;
+    };
+
+    std::vector<Held> held;
+
+    // A record is only touched while its reclaimer is known to be alive.
+    ~Local() {
+        Registry& registry = EpochReclaimer::registry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        for (Held const& entry : held) {
+            if (!registry.alive(entry.id))
+                continue;
+            entry.record->depth = 0;
+            entry.record->epoch.store(IDLE, std::memory_order_release);
+            entry.record->taken.store(false, std::memory_order_release);
+        }
+    }
+};
+
+inline EpochReclaimer::EpochReclaimer(std::size_t batch, std::size_t limit, Overflow overflow)
+        : id_([] {
+              Registry& registry = EpochReclaimer::registry();
+              std::lock_guard<std::mutex> lock(registry.mutex);
+              registry.live.push_back(registry.next_id);
+              return registry.next_id++;
+          }()),
+          batch_(batch > 0 ? batch : 1),
+          limit_(std::max(limit, batch_)),
+          overflow_(overflow) {}
+
+inline EpochReclaimer::~EpochReclaimer() {
+    {
+        Registry& registry = EpochReclaimer::registry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.live.erase(std::find(registry.live.begin(), registry.live.end(), id_));
+    }
+    Record* record = records_.load(std::memory_order_acquire);
+    while (record != nullptr) {
+        for (Retired const& retired : record->limbo)
+            retired.free(retired.pointer, retired.context);
+        Record* next = record->next;
+        delete record;
+        record = next;
+    }
+}
+
+inline EpochReclaimer::Registry& EpochReclaimer::registry() {
+    static Registry* registry = new Registry();
+    return *registry;
+}
+
+// The calling thread's record, found through a thread local list of the records it holds.
+inline EpochReclaimer::Record* EpochReclaimer::record() {
+    static thread_local Local local;
+    for (Local::Held const& entry : local.held)
+        if (entry.id == id_)
+            return entry.record;
+
+    // forget the records of reclaimers that are gone before taking a new one
+    {
+        Registry& registry = EpochReclaimer::registry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        local.held.erase(std::remove_if(local.held.begin(), local.held.end(),
+                                        [&registry](Local::Held const& entry) { return !registry.alive(entry.id); }),
+                         local.held.end());
+    }
+    local.held.reserve(local.held.size() + 1);
+    Record* record = acquire();
+    local.held.push_back({id_, record});
+    return record;
+}
+
+// A record left by an exited thread, limbo list and all, or a new one.
+inline EpochReclaimer::Record* EpochReclaimer::acquire() {
+    for (Record* record = records_.load(std::memory_order_acquire); record != nullptr; record = record->next) {
+        bool taken = false;
+        if (!record->taken.load(std::memory_order_relaxed) &&
+            record->taken.compare_exchange_strong(taken, true, std::memory_order_acquire))
+            return record;
+    }
+    std::unique_ptr<Record> owned(new Record());
+    owned->limbo.reserve(limit_);
+    Record* record = owned.release();
+    Record* head = records_.load(std::memory_order_relaxed);
+    do {
+        record->next = head;
+    } while (!records_.compare_exchange_weak(head, record, std::memory_order_release, std::memory_order_relaxed));
+    return record;
+}
+
+// The fence orders the pin before every read of the structure that follows.
+inline void EpochReclaimer::pin() {
+    Record* record = this->record();
+    if (record->depth++ == 0) {
+        record->epoch.store(epoch_.load(std::memory_order_relaxed), std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+}
+
+inline void EpochReclaimer::unpin() {
+    Record* record = this->record();
+    if (--record->depth == 0)
+        record->epoch.store(IDLE, std::memory_order_release);
+}
+
+// Moves the epoch on if every pinned thread is in the current one, returns the epoch.
+inline std::uint64_t EpochReclaimer::advance() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    std::uint64_t epoch = epoch_.load(std::memory_order_relaxed);
+    for (Record* record = records_.load(std::memory_order_acquire); record != nullptr; record = record->next) {
+        std::uint64_t seen = record->epoch.load(std::memory_order_acquire);
+        if (seen != IDLE && seen != epoch)
+            return epoch;
+    }
+    if (epoch_.compare_exchange_strong(epoch, epoch + 1, std::memory_order_acq_rel))
+        return epoch + 1;
+    return epoch;
+}
+
+// Never throws. The list has room for limit entries from the start, so it only allocates when
+// it grows past that. Should that fail, or the thread have no record yet, the memory is freed
+// right away when the thread is not pinned, after waiting for two epochs. A pinned thread can
+// neither wait nor free it and leaks it instead.
+inline void EpochReclaimer::retire(void *pointer, Free free, void *context) noexcept {
+    Record* record = nullptr;
+    try {
+        record = this->record();
+    } catch (...) {
+        // a thread without a record has never pinned
+        free_unpinned(pointer, free, context, epoch_.load(std::memory_order_acquire));
+        return;
+    }
+    std::uint64_t epoch = epoch_.load(std::memory_order_acquire);
+    std::vector<Retired>& limbo = record->limbo;
+    if (limbo.size() == limbo.capacity()) {
+        try {
+            limbo.reserve(2 * limbo.capacity());
+        } catch (...) {
+            if (collect(record) == 0) {
+                stalls_.fetch_add(1, std::memory_order_relaxed);
+                if (record->depth == 0)
+                    free_unpinned(pointer, free, context, epoch);
+                return;
+            }
+        }
+    }
+    limbo.push_back({pointer, free, context, epoch});
+    pending_.fetch_add(1, std::memory_order_relaxed);
+    retired_.fetch_add(1, std::memory_order_relaxed);
+
+    if (limbo.size() >= limit_) {
+        stalls_.fetch_add(1, std::memory_order_relaxed);
+        if (overflow_ == WAIT) {
+            wait_below_limit(record);
+            return;
+        }
+    }
+    if (limbo.size() % batch_ == 0)
+        collect(record);
+}
+
+inline void EpochReclaimer::free_unpinned(void *pointer, Free free, void *context, std::uint64_t epoch) noexcept {
+    while (advance() < epoch + 2)
+        std::this_thread::yield();
+    free(pointer, context);
+    retired_.fetch_add(1, std::memory_order_relaxed);
+    freed_.fetch_add(1, std::memory_order_relaxed);
+}
+
+template <typename T>
+void EpochReclaimer::retire(T *pointer) noexcept {
+    retire(pointer, [](void* pointer, void*) { delete static_cast<T*>(pointer); }, nullptr);
+}
+
+// A pinned thread holds the epoch back itself, it cannot wait.
+inline void EpochReclaimer::wait_below_limit(Record *record) noexcept {
+    collect(record);
+    while (record->depth == 0 && record->limbo.size() >= limit_) {
+        std::this_thread::yield();
+        collect(record);
+    }
+}
+
+inline std::size_t EpochReclaimer::collect() {
+    return collect(record());
+}
+
+// The list is in epoch order, so what can go is a prefix.
+inline std::size_t EpochReclaimer::collect(Record *record) noexcept {
+    std::uint64_t epoch = advance();
+    std::vector<Retired>& limbo = record->limbo;
+    std::size_t count = 0;
+    while (count < limbo.size() && limbo[count].epoch + 2 <= epoch) {
+        limbo[count].free(limbo[count].pointer, limbo[count].context);
+        ++count;
+    }
+    limbo.erase(limbo.begin(), limbo.begin() + count);
+    pending_.fetch_sub(count, std::memory_order_relaxed);
+    freed_.fetch_add(count, std::memory_order_relaxed);
+    return count;
+}
+
+inline EpochReclaimer::Stats EpochReclaimer::stats() const {
+    return {epoch_.load(std::memory_order_relaxed), pending_.load(std::memory_order_relaxed),
+            retired_.load(std::memory_order_relaxed), freed_.load(std::memory_order_relaxed),
+            stalls_.load(std::memory_order_relaxed)};
+}
+
+#endif //SET_EPOCHRECLAIMER_H
@@ -0,0 +1,227 @@
+#ifndef SET_FLATSET_H
+#define SET_FLATSET_H
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "Set.h"
+
+// A set kept as one sorted array: the same interface as Set, random access iterators, a
+// fraction of the memory and no pointer chasing. Lookups are binary searches, a single
+// insert or erase shifts the elements after it, so it suits tables that are built in bulk
+// and then mostly read. Every insert and erase invalidates the iterators.
+template <typename T, typename Compare = std::less<T>, typename Allocator = std::allocator<T>>
+struct FlatSet {
+private:
+    using storage = std::vector<T, Allocator>;
+public:
+
+    using value_type = T;
+    using key_type = T;
+    using key_compare = Compare;
+    using value_compare = Compare;
+    using allocator_type = Allocator;
+    using size_type = std::size_t;
+
+    using iterator = typename storage::const_iterator;
+    using const_iterator = iterator;
+    using reverse_iterator = std::reverse_iterator<iterator>;
+    using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+    FlatSet() {}
+    explicit FlatSet(Compare const& compare, Allocator const& allocator = Allocator())
+            : values_(allocator), compare_(compare) {}
+    explicit FlatSet(Allocator const& allocator) : values_(allocator) {}
+    template <typename InputIt>
+    FlatSet(InputIt first, InputIt last, Compare const& compare = Compare(), Allocator const& allocator = Allocator());
+    // O(n), the set is already in order
+    template <typename SetAllocator, typename Balance>
+    explicit FlatSet(Set<T, Compare, SetAllocator, Balance> const& set, Allocator const& allocator = Allocator());
+
+    // O(n), the keys go in already sorted
+    template <typename Balance = RedBlackBalance, typename SetAllocator = Allocator>
+    Set<T, Compare, SetAllocator, Balance> to_set(SetAllocator const& allocator = SetAllocator()) const;
+
+    std::pair<iterator, bool> insert(T const& element) { return insert_impl(element); }
+    std::pair<iterator, bool> insert(T&& element) { return insert_impl(std::move(element)); }
+    template <typename... Args>
+    std::pair<iterator, bool> emplace(Args&&... args);
+    // O(n log n + size()): the new keys are sorted on their own and merged in one pass
+    template <typename InputIt>
+    void insert(InputIt first, InputIt last);
+    // O(n + size()) when the range is sorted
+    template <typename InputIt>
+    void insert_sorted(InputIt first, InputIt last) { insert(first, last); }
+    iterator erase(const_iterator it);
+
+    const_iterator find(T const& element) const;
+    const_iterator lower_bound(T const& element) const;
+    const_iterator upper_bound(T const& element) const;
+    std::pair<const_iterator, const_iterator> equal_range(T const& element) const;
+
+    size_type rank(T const& element) const { return lower_bound(element) - begin(); }
+    const_iterator nth(size_type index) const { return index < size() ? begin() + index : end(); }
+    // the elements from <= x <= to, as Set::count_range
+    size_type count_range(T const& from, T const& to) const;
+
+    bool empty() const { return values_.empty(); }
+    size_type size() const { return values_.size(); }
+    void clear() { values_.clear(); }
+    void reserve(size_type capacity) { values_.reserve(capacity); }
+    void shrink_to_fit() { values_.shrink_to_fit(); }
+
+    void swap(FlatSet& other);
+
+    allocator_type get_allocator() const { return values_.get_allocator(); }
+    key_compare key_comp() const { return compare_; }
+    value_compare value_comp() const { return compare_; }
+
+    iterator begin() { return values_.cbegin(); }
+    const_iterator begin() const { return values_.cbegin(); }
+    iterator end() { return values_.cend(); }
+    const_iterator end() const { return values_.cend(); }
+
+    reverse_iterator rbegin() { return reverse_iterator(end()); }
+    const_reverse_iterator rbegin() const { return const_reverse_iterator(end()); }
+    reverse_iterator rend() { return reverse_iterator(begin()); }
+    const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
+
+private:
+    storage values_;
+    Compare compare_;
+
+    template <typename K>
+    std::pair<iterator, bool> insert_impl(K&& element);
+};
+
+template <typename T, typename Compare, typename Allocator>
+template <typename InputIt>
+FlatSet<T, Compare, Allocator>::FlatSet(InputIt first, InputIt last, Compare const& compare, Allocator const& allocator)
+        : FlatSet(compare, allocator) {
+    insert(first, last);
+}
+
+template <typename T, typename Compare, typename Allocator>
+template <typename SetAllocator, typename Balance>
+FlatSet<T, Compare, Allocator>::FlatSet(Set<T, Compare, SetAllocator, Balance> const& set, Allocator const& allocator)
+        : values_(allocator), compare_(set.key_comp()) {
+    values_.reserve(set.size());
+    values_.insert(values_.end(), set.begin(), set.end());
+}
+
+template <typename T, typename Compare, typename Allocator>
+template <typename Balance, typename SetAllocator>
+Set<T, Compare, SetAllocator, Balance> FlatSet<T, Compare, Allocator>::to_set(SetAllocator const& allocator) const {
+    return Set<T, Compare, SetAllocator, Balance>(begin(), end(), compare_, allocator);
+}
+
+template <typename T, typename Compare, typename Allocator>
+template <typename K>
+std::pair<typename FlatSet<T, Compare, Allocator>::iterator, bool> FlatSet<T, Compare, Allocator>::insert_impl(K&& element) {
+    const_iterator position = lower_bound(element);
+    if (position != end() && !compare_(element, *position))
+        return {position, false};
+    return {values_.insert(position, std::forward<K>(element)), true};
+}
+
+template <typename T, typename Compare, typename Allocator>
+template <typename... Args>
+std::pair<typename FlatSet<T, Compare, Allocator>::iterator, bool> FlatSet<T, Compare, Allocator>::emplace(Args&&... args) {
+    // the key only exists once it is constructed
+    T element(std::forward<Args>(args)...);
+    return insert_impl(std::move(element));
+}
+
+// The new keys are appended, sorted and deduplicated in place, then merged with the old ones
+// with a single std::inplace_merge; the old keys come first in it, so they win over equal new
+// ones. If a comparison throws before the merge the new keys are dropped, during it the
+// order is lost and the set is cleared.
+template <typename T, typename Compare, typename Allocator>
+template <typename InputIt>
+void FlatSet<T, Compare, Allocator>::insert(InputIt first, InputIt last) {
+    size_type old_size = values_.size();
+    typename storage::iterator middle;
+    try {
+        values_.insert(values_.end(), first, last);
+        middle = values_.begin() + old_size;
+        if (!std::is_sorted(middle, values_.end(), compare_))
+            std::stable_sort(middle, values_.end(), compare_);
+        values_.erase(std::unique(middle, values_.end(), [this](T const& first, T const& second) {
+            return !compare_(first, second);
+        }), values_.end());
+    } catch (...) {
+        values_.erase(values_.begin() + std::min(old_size, values_.size()), values_.end());
+        throw;
+    }
+
+    if (old_size == 0 || middle == values_.end() || compare_(*(middle - 1), *middle))
+        return;
+    try {
+        std::inplace_merge(values_.begin(), middle, values_.end(), compare_);
+        values_.erase(std::unique(values_.begin(), values_.end(), [this](T const& first, T const& second) {
+            return !compare_(first, second);
+        }), values_.end());
+    } catch (...) {
+        values_.clear();
+        throw;
+    }
+}
+
+template <typename T, typename Compare, typename Allocator>
+typename FlatSet<T, Compare, Allocator>::iterator FlatSet<T, Compare, Allocator>::erase(const_iterator it) {
+    if (it == end())
+        return end();
+    return values_.erase(it);
+}
+
+template <typename T, typename Compare, typename Allocator>
+typename FlatSet<T, Compare, Allocator>::const_iterator FlatSet<T, Compare, Allocator>::find(T const &element) const {
+    const_iterator it = lower_bound(element);
+    if (it == end() || compare_(element, *it))
+        return end();
+    return it;
+}
+
+template <typename T, typename Compare, typename Allocator>
+typename FlatSet<T, Compare, Allocator>::const_iterator FlatSet<T, Compare, Allocator>::lower_bound(T const &element) const {
+    return std::lower_bound(begin(), end(), element, compare_);
+}
+
+template <typename T, typename Compare, typename Allocator>
+typename FlatSet<T, Compare, Allocator>::const_iterator FlatSet<T, Compare, Allocator>::upper_bound(T const &element) const {
+    return std::upper_bound(begin(), end(), element, compare_);
+}
+
+template <typename T, typename Compare, typename Allocator>
+std::pair<typename FlatSet<T, Compare, Allocator>::const_iterator, typename FlatSet<T, Compare, Allocator>::const_iterator>
+FlatSet<T, Compare, Allocator>::equal_range(T const &element) const {
+    const_iterator lower = lower_bound(element);
+    if (lower == end() || compare_(element, *lower))
+        return {lower, lower};
+    return {lower, lower + 1};
+}
+
+template <typename T, typename Compare, typename Allocator>
+typename FlatSet<T, Compare, Allocator>::size_type FlatSet<T, Compare, Allocator>::count_range(T const &from, T const &to) const {
+    if (compare_(to, from))
+        return 0;
+    return upper_bound(to) - lower_bound(from);
+}
+
+template <typename T, typename Compare, typename Allocator>
+void FlatSet<T, Compare, Allocator>::swap(FlatSet &other) {
+    values_.swap(other.values_);
+    std::swap(compare_, other.compare_);
+}
+
+template <typename T, typename Compare, typename Allocator>
+void swap(FlatSet<T, Compare, Allocator>& first, FlatSet<T, Compare, Allocator>& second) {
+    first.swap(second);
+}
+
+#endif //SET_FLATSET_H
@@ -0,0 +1,714 @@
+#ifndef SET_FROZENSET_H
+#define SET_FROZENSET_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+struct Set;
+
+// How FrozenSet lays its keys out in memory.
+//
+// EytzingerLayout: BFS order of a complete tree over the sorted keys, children found by index
+// arithmetic. The fastest when the tree is built for lookups alone.
+struct EytzingerLayout {};
+// VanEmdeBoasLayout: the shape of the source tree, stored recursively (see below) with explicit
+// links, so it is cache efficient at every block size without knowing any of them.
+struct VanEmdeBoasLayout {};
+
+// An immutable set, made by Set::freeze<Layout>() or from a range.
+template <typename T, typename Compare = std::less<T>, typename Layout = EytzingerLayout>
+struct FrozenSet;
+
+namespace set_detail {
+
+// Walks a FrozenSet in order through its next()/prev(), slot 0 is the end.
+template <typename Frozen, typename V>
+struct FrozenIterator {
+    using iterator_category = std::bidirectional_iterator_tag;
+    using difference_type = std::ptrdiff_t;
+    using value_type = V;
+    using pointer = V*;
+    using reference = V&;
+
+    FrozenIterator() : set(nullptr), slot(0) {}
+    FrozenIterator(Frozen const* set, std::size_t slot) : set(set), slot(slot) {}
+
+    FrozenIterator& operator++() {
+        slot = set->next(slot);
+        return *this;
+    }
+    const FrozenIterator operator++(int) {
+        FrozenIterator temp(*this);
+        ++*this;
+        return temp;
+    }
+    FrozenIterator& operator--() {
+        slot = set->prev(slot);
+        return *this;
+    }
+    const FrozenIterator operator--(int) {
+        FrozenIterator temp(*this);
+        --*this;
+        return temp;
+    }
+
+    V& operator*() const { return set->key(slot); }
+    V* operator->() const { return &set->key(slot); }
+    friend bool operator==(FrozenIterator const& first, FrozenIterator const& second) { return first.slot == second.slot; }
+    friend bool operator!=(FrozenIterator const& first, FrozenIterator const& second) { return first.slot != second.slot; }
+
+    Frozen const* set;
+    std::size_t slot;
+};
+
+}
+
+// The keys sit in one array in Eytzinger (BFS) order: the children of slot k are 2k and
+// 2k + 1, slot 0 is unused. A lookup walks down with no branch on the comparison, and
+// prefetches the cache line holding the slots four levels below, so the memory latency of
+// the next levels overlaps with this one.
+template <typename T, typename Compare>
+struct FrozenSet<T, Compare, EytzingerLayout> {
+    using value_type = T;
+    using key_type = T;
+    using key_compare = Compare;
+    using value_compare = Compare;
+    using size_type = std::size_t;
+
+    using iterator = set_detail::FrozenIterator<FrozenSet, T const>;
+    using const_iterator = iterator;
+    using reverse_iterator = std::reverse_iterator<iterator>;
+    using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+    FrozenSet() {}
+    explicit FrozenSet(Compare const& compare) : compare_(compare) {}
+    template <typename InputIt>
+    FrozenSet(InputIt first, InputIt last, Compare const& compare = Compare());
+    FrozenSet(FrozenSet const& other);
+    FrozenSet(FrozenSet&& other) noexcept;
+    FrozenSet& operator=(FrozenSet other);
+    ~FrozenSet();
+
+    const_iterator find(T const& element) const;
+    const_iterator lower_bound(T const& element) const;
+    const_iterator upper_bound(T const& element) const;
+    std::pair<const_iterator, const_iterator> equal_range(T const& element) const;
+    bool contains(T const& element) const { return find(element) != end(); }
+
+    bool empty() const { return size_ == 0; }
+    size_type size() const { return size_; }
+
+    void swap(FrozenSet& other) noexcept;
+
+    key_compare key_comp() const { return compare_; }
+    value_compare value_comp() const { return compare_; }
+
+    const_iterator begin() const;
+    const_iterator end() const { return const_iterator(this, 0); }
+    const_reverse_iterator rbegin() const { return const_reverse_iterator(end()); }
+    const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
+
+private:
+    template <typename, typename, typename, typename>
+    friend struct Set;
+    friend iterator;
+
+    static constexpr std::size_t CACHE_LINE = 64;
+    // the descendants four levels below slot k are slots 16k ... 16k + 15, a cache line of int keys
+    static constexpr std::size_t PREFETCH_STRIDE = 16;
+
+    void* storage_ = nullptr;
+    T* keys_ = nullptr;
+    size_type size_ = 0;
+    Compare compare_;
+
+    void layout(std::vector<T const*> const& sorted);
+    static void in_order(std::vector<T const*> const& sorted, std::vector<T const*>& slots, std::size_t slot, std::size_t& rank);
+    void prefetch(std::size_t slot) const;
+    T const& key(std::size_t slot) const { return keys_[slot]; }
+    std::size_t next(std::size_t slot) const;
+    std::size_t prev(std::size_t slot) const;
+};
+
+template <typename T, typename Compare>
+constexpr std::size_t FrozenSet<T, Compare, EytzingerLayout>::CACHE_LINE;
+template <typename T, typename Compare>
+constexpr std::size_t FrozenSet<T, Compare, EytzingerLayout>::PREFETCH_STRIDE;
+
+template <typename T, typename Compare>
+template <typename InputIt>
+FrozenSet<T, Compare, EytzingerLayout>::FrozenSet(InputIt first, InputIt last, Compare const& compare) : compare_(compare) {
+    std::vector<T> values(first, last);
+    std::stable_sort(values.begin(), values.end(), compare_);
+    values.erase(std::unique(values.begin(), values.end(), [this](T const& first, T const& second) {
+        return !compare_(first, second);
+    }), values.end());
+
+    std::vector<T const*> sorted;
+    sorted.reserve(values.size());
+    for (T const& value : values)
+        sorted.push_back(&value);
+    layout(sorted);
+}
+
+template <typename T, typename Compare>
+FrozenSet<T, Compare, EytzingerLayout>::FrozenSet(FrozenSet const& other) : compare_(other.compare_) {
+    std::vector<T const*> sorted;
+    sorted.reserve(other.size_);
+    for (T const& value : other)
+        sorted.push_back(&value);
+    layout(sorted);
+}
+
+template <typename T, typename Compare>
+FrozenSet<T, Compare, EytzingerLayout>::FrozenSet(FrozenSet&& other) noexcept : compare_(other.compare_) {
+    swap(other);
+}
+
+template <typename T, typename Compare>
+FrozenSet<T, Compare, EytzingerLayout>& FrozenSet<T, Compare, EytzingerLayout>::operator=(FrozenSet other) {
+    swap(other);
+    return *this;
+}
+
+template <typename T, typename Compare>
+FrozenSet<T, Compare, EytzingerLayout>::~FrozenSet() {
+    for (std::size_t slot = 1; slot <= size_; slot++)
+        keys_[slot].~T();
+    ::operator delete(storage_);
+}
+
+// Copies the sorted keys into a fresh array in Eytzinger order. Slot 0 starts a cache line,
+// so each group of PREFETCH_STRIDE slots a prefetch targets is one line for small keys.
+template <typename T, typename Compare>
+void FrozenSet<T, Compare, EytzingerLayout>::layout(std::vector<T const*> const& sorted) {
+    static_assert(alignof(T) <= CACHE_LINE, "over-aligned types are not supported");
+    std::size_t size = sorted.size();
+    if (size == 0)
+        return;
+
+    std::vector<T const*> slots(size + 1);
+    std::size_t rank = 0;
+    in_order(sorted, slots, 1, rank);
+
+    storage_ = ::operator new((size + 1) * sizeof(T) + CACHE_LINE);
+    std::uintptr_t address = reinterpret_cast<std::uintptr_t>(storage_);
+    keys_ = reinterpret_cast<T*>((address + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE);
+    try {
+        for (; size_ < size; size_++)
+            new (keys_ + size_ + 1) T(*slots[size_ + 1]);
+    } catch (...) {
+        for (; size_ > 0; size_--)
+            keys_[size_].~T();
+        ::operator delete(storage_);
+        storage_ = nullptr;
+        keys_ = nullptr;
+        throw;
+    }
+}
+
+// An in-order walk of the implicit tree hands out the keys in sorted order. It recurses
+// only as deep as the tree, log2(size) levels.
+template <typename T, typename Compare>
+void FrozenSet<T, Compare, EytzingerLayout>::in_order(std::vector<T const*> const& sorted, std::vector<T const*>& slots,
+                                     std::size_t slot, std::size_t& rank) {
+    if (slot >= slots.size())
+        return;
+    in_order(sorted, slots, 2 * slot, rank);
+    slots[slot] = sorted[rank++];
+    in_order(sorted, slots, 2 * slot + 1, rank);
+}
+
+template <typename T, typename Compare>
+void FrozenSet<T, Compare, EytzingerLayout>::prefetch(std::size_t slot) const {
+    // the address may lie past the array, a prefetch never faults
+    __builtin_prefetch(reinterpret_cast<char const*>(keys_) + slot * PREFETCH_STRIDE * sizeof(T));
+}
+
+// The walk goes right past every key less than element, so the answer is the last node it
+// went left at: strip the trailing right turns, and the left turn, off the final slot.
+// A result of 0 means every key is less.
+template <typename T, typename Compare>
+typename FrozenSet<T, Compare, EytzingerLayout>::const_iterator FrozenSet<T, Compare, EytzingerLayout>::lower_bound(T const &element) const {
+    std::size_t slot = 1;
+    while (slot <= size_) {
+        prefetch(slot);
+        slot = 2 * slot + static_cast<std::size_t>(compare_(keys_[slot], element));
+    }
+    slot >>= __builtin_ctzll(~static_cast<unsigned long long>(slot)) + 1;
+    return const_iterator(this, slot);
+}
+
+template <typename T, typename Compare>
+typename FrozenSet<T, Compare, EytzingerLayout>::const_iterator FrozenSet<T, Compare, EytzingerLayout>::upper_bound(T const &element) const {
+    std::size_t slot = 1;
+    while (slot <= size_) {
+        prefetch(slot);
+        slot = 2 * slot + static_cast<std::size_t>(!compare_(element, keys_[slot]));
+    }
+    slot >>= __builtin_ctzll(~static_cast<unsigned long long>(slot)) + 1;
+    return const_iterator(this, slot);
+}
+
+template <typename T, typename Compare>
+typename FrozenSet<T, Compare, EytzingerLayout>::const_iterator FrozenSet<T, Compare, EytzingerLayout>::find(T const &element) const {
+    const_iterator it = lower_bound(element);
+    if (it.slot == 0 || compare_(element, keys_[it.slot]))
+        return end();
+    return it;
+}
+
+template <typename T, typename Compare>
+std::pair<typename FrozenSet<T, Compare, EytzingerLayout>::const_iterator, typename FrozenSet<T, Compare, EytzingerLayout>::const_iterator>
+FrozenSet<T, Compare, EytzingerLayout>::equal_range(T const &element) const {
+    const_iterator lower = lower_bound(element);
+    if (lower.slot == 0 || compare_(element, keys_[lower.slot]))
+        return {lower, lower};
+    const_iterator upper = lower;
+    return {lower, ++upper};
+}
+
+template <typename T, typename Compare>
+typename FrozenSet<T, Compare, EytzingerLayout>::const_iterator FrozenSet<T, Compare, EytzingerLayout>::begin() const {
+    std::size_t slot = 1;
+    while (2 * slot <= size_)
+        slot = 2 * slot;
+    return const_iterator(this, size_ == 0 ? 0 : slot);
+}
+
+// In-order successor in the implicit tree, 0 after the last key.
+template <typename T, typename Compare>
+std::size_t FrozenSet<T, Compare, EytzingerLayout>::next(std::size_t slot) const {
+    if (2 * slot + 1 <= size_) {
+        slot = 2 * slot + 1;
+        while (2 * slot <= size_)
+            slot = 2 * slot;
+        return slot;
+    }
+    while (slot & 1)
+        slot >>= 1;
+    return slot >> 1;
+}
+
+// In-order predecessor, the end slot 0 steps back to the last key.
+template <typename T, typename Compare>
+std::size_t FrozenSet<T, Compare, EytzingerLayout>::prev(std::size_t slot) const {
+    if (slot == 0) {
+        slot = 1;
+        while (2 * slot + 1 <= size_)
+            slot = 2 * slot + 1;
+        return slot;
+    }
+    if (2 * slot <= size_) {
+        slot = 2 * slot;
+        while (2 * slot + 1 <= size_)
+            slot = 2 * slot + 1;
+        return slot;
+    }
+    while (slot > 1 && !(slot & 1))
+        slot >>= 1;
+    return slot >> 1;
+}
+
+template <typename T, typename Compare>
+void FrozenSet<T, Compare, EytzingerLayout>::swap(FrozenSet &other) noexcept {
+    std::swap(storage_, other.storage_);
+    std::swap(keys_, other.keys_);
+    std::swap(size_, other.size_);
+    std::swap(compare_, other.compare_);
+}
+
+// The source tree's nodes in van Emde Boas order: a tree of height h is cut at half its
+// height, the top half is stored first and then every subtree hanging below it, each of them
+// laid out the same way recursively. Whatever the block size of a cache level (or a page), a
+// root-to-leaf walk touches only O(log_B n) blocks, so one layout suits every machine.
+//
+// The nodes carry explicit 32-bit links. A missing child is instead a thread to the in-order
+// neighbour, flagged by THREAD, so iterating needs neither parent links nor a stack.
+template <typename T, typename Compare>
+struct FrozenSet<T, Compare, VanEmdeBoasLayout> {
+    using value_type = T;
+    using key_type = T;
+    using key_compare = Compare;
+    using value_compare = Compare;
+    using size_type = std::size_t;
+
+    using iterator = set_detail::FrozenIterator<FrozenSet, T const>;
+    using const_iterator = iterator;
+    using reverse_iterator = std::reverse_iterator<iterator>;
+    using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+    FrozenSet() {}
+    explicit FrozenSet(Compare const& compare) : compare_(compare) {}
+    // the keys get a balanced shape
+    template <typename InputIt>
+    FrozenSet(InputIt first, InputIt last, Compare const& compare = Compare());
+    FrozenSet(FrozenSet const& other);
+    FrozenSet(FrozenSet&& other) noexcept;
+    FrozenSet& operator=(FrozenSet other);
+    ~FrozenSet();
+
+    const_iterator find(T const& element) const;
+    const_iterator lower_bound(T const& element) const;
+    const_iterator upper_bound(T const& element) const;
+    std::pair<const_iterator, const_iterator> equal_range(T const& element) const;
+    bool contains(T const& element) const { return find(element) != end(); }
+
+    bool empty() const { return size_ == 0; }
+    size_type size() const { return size_; }
+
+    void swap(FrozenSet& other) noexcept;
+
+    key_compare key_comp() const { return compare_; }
+    value_compare value_comp() const { return compare_; }
+
+    const_iterator begin() const;
+    const_iterator end() const { return const_iterator(this, 0); }
+    const_reverse_iterator rbegin() const { return const_reverse_iterator(end()); }
+    const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
+
+private:
+    template <typename, typename, typename, typename>
+    friend struct Set;
+    friend iterator;
+
+    static constexpr std::uint32_t THREAD = 1u << 31;
+
+    struct Node {
+        T key;
+        std::uint32_t left;
+        std::uint32_t right;
+    };
+
+    // A tree to lay out: nodes are numbered from 1 in any order, 0 is no child.
+    struct Shape {
+        std::vector<T const*> keys;
+        std::vector<std::uint32_t> left;
+        std::vector<std::uint32_t> right;
+        std::uint32_t root = 0;
+
+        explicit Shape(std::size_t size) : keys(size + 1), left(size + 1), right(size + 1) {}
+    };
+
+    // slot 0 is unused, the root is slot 1
+    Node* nodes_ = nullptr;
+    size_type size_ = 0;
+    Compare compare_;
+
+    void layout(std::vector<T const*> const& sorted);
+    template <typename SourceNode>
+    void layout_tree(SourceNode* root, size_type size);
+    void layout(Shape const& shape);
+    static std::uint32_t balance(Shape& shape, std::vector<T const*> const& sorted, std::size_t from, std::size_t to);
+    static void order(Shape const& shape, std::uint32_t root, unsigned height, std::vector<std::uint32_t>& slots, std::uint32_t& next);
+    T const& key(std::size_t slot) const { return nodes_[slot].key; }
+    std::size_t next(std::size_t slot) const;
+    std::size_t prev(std::size_t slot) const;
+};
+
+template <typename T, typename Compare>
+constexpr std::uint32_t FrozenSet<T, Compare, VanEmdeBoasLayout>::THREAD;
+
+template <typename T, typename Compare>
+template <typename InputIt>
+FrozenSet<T, Compare, VanEmdeBoasLayout>::FrozenSet(InputIt first, InputIt last, Compare const& compare) : compare_(compare) {
+    std::vector<T> values(first, last);
+    std::stable_sort(values.begin(), values.end(), compare_);
+    values.erase(std::unique(values.begin(), values.end(), [this](T const& first, T const& second) {
+        return !compare_(first, second);
+    }), values.end());
+
+    std::vector<T const*> sorted;
+    sorted.reserve(values.size());
+    for (T const& value : values)
+        sorted.push_back(&value);
+    layout(sorted);
+}
+
+// the copy keeps the layout: slot numbers double as node numbers of the shape
+template <typename T, typename Compare>
+FrozenSet<T, Compare, VanEmdeBoasLayout>::FrozenSet(FrozenSet const& other) : compare_(other.compare_) {
+    Shape shape(other.size_);
+    for (std::size_t slot = 1; slot <= other.size_; slot++) {
+        Node const& node = other.nodes_[slot];
+        shape.keys[slot] = &node.key;
+        shape.left[slot] = node.left & THREAD ? 0 : node.left;
+        shape.right[slot] = node.right & THREAD ? 0 : node.right;
+    }
+    shape.root = other.size_ == 0 ? 0 : 1;
+    layout(shape);
+}
+
+template <typename T, typename Compare>
+FrozenSet<T, Compare, VanEmdeBoasLayout>::FrozenSet(FrozenSet&& other) noexcept : compare_(other.compare_) {
+    swap(other);
+}
+
+template <typename T, typename Compare>
+FrozenSet<T, Compare, VanEmdeBoasLayout>& FrozenSet<T, Compare, VanEmdeBoasLayout>::operator=(FrozenSet other) {
+    swap(other);
+    return *this;
+}
+
+template <typename T, typename Compare>
+FrozenSet<T, Compare, VanEmdeBoasLayout>::~FrozenSet() {
+    for (std::size_t slot = 1; slot <= size_; slot++)
+        nodes_[slot].~Node();
+    ::operator delete(nodes_);
+}
+
+template <typename T, typename Compare>
+void FrozenSet<T, Compare, VanEmdeBoasLayout>::layout(std::vector<T const*> const& sorted) {
+    Shape shape(sorted.size());
+    shape.root = balance(shape, sorted, 0, sorted.size());
+    layout(shape);
+}
+
+// Numbers the nodes of a binary tree (anything with left, right and value()) in the order
+// they are found. The stack holds at most one pending right child per level.
+template <typename T, typename Compare>
+template <typename SourceNode>
+void FrozenSet<T, Compare, VanEmdeBoasLayout>::layout_tree(SourceNode* root, size_type size) {
+    Shape shape(size);
+    if (root != nullptr) {
+        std::uint32_t count = 1;
+        std::vector<std::pair<SourceNode*, std::uint32_t>> stack{{root, 1}};
+        shape.root = 1;
+        while (!stack.empty()) {
+            SourceNode* node = stack.back().first;
+            std::uint32_t id = stack.back().second;
+            stack.pop_back();
+            shape.keys[id] = &node->value();
+            if (node->right != nullptr) {
+                shape.right[id] = ++count;
+                stack.push_back({node->right, count});
+            }
+            if (node->left != nullptr) {
+                shape.left[id] = ++count;
+                stack.push_back({node->left, count});
+            }
+        }
+    }
+    layout(shape);
+}
+
+template <typename T, typename Compare>
+std::uint32_t FrozenSet<T, Compare, VanEmdeBoasLayout>::balance(Shape& shape, std::vector<T const*> const& sorted,
+                                                                std::size_t from, std::size_t to) {
+    if (from >= to)
+        return 0;
+    std::size_t middle = from + (to - from) / 2;
+    std::uint32_t id = static_cast<std::uint32_t>(middle + 1);
+    shape.keys[id] = sorted[middle];
+    shape.left[id] = balance(shape, sorted, from, middle);
+    shape.right[id] = balance(shape, sorted, middle + 1, to);
+    return id;
+}
+
+// Gives slots to the nodes less than height levels below root, in van Emde Boas order.
+template <typename T, typename Compare>
+void FrozenSet<T, Compare, VanEmdeBoasLayout>::order(Shape const& shape, std::uint32_t root, unsigned height,
+                                                     std::vector<std::uint32_t>& slots, std::uint32_t& next) {
+    if (height == 1) {
+        slots[root] = ++next;
+        return;
+    }
+
+    unsigned top = height / 2;
+    order(shape, root, top, slots, next);
+
+    // the roots of the bottom subtrees, top levels down, left to right
+    std::vector<std::uint32_t> bottoms;
+    std::vector<std::pair<std::uint32_t, unsigned>> stack{{root, 0}};
+    while (!stack.empty()) {
+        std::uint32_t id = stack.back().first;
+        unsigned depth = stack.back().second;
+        stack.pop_back();
+        if (depth == top) {
+            bottoms.push_back(id);
+            continue;
+        }
+        if (shape.right[id] != 0)
+            stack.push_back({shape.right[id], depth + 1});
+        if (shape.left[id] != 0)
+            stack.push_back({shape.left[id], depth + 1});
+    }
+    for (std::uint32_t bottom : bottoms)
+        order(shape, bottom, height - top, slots, next);
+}
+
+template <typename T, typename Compare>
+void FrozenSet<T, Compare, VanEmdeBoasLayout>::layout(Shape const& shape) {
+    std::size_t size = shape.keys.size() - 1;
+    if (size == 0)
+        return;
+    if (size >= THREAD)
+        throw std::length_error("FrozenSet: too many keys for VanEmdeBoasLayout");
+
+    unsigned height = 0;
+    std::vector<std::pair<std::uint32_t, unsigned>> stack{{shape.root, 1}};
+    while (!stack.empty()) {
+        std::uint32_t id = stack.back().first;
+        unsigned depth = stack.back().second;
+        stack.pop_back();
+        height = std::max(height, depth);
+        if (shape.left[id] != 0)
+            stack.push_back({shape.left[id], depth + 1});
+        if (shape.right[id] != 0)
+            stack.push_back({shape.right[id], depth + 1});
+    }
+
+    std::vector<std::uint32_t> slots(size + 1);
+    std::uint32_t next = 0;
+    order(shape, shape.root, height, slots, next);
+
+    // links by slot; walking in order, missing children become threads to the neighbours
+    std::vector<std::uint32_t> ids(size + 1);
+    std::vector<std::uint32_t> left(size + 1);
+    std::vector<std::uint32_t> right(size + 1);
+    for (std::uint32_t id = 1; id <= size; id++) {
+        ids[slots[id]] = id;
+        left[slots[id]] = slots[shape.left[id]];
+        right[slots[id]] = slots[shape.right[id]];
+    }
+    std::vector<std::uint32_t> path;
+    std::uint32_t previous = 0;
+    for (std::uint32_t id = shape.root; id != 0 || !path.empty();) {
+        if (id != 0) {
+            path.push_back(id);
+            id = shape.left[id];
+            continue;
+        }
+        id = path.back();
+        path.pop_back();
+        if (shape.left[id] == 0)
+            left[slots[id]] = THREAD | slots[previous];
+        if (previous != 0 && shape.right[previous] == 0)
+            right[slots[previous]] = THREAD | slots[id];
+        previous = id;
+        id = shape.right[id];
+    }
+    right[slots[previous]] = THREAD;
+
+    nodes_ = static_cast<Node*>(::operator new((size + 1) * sizeof(Node)));
+    try {
+        for (; size_ < size; size_++) {
+            std::uint32_t slot = static_cast<std::uint32_t>(size_ + 1);
+            new (nodes_ + slot) Node{*shape.keys[ids[slot]], left[slot], right[slot]};
+        }
+    } catch (...) {
+        for (; size_ > 0; size_--)
+            nodes_[size_].~Node();
+        ::operator delete(nodes_);
+        nodes_ = nullptr;
+        throw;
+    }
+}
+
+// The walk remembers the last node it went left at, and stops at the first thread.
+template <typename T, typename Compare>
+typename FrozenSet<T, Compare, VanEmdeBoasLayout>::const_iterator
+FrozenSet<T, Compare, VanEmdeBoasLayout>::lower_bound(T const &element) const {
+    std::uint32_t result = 0;
+    std::uint32_t link = size_ == 0 ? THREAD : 1;
+    while (!(link & THREAD)) {
+        Node const& node = nodes_[link];
+        bool right = compare_(node.key, element);
+        result = right ? result : link;
+        link = right ? node.right : node.left;
+    }
+    return const_iterator(this, result);
+}
+
+template <typename T, typename Compare>
+typename FrozenSet<T, Compare, VanEmdeBoasLayout>::const_iterator
+FrozenSet<T, Compare, VanEmdeBoasLayout>::upper_bound(T const &element) const {
+    std::uint32_t result = 0;
+    std::uint32_t link = size_ == 0 ? THREAD : 1;
+    while (!(link & THREAD)) {
+        Node const& node = nodes_[link];
+        bool right = !compare_(element, node.key);
+        result = right ? result : link;
+        link = right ? node.right : node.left;
+    }
+    return const_iterator(this, result);
+}
+
+template <typename T, typename Compare>
+typename FrozenSet<T, Compare, VanEmdeBoasLayout>::const_iterator
+FrozenSet<T, Compare, VanEmdeBoasLayout>::find(T const &element) const {
+    const_iterator it = lower_bound(element);
+    if (it.slot == 0 || compare_(element, nodes_[it.slot].key))
+        return end();
+    return it;
+}
+
+template <typename T, typename Compare>
+std::pair<typename FrozenSet<T, Compare, VanEmdeBoasLayout>::const_iterator,
+          typename FrozenSet<T, Compare, VanEmdeBoasLayout>::const_iterator>
+FrozenSet<T, Compare, VanEmdeBoasLayout>::equal_range(T const &element) const {
+    const_iterator lower = lower_bound(element);
+    if (lower.slot == 0 || compare_(element, nodes_[lower.slot].key))
+        return {lower, lower};
+    const_iterator upper = lower;
+    return {lower, ++upper};
+}
+
+template <typename T, typename Compare>
+typename FrozenSet<T, Compare, VanEmdeBoasLayout>::const_iterator FrozenSet<T, Compare, VanEmdeBoasLayout>::begin() const {
+    if (size_ == 0)
+        return end();
+    std::size_t slot = 1;
+    while (!(nodes_[slot].left & THREAD))
+        slot = nodes_[slot].left;
+    return const_iterator(this, slot);
+}
+
+template <typename T, typename Compare>
+std::size_t FrozenSet<T, Compare, VanEmdeBoasLayout>::next(std::size_t slot) const {
+    std::uint32_t link = nodes_[slot].right;
+    if (link & THREAD)
+        return link & ~THREAD;
+    slot = link;
+    while (!(nodes_[slot].left & THREAD))
+        slot = nodes_[slot].left;
+    return slot;
+}
+
+// the end slot 0 steps back to the last key
+template <typename T, typename Compare>
+std::size_t FrozenSet<T, Compare, VanEmdeBoasLayout>::prev(std::size_t slot) const {
+    if (slot == 0) {
+        slot = 1;
+    } else {
+        std::uint32_t link = nodes_[slot].left;
+        if (link & THREAD)
+            return link & ~THREAD;
+        slot = link;
+    }
+    while (!(nodes_[slot].right & THREAD))
+        slot = nodes_[slot].right;
+    return slot;
+}
+
+template <typename T, typename Compare>
+void FrozenSet<T, Compare, VanEmdeBoasLayout>::swap(FrozenSet &other) noexcept {
+    std::swap(nodes_, other.nodes_);
+    std::swap(size_, other.size_);
+    std::swap(compare_, other.compare_);
+}
+
+template <typename T, typename Compare, typename Layout>
+void swap(FrozenSet<T, Compare, Layout>& first, FrozenSet<T, Compare, Layout>& second) noexcept {
+    first.swap(second);
+}
+
+#endif //SET_FROZENSET_H
@@ -0,0 +1,494 @@
+#ifndef SET_LOCKFREESET_H
+#define SET_LOCKFREESET_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <utility>
+
+#include "EpochReclaimer.h"
+
+// An ordered set that any number of threads may update and read at once without locks: a
+// skip list after Fraser, "Practical lock-freedom", and Herlihy and Shavit, "The art of
+// multiprocessor programming". No operation waits for another; a thread that loses a race
+// only retries its own step.
+//
+// An element is erased by marking the links of its node, level 0 last; the mark on level 0
+// is the moment it leaves the set. Searches unlink marked nodes they pass. A node goes to
+// the set's EpochReclaimer once neither the thread that inserted it nor the one that erased
+// it can still link it back, and is freed when no other thread can still be looking at it.
+// The reclaimer lets its lists grow rather than wait, so a reader that stays pinned, an
+// iterator held for long, delays frees but never blocks an update.
+//
+// Iterators walk level 0 in order while updates go on, and see each element that is in the
+// set for the whole walk. An iterator pins the epoch of the thread that made it and has to
+// stay on that thread. Compare and the allocator are called from several threads at once.
+template <typename T, typename Compare = std::less<T>, typename Allocator = std::allocator<T>>
+struct LockFreeSet {
+private:
+    using Link = std::atomic<std::uintptr_t>;
+    struct Node;
+    struct Slot;
+    struct Iterator;
+    using slot_allocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Slot>;
+    using slot_traits = std::allocator_traits<slot_allocator>;
+public:
+
+    using value_type = T;
+    using key_type = T;
+    using key_compare = Compare;
+    using value_compare = Compare;
+    using allocator_type = Allocator;
+    using size_type = std::size_t;
+
+    using iterator = Iterator;
+    using const_iterator = iterator;
+
+    explicit LockFreeSet(Compare const& compare = Compare(), Allocator const& allocator = Allocator());
+    template <typename InputIt>
+    LockFreeSet(InputIt first, InputIt last, Compare const& compare = Compare(), Allocator const& allocator = Allocator());
+    LockFreeSet(LockFreeSet const&) = delete;
+    LockFreeSet& operator=(LockFreeSet const&) = delete;
+    ~LockFreeSet();
+
+    std::pair<iterator, bool> insert(T const& element);
+    std::pair<iterator, bool> insert(T&& element);
+    template <typename... Args>
+    std::pair<iterator, bool> emplace(Args&&... args);
+    size_type erase(T const& element);
+    // erases *it, returns the element after it
+    iterator erase(const_iterator it);
+
+    iterator find(T const& element) const;
+    bool contains(T const& element) const;
+    iterator lower_bound(T const& element) const;
+    iterator upper_bound(T const& element) const;
+
+    iterator begin() const;
+    iterator end() const { return iterator(); }
+
+    // exact when no update is running
+    size_type size() const { return size_.load(std::memory_order_relaxed); }
+    bool empty() const { return size() == 0; }
+
+    allocator_type get_allocator() const { return allocator_type(allocator_); }
+    key_compare key_comp() const { return compare_; }
+    value_compare value_comp() const { return compare_; }
+
+private:
+    // with a quarter of the nodes on each level above the last, enough for 4^16 elements
+    static const unsigned MAX_HEIGHT = 16;
+    // the low bit of a link marks its node as erased from that level
+    static const std::uintptr_t MARK = 1;
+
+    enum Outcome { NO, YES, RESTART };
+
+    Link head_[MAX_HEIGHT];
+    std::atomic<size_type> size_{0};
+    Compare compare_;
+    mutable slot_allocator allocator_;
+    // after allocator_: it frees the nodes still retired when it goes
+    mutable EpochReclaimer reclaimer_{64, 4096, EpochReclaimer::GROW};
+
+    static Node* pointer(std::uintptr_t link) { return reinterpret_cast<Node*>(link & ~MARK); }
+    static std::uintptr_t address(Node* node) { return reinterpret_cast<std::uintptr_t>(node); }
+    static bool marked(std::uintptr_t link) { return (link & MARK) != 0; }
+    static unsigned random_height();
+    static Node* next_live(Link const& link);
+
+    template <typename... Args>
+    Node* make_node(unsigned height, Args&&... args);
+    void free_node(Node* node);
+    void release(Node* node);
+    static void free_retired(void* node, void* set);
+
+    bool search(T const& element, Link** preds, Node** succs);
+    Outcome try_search(T const& element, Link** preds, Node** succs);
+    void link_upper(Node* node, Link** preds, Node** succs);
+    Node* unlink(T const& element);
+    template <typename Less>
+    Node* seek(Less less) const;
+};
+
+template <typename T, typename Compare, typename Allocator>
+struct LockFreeSet<T, Compare, Allocator>::Node {
+    template <typename... Args>
+    explicit Node(unsigned height, Args&&... args) : value(std::forward<Args>(args)...), height(height) {}
+
+    // height links follow the node in the same allocation
+    Link* links() { return reinterpret_cast<Link*>(reinterpret_cast<unsigned char*>(this) + links_offset()); }
+
+    static constexpr std::size_t links_offset() {
+        return (sizeof(Node) + alignof(Link) - 1) / alignof(Link) * alignof(Link);
+    }
+    static std::size_t slots(unsigned height) {
+        return (links_offset() + height * sizeof(Link) + sizeof(Slot) - 1) / sizeof(Slot);
+    }
+
+    T value;
+    unsigned const height;
+    // the inserting and the erasing thread each let go once they can no longer link it
+    std::atomic<unsigned> owners{2};
+};
+
+template <typename T, typename Compare, typename Allocator>
+struct LockFreeSet<T, Compare, Allocator>::Slot {
+    alignas(Node) alignas(Link) unsigned char bytes[alignof(Node) > alignof(Link) ? alignof(Node) : alignof(Link)];
+};
+
+template <typename T, typename Compare, typename Allocator>
+struct LockFreeSet<T, Compare, Allocator>::Iterator {
+    using iterator_category = std::forward_iterator_tag;
+    using difference_type = std::ptrdiff_t;
+    using value_type = T const;
+    using pointer = T const*;
+    using reference = T const&;
+
+    friend struct LockFreeSet;
+    Iterator() : reclaimer(nullptr), node(nullptr) {}
+    Iterator(Iterator const& other) : reclaimer(other.reclaimer), node(other.node) {
+        if (node != nullptr)
+            reclaimer->pin();
+    }
+    Iterator& operator=(Iterator const& other) {
+        if (other.node != nullptr)
+            other.reclaimer->pin();
+        if (node != nullptr)
+            reclaimer->unpin();
+        reclaimer = other.reclaimer;
+        node = other.node;
+        return *this;
+    }
+    ~Iterator() {
+        if (node != nullptr)
+            reclaimer->unpin();
+    }
+
+    Iterator& operator++() {
+        node = next_live(node->links()[0]);
+        if (node == nullptr)
+            reclaimer->unpin();
+        return *this;
+    }
+    const Iterator operator++(int) {
+        Iterator temp(*this);
+        ++*this;
+        return temp;
+    }
+
+    T const& operator*() const { return node->value; }
+    T const* operator->() const { return &node->value; }
+    friend bool operator==(Iterator const& first, Iterator const& second) { return first.node == second.node; }
+    friend bool operator!=(Iterator const& first, Iterator const& second) { return first.node != second.node; }
+
+private:
+    Iterator(EpochReclaimer& reclaimer, Node* node) : reclaimer(&reclaimer), node(node) {
+        if (node != nullptr)
+            reclaimer.pin();
+    }
+    EpochReclaimer* reclaimer;
+    Node* node;
+};
+
+template <typename T, typename Compare, typename Allocator>
+LockFreeSet<T, Compare, Allocator>::LockFreeSet(Compare const& compare, Allocator const& allocator)
+        : compare_(compare), allocator_(allocator) {
+    for (Link& link : head_)
+        link.store(0, std::memory_order_relaxed);
+}
+
+template <typename T, typename Compare, typename Allocator>
+template <typename InputIt>
+LockFreeSet<T, Compare, Allocator>::LockFreeSet(InputIt first, InputIt last, Compare const& compare,
+                                                Allocator const& allocator)
+        : LockFreeSet(compare, allocator) {
+    for (; first != last; ++first)
+        emplace(*first);
+}
+
+// Nodes still in the list are on level 0; the retired ones go with reclaimer_.
+template <typename T, typename Compare, typename Allocator>
+LockFreeSet<T, Compare, Allocator>::~LockFreeSet() {
+    Node* node = pointer(head_[0].load(std::memory_order_relaxed));
+    while (node != nullptr) {
+        Node* next = pointer(node->links()[0].load(std::memory_order_relaxed));
+        free_node(node);
+        node = next;
+    }
+}
+
+template <typename T, typename Compare, typename Allocator>
+unsigned LockFreeSet<T, Compare, Allocator>::random_height() {
+    static std::atomic<std::uint32_t> seeds(0x9e3779b9u);
+    static thread_local std::uint32_t state = seeds.fetch_add(0x9e3779b9u, std::memory_order_relaxed) | 1;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    std::uint32_t bits = state;
+    unsigned height = 1;
+    while (height < MAX_HEIGHT && (bits & 3) == 0) {
+        height++;
+        bits >>= 2;
+    }
+    return height;
+}
+
+// The first node from link on that is not erased, or nullptr.
+template <typename T, typename Compare, typename Allocator>
+typename LockFreeSet<T, Compare, Allocator>::Node* LockFreeSet<T, Compare, Allocator>::next_live(Link const& link) {
+    Node* node = pointer(link.load(std::memory_order_acquire));
+    while (node != nullptr) {
+        std::uintptr_t next = node->links()[0].load(std::memory_order_acquire);
+        if (!marked(next))
+            return node;
+        node = pointer(next);
+    }
+    return nullptr;
+}
+
+template <typename T, typename Compare, typename Allocator>
+template <typename... Args>
+typename LockFreeSet<T, Compare, Allocator>::Node*
+LockFreeSet<T, Compare, Allocator>::make_node(unsigned height, Args&&... args) {
+    Slot* slots = slot_traits::allocate(allocator_, Node::slots(height));
+    Node* node = reinterpret_cast<Node*>(slots);
+    try {
+        ::new (static_cast<void*>(node)) Node(height, std::forward<Args>(args)...);
+    } catch (...) {
+        slot_traits::deallocate(allocator_, slots, Node::slots(height));
+        throw;
+    }
+    for (unsigned level = 0; level < height; level++)
+        ::new (static_cast<void*>(node->links() + level)) Link(0);
+    return node;
+}
+
+template <typename T, typename Compare, typename Allocator>
+void LockFreeSet<T, Compare, Allocator>::free_node(Node *node) {
+    unsigned height = node->height;
+    node->~Node();
+    slot_traits::deallocate(allocator_, reinterpret_cast<Slot*>(node), Node::slots(height));
+}
+
+// Retires node once both its inserter and its eraser are done with it.
+template <typename T, typename Compare, typename Allocator>
+void LockFreeSet<T, Compare, Allocator>::release(Node *node) {
+    if (node->owners.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        reclaimer_.retire(node, &free_retired, this);
+}
+
+template <typename T, typename Compare, typename Allocator>
+void LockFreeSet<T, Compare, Allocator>::free_retired(void *node, void *set) {
+    static_cast<LockFreeSet*>(set)->free_node(static_cast<Node*>(node));
+}
+
+// Fills preds and succs with, on every level, the last link before element and the first
+// node not less than it, unlinking the erased nodes on the way. Whether element is there.
+template <typename T, typename Compare, typename Allocator>
+bool LockFreeSet<T, Compare, Allocator>::search(T const &element, Link **preds, Node **succs) {
+    Outcome outcome;
+    while ((outcome = try_search(element, preds, succs)) == RESTART) {}
+    return outcome == YES;
+}
+
+template <typename T, typename Compare, typename Allocator>
+typename LockFreeSet<T, Compare, Allocator>::Outcome
+LockFreeSet<T, Compare, Allocator>::try_search(T const &element, Link **preds, Node **succs) {
+    Link* pred = head_;
+    for (unsigned level = MAX_HEIGHT; level-- > 0;) {
+        Node* current = pointer(pred[level].load(std::memory_order_acquire));
+        while (current != nullptr) {
+            std::uintptr_t next = current->links()[level].load(std::memory_order_acquire);
+            if (marked(next)) {
+                // fails when pred itself was erased or changed, then start over
+                std::uintptr_t expected = address(current);
+                if (!pred[level].compare_exchange_strong(expected, next & ~MARK, std::memory_order_acq_rel,
+                                                         std::memory_order_relaxed))
+                    return RESTART;
+                current = pointer(next);
+                continue;
+            }
+            if (!compare_(current->value, element))
+                break;
+            pred = current->links();
+            current = pointer(next);
+        }
+        preds[level] = pred;
+        succs[level] = current;
+    }
+    return succs[0] != nullptr && !compare_(element, succs[0]->value) ? YES : NO;
+}
+
+// The first node that less is false for, read only: erased nodes are stepped over.
+template <typename T, typename Compare, typename Allocator>
+template <typename Less>
+typename LockFreeSet<T, Compare, Allocator>::Node* LockFreeSet<T, Compare, Allocator>::seek(Less less) const {
+    Link const* pred = head_;
+    Node* current = nullptr;
+    for (unsigned level = MAX_HEIGHT; level-- > 0;) {
+        current = pointer(pred[level].load(std::memory_order_acquire));
+        while (current != nullptr) {
+            std::uintptr_t next = current->links()[level].load(std::memory_order_acquire);
+            if (marked(next)) {
+                current = pointer(next);
+                continue;
+            }
+            if (!less(current->value))
+                break;
+            pred = current->links();
+            current = pointer(next);
+        }
+    }
+    return current;
+}
+
+template <typename T, typename Compare, typename Allocator>
+std::pair<typename LockFreeSet<T, Compare, Allocator>::iterator, bool>
+LockFreeSet<T, Compare, Allocator>::insert(T const &element) {
+    return emplace(element);
+}
+
+template <typename T, typename Compare, typename Allocator>
+std::pair<typename LockFreeSet<T, Compare, Allocator>::iterator, bool>
+LockFreeSet<T, Compare, Allocator>::insert(T &&element) {
+    return emplace(std::move(element));
+}
+
+// The node goes into level 0 first, which puts the element in the set, then into the
+// levels above one at a time.
+template <typename T, typename Compare, typename Allocator>
+template <typename... Args>
+std::pair<typename LockFreeSet<T, Compare, Allocator>::iterator, bool>
+LockFreeSet<T, Compare, Allocator>::emplace(Args &&... args) {
+    Node* node = make_node(random_height(), std::forward<Args>(args)...);
+    EpochReclaimer::Guard guard(reclaimer_);
+    Link* preds[MAX_HEIGHT];
+    Node* succs[MAX_HEIGHT];
+    while (true) {
+        if (search(node->value, preds, succs)) {
+            free_node(node);
+            return {iterator(reclaimer_, succs[0]), false};
+        }
+        for (unsigned level = 0; level < node->height; level++)
+            node->links()[level].store(address(succs[level]), std::memory_order_relaxed);
+        std::uintptr_t expected = address(succs[0]);
+        if (preds[0][0].compare_exchange_strong(expected, address(node), std::memory_order_release,
+                                                std::memory_order_relaxed))
+            break;
+    }
+    size_.fetch_add(1, std::memory_order_relaxed);
+    iterator inserted(reclaimer_, node);
+    link_upper(node, preds, succs);
+    release(node);
+    return {inserted, true};
+}
+
+// Stops early when the node is erased meanwhile; a link it made after the eraser cleaned up
+// is then undone by one more search.
+template <typename T, typename Compare, typename Allocator>
+void LockFreeSet<T, Compare, Allocator>::link_upper(Node *node, Link **preds, Node **succs) {
+    for (unsigned level = 1; level < node->height; level++) {
+        bool linked = false;
+        while (!linked) {
+            std::uintptr_t next = node->links()[level].load(std::memory_order_acquire);
+            if (marked(next))
+                break;
+            if (next != address(succs[level]) &&
+                !node->links()[level].compare_exchange_strong(next, address(succs[level]), std::memory_order_acq_rel))
+                break;
+            std::uintptr_t expected = address(succs[level]);
+            linked = preds[level][level].compare_exchange_strong(expected, address(node), std::memory_order_release,
+                                                                 std::memory_order_relaxed);
+            if (!linked && (!search(node->value, preds, succs) || succs[0] != node))
+                break;
+        }
+        if (!linked)
+            break;
+    }
+    if (marked(node->links()[0].load(std::memory_order_acquire)))
+        search(node->value, preds, succs);
+}
+
+// The node is let go of while pinned, so retiring it never waits for other readers.
+template <typename T, typename Compare, typename Allocator>
+typename LockFreeSet<T, Compare, Allocator>::size_type LockFreeSet<T, Compare, Allocator>::erase(T const &element) {
+    EpochReclaimer::Guard guard(reclaimer_);
+    Node* node = unlink(element);
+    if (node == nullptr)
+        return 0;
+    release(node);
+    return 1;
+}
+
+// The links are marked from the top down; whoever marks level 0 has erased the element and
+// gets its node, still owned.
+template <typename T, typename Compare, typename Allocator>
+typename LockFreeSet<T, Compare, Allocator>::Node* LockFreeSet<T, Compare, Allocator>::unlink(T const &element) {
+    EpochReclaimer::Guard guard(reclaimer_);
+    Link* preds[MAX_HEIGHT];
+    Node* succs[MAX_HEIGHT];
+    if (!search(element, preds, succs))
+        return nullptr;
+    Node* node = succs[0];
+    for (unsigned level = node->height - 1; level > 0; level--)
+        node->links()[level].fetch_or(MARK, std::memory_order_acq_rel);
+    std::uintptr_t next = node->links()[0].load(std::memory_order_relaxed);
+    do {
+        if (marked(next))
+            return nullptr;
+    } while (!node->links()[0].compare_exchange_weak(next, next | MARK, std::memory_order_acq_rel,
+                                                     std::memory_order_relaxed));
+    size_.fetch_sub(1, std::memory_order_relaxed);
+    search(element, preds, succs);
+    return node;
+}
+
+template <typename T, typename Compare, typename Allocator>
+typename LockFreeSet<T, Compare, Allocator>::iterator LockFreeSet<T, Compare, Allocator>::erase(const_iterator it) {
+    iterator next = it;
+    ++next;
+    erase(*it);
+    return next;
+}
+
+template <typename T, typename Compare, typename Allocator>
+typename LockFreeSet<T, Compare, Allocator>::iterator LockFreeSet<T, Compare, Allocator>::find(T const &element) const {
+    EpochReclaimer::Guard guard(reclaimer_);
+    Node* node = seek([this, &element](T const& value) { return compare_(value, element); });
+    if (node == nullptr || compare_(element, node->value))
+        return end();
+    return iterator(reclaimer_, node);
+}
+
+template <typename T, typename Compare, typename Allocator>
+bool LockFreeSet<T, Compare, Allocator>::contains(T const &element) const {
+    EpochReclaimer::Guard guard(reclaimer_);
+    Node* node = seek([this, &element](T const& value) { return compare_(value, element); });
+    return node != nullptr && !compare_(element, node->value);
+}
+
+template <typename T, typename Compare, typename Allocator>
+typename LockFreeSet<T, Compare, Allocator>::iterator
+LockFreeSet<T, Compare, Allocator>::lower_bound(T const &element) const {
+    EpochReclaimer::Guard guard(reclaimer_);
+    return iterator(reclaimer_, seek([this, &element](T const& value) { return compare_(value, element); }));
+}
+
+template <typename T, typename Compare, typename Allocator>
+typename LockFreeSet<T, Compare, Allocator>::iterator
+LockFreeSet<T, Compare, Allocator>::upper_bound(T const &element) const {
+    EpochReclaimer::Guard guard(reclaimer_);
+    return iterator(reclaimer_, seek([this, &element](T const& value) { return !compare_(element, value); }));
+}
+
+template <typename T, typename Compare, typename Allocator>
+typename LockFreeSet<T, Compare, Allocator>::iterator LockFreeSet<T, Compare, Allocator>::begin() const {
+    EpochReclaimer::Guard guard(reclaimer_);
+    return iterator(reclaimer_, next_live(head_[0]));
+}
+
+#endif //SET_LOCKFREESET_H
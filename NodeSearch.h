@@ -0,0 +1,168 @@
+#ifndef SET_NODESEARCH_H
+#define SET_NODESEARCH_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#include <immintrin.h>
+#define SET_SIMD_SEARCH 1
+#endif
+
+namespace set_detail {
+
+// Search inside one sorted B-tree node.
+template <typename T, typename Compare>
+struct NodeSearch {
+    // index of the first key not less than element
+    static std::size_t lower(T const* keys, std::size_t count, T const& element, Compare const& compare) {
+        return std::lower_bound(keys, keys + count, element, compare) - keys;
+    }
+
+    // index of the first key greater than element
+    static std::size_t upper(T const* keys, std::size_t count, T const& element, Compare const& compare) {
+        return std::upper_bound(keys, keys + count, element, compare) - keys;
+    }
+};
+
+#ifdef SET_SIMD_SEARCH
+
+// For keys ordered by std::less, the bounds in a sorted node are counts: lower is the number
+// of keys less than element, upper the number not greater. A whole node is compared at once,
+// several keys per instruction and without a branch per key, and the comparison masks are
+// popcounted. SSE2 is always there on x86-64, AVX2 is picked at run time when the CPU has it.
+namespace simd {
+
+inline bool has_avx2() {
+    static const bool supported = __builtin_cpu_supports("avx2");
+    return supported;
+}
+
+template <bool Inclusive, typename T>
+std::size_t count_scalar(T const* keys, std::size_t count, T element) {
+    std::size_t result = 0;
+    for (std::size_t i = 0; i < count; i++)
+        result += Inclusive ? !(element < keys[i]) : keys[i] < element;
+    return result;
+}
+
+// unsigned keys compare as signed ones once the sign bit is flipped
+inline __m128i bias(__m128i value, std::int32_t) { return value; }
+inline __m128i bias(__m128i value, std::uint32_t) {
+    return _mm_xor_si128(value, _mm_set1_epi32(INT32_MIN));
+}
+
+template <bool Inclusive, typename T>
+std::size_t count_sse2(T const* keys, std::size_t count, T element) {
+    __m128i query = bias(_mm_set1_epi32(static_cast<std::int32_t>(element)), element);
+    std::size_t result = 0;
+    std::size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i block = bias(_mm_loadu_si128(reinterpret_cast<__m128i const*>(keys + i)), element);
+        // key <= element is !(key > element), key < element is element > key
+        __m128i mask = Inclusive ? _mm_cmpgt_epi32(block, query) : _mm_cmpgt_epi32(query, block);
+        int bits = __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(mask)));
+        result += Inclusive ? 4 - bits : bits;
+    }
+    return result + count_scalar<Inclusive>(keys + i, count - i, element);
+}
+
+template <bool Inclusive>
+std::size_t count_sse2(float const* keys, std::size_t count, float element) {
+    __m128 query = _mm_set1_ps(element);
+    std::size_t result = 0;
+    std::size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 block = _mm_loadu_ps(keys + i);
+        __m128 mask = Inclusive ? _mm_cmple_ps(block, query) : _mm_cmplt_ps(block, query);
+        result += __builtin_popcount(_mm_movemask_ps(mask));
+    }
+    return result + count_scalar<Inclusive>(keys + i, count - i, element);
+}
+
+__attribute__((target("avx2"))) inline __m256i bias(__m256i value, std::int32_t) { return value; }
+__attribute__((target("avx2"))) inline __m256i bias(__m256i value, std::uint32_t) {
+    return _mm256_xor_si256(value, _mm256_set1_epi32(INT32_MIN));
+}
+
+template <bool Inclusive, typename T>
+__attribute__((target("avx2"))) std::size_t count_avx2(T const* keys, std::size_t count, T element) {
+    __m256i query = bias(_mm256_set1_epi32(static_cast<std::int32_t>(element)), element);
+    std::size_t result = 0;
+    std::size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i block = bias(_mm256_loadu_si256(reinterpret_cast<__m256i const*>(keys + i)), element);
+        __m256i mask = Inclusive ? _mm256_cmpgt_epi32(block, query) : _mm256_cmpgt_epi32(query, block);
+        int bits = __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(mask)));
+        result += Inclusive ? 8 - bits : bits;
+    }
+    return result + count_sse2<Inclusive>(keys + i, count - i, element);
+}
+
+template <bool Inclusive>
+__attribute__((target("avx2"))) std::size_t count_avx2(float const* keys, std::size_t count, float element) {
+    __m256 query = _mm256_set1_ps(element);
+    std::size_t result = 0;
+    std::size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 block = _mm256_loadu_ps(keys + i);
+        __m256 mask = _mm256_cmp_ps(block, query, Inclusive ? _CMP_LE_OQ : _CMP_LT_OQ);
+        result += __builtin_popcount(_mm256_movemask_ps(mask));
+    }
+    return result + count_sse2<Inclusive>(keys + i, count - i, element);
+}
+
+template <bool Inclusive>
+__attribute__((target("avx2"))) std::size_t count_avx2(std::int64_t const* keys, std::size_t count, std::int64_t element) {
+    __m256i query = _mm256_set1_epi64x(element);
+    std::size_t result = 0;
+    std::size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(keys + i));
+        __m256i mask = Inclusive ? _mm256_cmpgt_epi64(block, query) : _mm256_cmpgt_epi64(query, block);
+        int bits = __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(mask)));
+        result += Inclusive ? 4 - bits : bits;
+    }
+    return result + count_scalar<Inclusive>(keys + i, count - i, element);
+}
+
+// SSE2 has no 64-bit compare, without AVX2 the keys are compared one by one
+template <bool Inclusive>
+std::size_t count_sse2(std::int64_t const* keys, std::size_t count, std::int64_t element) {
+    return count_scalar<Inclusive>(keys, count, element);
+}
+
+template <bool Inclusive, typename T>
+std::size_t count_keys(T const* keys, std::size_t count, T element) {
+    return has_avx2() ? count_avx2<Inclusive>(keys, count, element) : count_sse2<Inclusive>(keys, count, element);
+}
+
+template <typename T>
+struct CountingSearch {
+    static std::size_t lower(T const* keys, std::size_t count, T const& element, std::less<T> const&) {
+        return count_keys<false>(keys, count, element);
+    }
+
+    static std::size_t upper(T const* keys, std::size_t count, T const& element, std::less<T> const&) {
+        return count_keys<true>(keys, count, element);
+    }
+};
+
+}
+
+template <>
+struct NodeSearch<std::int32_t, std::less<std::int32_t>> : simd::CountingSearch<std::int32_t> {};
+template <>
+struct NodeSearch<std::uint32_t, std::less<std::uint32_t>> : simd::CountingSearch<std::uint32_t> {};
+template <>
+struct NodeSearch<std::int64_t, std::less<std::int64_t>> : simd::CountingSearch<std::int64_t> {};
+template <>
+struct NodeSearch<float, std::less<float>> : simd::CountingSearch<float> {};
+
+#endif
+
+}
+
+#endif //SET_NODESEARCH_H
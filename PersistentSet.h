@@ -0,0 +1,570 @@
+#ifndef SET_PERSISTENTSET_H
+#define SET_PERSISTENTSET_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "Set.h"
+
+// An immutable set whose updates return new versions: insert and erase copy the O(log n)
+// nodes on the search path and share every other subtree with the version they started
+// from, so a snapshot is a copy of the set, O(1). Nodes are reference counted and freed
+// with the last version that uses them, on whichever thread drops it; the allocator has to
+// allow that. Versions may be read, copied and destroyed from any number of threads, one
+// PersistentSet object is as thread safe as an int.
+//
+// The tree is an AVL tree without parent pointers, which path copying cannot keep up. An
+// iterator holds the path to its node instead and is valid while its version lives.
+template <typename T, typename Compare = std::less<T>, typename Allocator = std::allocator<T>>
+struct PersistentSet {
+private:
+    struct Node;
+    using node_allocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Node>;
+    using node_traits = std::allocator_traits<node_allocator>;
+    template <typename V>
+    struct Iterator;
+public:
+
+    using value_type = T;
+    using key_type = T;
+    using key_compare = Compare;
+    using value_compare = Compare;
+    using allocator_type = Allocator;
+    using size_type = std::size_t;
+
+    using iterator = Iterator<T const>;
+    using const_iterator = iterator;
+    using reverse_iterator = std::reverse_iterator<iterator>;
+    using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+    PersistentSet() {}
+    explicit PersistentSet(Compare const& compare, Allocator const& allocator = Allocator())
+            : compare_(compare), allocator_(allocator) {}
+    explicit PersistentSet(Allocator const& allocator) : allocator_(allocator) {}
+    // O(n log n), O(n) when the range is sorted
+    template <typename InputIt>
+    PersistentSet(InputIt first, InputIt last, Compare const& compare = Compare(), Allocator const& allocator = Allocator());
+    // O(n), the set is already in order
+    template <typename SetAllocator, typename Balance>
+    explicit PersistentSet(Set<T, Compare, SetAllocator, Balance> const& set, Allocator const& allocator = Allocator());
+
+    // O(1), the versions share all their nodes
+    PersistentSet(PersistentSet const& other);
+    PersistentSet(PersistentSet&& other) noexcept;
+    PersistentSet& operator=(PersistentSet const& other);
+    PersistentSet& operator=(PersistentSet&& other) noexcept;
+    ~PersistentSet() { release(root_); }
+
+    // The set with element added, or this version if it is there already. O(log n) new nodes.
+    PersistentSet insert(T const& element) const { return insert_impl(element); }
+    PersistentSet insert(T&& element) const { return insert_impl(std::move(element)); }
+    // The set without element, or this version if it is not there. O(log n) new nodes.
+    PersistentSet erase(T const& element) const;
+
+    const_iterator find(T const& element) const;
+    const_iterator lower_bound(T const& element) const;
+    const_iterator upper_bound(T const& element) const;
+    bool contains(T const& element) const;
+
+    bool empty() const { return root_ == nullptr; }
+    size_type size() const { return size_; }
+    void clear();
+    void swap(PersistentSet& other) noexcept;
+    // true when both versions are the same tree, as after a copy or a no-op update
+    bool same_version(PersistentSet const& other) const { return root_ == other.root_; }
+
+    allocator_type get_allocator() const { return allocator_type(allocator_); }
+    key_compare key_comp() const { return compare_; }
+    value_compare value_comp() const { return compare_; }
+
+    const_iterator begin() const;
+    const_iterator end() const { return const_iterator(root_); }
+
+    const_reverse_iterator rbegin() const { return const_reverse_iterator(end()); }
+    const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
+
+private:
+    // an AVL tree of this height holds more than 2^62 nodes
+    static const int MAX_HEIGHT = 90;
+
+    Node* root_ = nullptr;
+    size_type size_ = 0;
+    Compare compare_;
+    // mutable: a const version allocates the nodes of the versions made from it
+    mutable node_allocator allocator_;
+
+    static int height(Node const* node) { return node == nullptr ? 0 : node->height; }
+    static Node* retain(Node* node) noexcept;
+    void release(Node* node) const noexcept;
+    template <typename V>
+    Node* make(V&& value, Node* left, Node* right) const;
+    Node* balance(T const& value, Node* left, Node* right) const;
+    Node* rotate_right(T const& value, Node* left, Node* right) const;
+    Node* rotate_left(T const& value, Node* left, Node* right) const;
+
+    template <typename K>
+    PersistentSet insert_impl(K&& element) const;
+    template <typename K>
+    Node* insert_node(Node* node, K&& element) const;
+    Node* erase_node(Node* node, T const& element) const;
+    Node* erase_min(Node* node, Node*& min) const;
+    template <typename RandomIt>
+    Node* build(RandomIt first, RandomIt last) const;
+    // build() moves the values of a range it owns and copies those of a Set
+    static T&& value_of(T& value) { return std::move(value); }
+    static T const& value_of(std::reference_wrapper<T const> value) { return value.get(); }
+};
+
+template <typename T, typename Compare, typename Allocator>
+struct PersistentSet<T, Compare, Allocator>::Node {
+    template <typename V>
+    explicit Node(V&& value) : value(std::forward<V>(value)) {}
+
+    T value;
+    Node* left = nullptr;
+    Node* right = nullptr;
+    std::atomic<size_type> refs{1};
+    int height = 1;
+};
+
+template <typename T, typename Compare, typename Allocator>
+template <typename InputIt>
+PersistentSet<T, Compare, Allocator>::PersistentSet(InputIt first, InputIt last, Compare const& compare,
+                                                    Allocator const& allocator)
+        : compare_(compare), allocator_(allocator) {
+    std::vector<T> values(first, last);
+    if (!std::is_sorted(values.begin(), values.end(), compare_))
+        std::stable_sort(values.begin(), values.end(), compare_);
+    values.erase(std::unique(values.begin(), values.end(), [this](T const& first, T const& second) {
+        return !compare_(first, second);
+    }), values.end());
+    root_ = build(values.begin(), values.end());
+    size_ = values.size();
+}
+
+template <typename T, typename Compare, typename Allocator>
+template <typename SetAllocator, typename Balance>
+PersistentSet<T, Compare, Allocator>::PersistentSet(Set<T, Compare, SetAllocator, Balance> const& set,
+                                                    Allocator const& allocator)
+        : compare_(set.key_comp()), allocator_(allocator) {
+    std::vector<std::reference_wrapper<T const>> values(set.begin(), set.end());
+    root_ = build(values.begin(), values.end());
+    size_ = values.size();
+}
+
+template <typename T, typename Compare, typename Allocator>
+PersistentSet<T, Compare, Allocator>::PersistentSet(PersistentSet const& other)
+        : root_(retain(other.root_)), size_(other.size_), compare_(other.compare_), allocator_(other.allocator_) {}
+
+template <typename T, typename Compare, typename Allocator>
+PersistentSet<T, Compare, Allocator>::PersistentSet(PersistentSet&& other) noexcept
+        : root_(other.root_), size_(other.size_), compare_(other.compare_), allocator_(other.allocator_) {
+    other.root_ = nullptr;
+    other.size_ = 0;
+}
+
+template <typename T, typename Compare, typename Allocator>
+PersistentSet<T, Compare, Allocator>& PersistentSet<T, Compare, Allocator>::operator=(PersistentSet const& other) {
+    PersistentSet temp(other);
+    swap(temp);
+    return *this;
+}
+
+template <typename T, typename Compare, typename Allocator>
+PersistentSet<T, Compare, Allocator>& PersistentSet<T, Compare, Allocator>::operator=(PersistentSet&& other) noexcept {
+    PersistentSet temp(std::move(other));
+    swap(temp);
+    return *this;
+}
+
+template <typename T, typename Compare, typename Allocator>
+void PersistentSet<T, Compare, Allocator>::clear() {
+    release(root_);
+    root_ = nullptr;
+    size_ = 0;
+}
+
+template <typename T, typename Compare, typename Allocator>
+void PersistentSet<T, Compare, Allocator>::swap(PersistentSet &other) noexcept {
+    std::swap(root_, other.root_);
+    std::swap(size_, other.size_);
+    std::swap(compare_, other.compare_);
+    std::swap(allocator_, other.allocator_);
+}
+
+template <typename T, typename Compare, typename Allocator>
+typename PersistentSet<T, Compare, Allocator>::Node* PersistentSet<T, Compare, Allocator>::retain(Node *node) noexcept {
+    if (node != nullptr)
+        node->refs.fetch_add(1, std::memory_order_relaxed);
+    return node;
+}
+
+// Drops one reference; a node that loses its last one drops its children's. Left subtrees
+// recurse and right ones loop, so the depth is bounded by the height.
+template <typename T, typename Compare, typename Allocator>
+void PersistentSet<T, Compare, Allocator>::release(Node *node) const noexcept {
+    while (node != nullptr && node->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        release(node->left);
+        Node* right = node->right;
+        node_traits::destroy(allocator_, node);
+        node_traits::deallocate(allocator_, node, 1);
+        node = right;
+    }
+}
+
+// A new node owning the given references to its children; they are dropped if it throws.
+template <typename T, typename Compare, typename Allocator>
+template <typename V>
+typename PersistentSet<T, Compare, Allocator>::Node*
+PersistentSet<T, Compare, Allocator>::make(V&& value, Node *left, Node *right) const {
+    Node* node;
+    try {
+        node = node_traits::allocate(allocator_, 1);
+        try {
+            node_traits::construct(allocator_, node, std::forward<V>(value));
+        } catch (...) {
+            node_traits::deallocate(allocator_, node, 1);
+            throw;
+        }
+    } catch (...) {
+        release(left);
+        release(right);
+        throw;
+    }
+    node->left = left;
+    node->right = right;
+    node->height = 1 + std::max(height(left), height(right));
+    return node;
+}
+
+// make() that restores the AVL invariant, the children's heights differ by at most two.
+template <typename T, typename Compare, typename Allocator>
+typename PersistentSet<T, Compare, Allocator>::Node*
+PersistentSet<T, Compare, Allocator>::balance(T const& value, Node *left, Node *right) const {
+    if (height(left) > height(right) + 1)
+        return rotate_right(value, left, right);
+    if (height(right) > height(left) + 1)
+        return rotate_left(value, left, right);
+    return make(value, left, right);
+}
+
+// The rotated nodes may be shared, so they are copied rather than relinked.
+template <typename T, typename Compare, typename Allocator>
+typename PersistentSet<T, Compare, Allocator>::Node*
+PersistentSet<T, Compare, Allocator>::rotate_right(T const& value, Node *left, Node *right) const {
+    Node* root;
+    try {
+        if (height(left->left) >= height(left->right)) {
+            Node* lower = make(value, retain(left->right), right);
+            root = make(left->value, retain(left->left), lower);
+        } else {
+            Node* pivot = left->right;
+            Node* lower_left;
+            try {
+                lower_left = make(left->value, retain(left->left), retain(pivot->left));
+            } catch (...) {
+                release(right);
+                throw;
+            }
+            Node* lower_right;
+            try {
+                lower_right = make(value, retain(pivot->right), right);
+            } catch (...) {
+                release(lower_left);
+                throw;
+            }
+            root = make(pivot->value, lower_left, lower_right);
+        }
+    } catch (...) {
+        release(left);
+        throw;
+    }
+    release(left);
+    return root;
+}
+
+template <typename T, typename Compare, typename Allocator>
+typename PersistentSet<T, Compare, Allocator>::Node*
+PersistentSet<T, Compare, Allocator>::rotate_left(T const& value, Node *left, Node *right) const {
+    Node* root;
+    try {
+        if (height(right->right) >= height(right->left)) {
+            Node* lower = make(value, left, retain(right->left));
+            root = make(right->value, lower, retain(right->right));
+        } else {
+            Node* pivot = right->left;
+            Node* lower_right;
+            try {
+                lower_right = make(right->value, retain(pivot->right), retain(right->right));
+            } catch (...) {
+                release(left);
+                throw;
+            }
+            Node* lower_left;
+            try {
+                lower_left = make(value, left, retain(pivot->left));
+            } catch (...) {
+                release(lower_right);
+                throw;
+            }
+            root = make(pivot->value, lower_left, lower_right);
+        }
+    } catch (...) {
+        release(right);
+        throw;
+    }
+    release(right);
+    return root;
+}
+
+template <typename T, typename Compare, typename Allocator>
+template <typename K>
+PersistentSet<T, Compare, Allocator> PersistentSet<T, Compare, Allocator>::insert_impl(K&& element) const {
+    PersistentSet result(*this);
+    Node* root = insert_node(root_, std::forward<K>(element));
+    if (root != nullptr) {
+        result.release(result.root_);
+        result.root_ = root;
+        ++result.size_;
+    }
+    return result;
+}
+
+// The new path down to element, or nullptr if it is there already.
+template <typename T, typename Compare, typename Allocator>
+template <typename K>
+typename PersistentSet<T, Compare, Allocator>::Node*
+PersistentSet<T, Compare, Allocator>::insert_node(Node *node, K&& element) const {
+    if (node == nullptr)
+        return make(std::forward<K>(element), nullptr, nullptr);
+
+    if (compare_(element, node->value)) {
+        Node* left = insert_node(node->left, std::forward<K>(element));
+        return left == nullptr ? nullptr : balance(node->value, left, retain(node->right));
+    }
+    if (compare_(node->value, element)) {
+        Node* right = insert_node(node->right, std::forward<K>(element));
+        return right == nullptr ? nullptr : balance(node->value, retain(node->left), right);
+    }
+    return nullptr;
+}
+
+template <typename T, typename Compare, typename Allocator>
+PersistentSet<T, Compare, Allocator> PersistentSet<T, Compare, Allocator>::erase(T const &element) const {
+    PersistentSet result(*this);
+    if (!contains(element))
+        return result;
+    Node* root = erase_node(root_, element);
+    result.release(result.root_);
+    result.root_ = root;
+    --result.size_;
+    return result;
+}
+
+// The subtree without element, which it holds.
+template <typename T, typename Compare, typename Allocator>
+typename PersistentSet<T, Compare, Allocator>::Node*
+PersistentSet<T, Compare, Allocator>::erase_node(Node *node, T const &element) const {
+    if (compare_(element, node->value)) {
+        Node* left = erase_node(node->left, element);
+        return balance(node->value, left, retain(node->right));
+    }
+    if (compare_(node->value, element)) {
+        Node* right = erase_node(node->right, element);
+        return balance(node->value, retain(node->left), right);
+    }
+
+    if (node->left == nullptr)
+        return retain(node->right);
+    if (node->right == nullptr)
+        return retain(node->left);
+    // the successor takes the place of node
+    Node* min;
+    Node* right = erase_min(node->right, min);
+    return balance(min->value, retain(node->left), right);
+}
+
+template <typename T, typename Compare, typename Allocator>
+typename PersistentSet<T, Compare, Allocator>::Node*
+PersistentSet<T, Compare, Allocator>::erase_min(Node *node, Node*& min) const {
+    if (node->left == nullptr) {
+        min = node;
+        return retain(node->right);
+    }
+    Node* left = erase_min(node->left, min);
+    return balance(node->value, left, retain(node->right));
+}
+
+// A perfectly balanced tree over sorted, distinct values.
+template <typename T, typename Compare, typename Allocator>
+template <typename RandomIt>
+typename PersistentSet<T, Compare, Allocator>::Node*
+PersistentSet<T, Compare, Allocator>::build(RandomIt first, RandomIt last) const {
+    if (first == last)
+        return nullptr;
+    RandomIt middle = first + (last - first) / 2;
+    Node* left = build(first, middle);
+    Node* right;
+    try {
+        right = build(middle + 1, last);
+    } catch (...) {
+        release(left);
+        throw;
+    }
+    return make(value_of(*middle), left, right);
+}
+
+template <typename T, typename Compare, typename Allocator>
+typename PersistentSet<T, Compare, Allocator>::const_iterator PersistentSet<T, Compare, Allocator>::begin() const {
+    const_iterator it(root_);
+    for (Node* node = root_; node != nullptr; node = node->left)
+        it.path_[it.depth_++] = node;
+    return it;
+}
+
+template <typename T, typename Compare, typename Allocator>
+typename PersistentSet<T, Compare, Allocator>::const_iterator
+PersistentSet<T, Compare, Allocator>::find(T const &element) const {
+    const_iterator it = lower_bound(element);
+    if (it == end() || compare_(element, *it))
+        return end();
+    return it;
+}
+
+// The path is kept down to the last node where the search went left, the first not less.
+template <typename T, typename Compare, typename Allocator>
+typename PersistentSet<T, Compare, Allocator>::const_iterator
+PersistentSet<T, Compare, Allocator>::lower_bound(T const &element) const {
+    const_iterator it(root_);
+    int depth = 0;
+    for (Node* node = root_; node != nullptr;) {
+        it.path_[it.depth_++] = node;
+        if (compare_(node->value, element)) {
+            node = node->right;
+        } else {
+            depth = it.depth_;
+            node = node->left;
+        }
+    }
+    it.depth_ = depth;
+    return it;
+}
+
+template <typename T, typename Compare, typename Allocator>
+typename PersistentSet<T, Compare, Allocator>::const_iterator
+PersistentSet<T, Compare, Allocator>::upper_bound(T const &element) const {
+    const_iterator it(root_);
+    int depth = 0;
+    for (Node* node = root_; node != nullptr;) {
+        it.path_[it.depth_++] = node;
+        if (compare_(element, node->value)) {
+            depth = it.depth_;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+    it.depth_ = depth;
+    return it;
+}
+
+template <typename T, typename Compare, typename Allocator>
+bool PersistentSet<T, Compare, Allocator>::contains(T const &element) const {
+    Node* node = root_;
+    while (node != nullptr) {
+        if (compare_(element, node->value))
+            node = node->left;
+        else if (compare_(node->value, element))
+            node = node->right;
+        else return true;
+    }
+    return false;
+}
+
+template <typename T, typename Compare, typename Allocator>
+void swap(PersistentSet<T, Compare, Allocator>& first, PersistentSet<T, Compare, Allocator>& second) noexcept {
+    first.swap(second);
+}
+
+// The path from the root to the current node, empty at the end.
+template <typename T, typename Compare, typename Allocator>
+template <typename V>
+struct PersistentSet<T, Compare, Allocator>::Iterator {
+    using iterator_category = std::bidirectional_iterator_tag;
+    using difference_type = std::ptrdiff_t;
+    using value_type = V;
+    using pointer = V*;
+    using reference = V&;
+
+    friend struct PersistentSet;
+    Iterator() {}
+    // only the path in use is copied
+    Iterator(Iterator const& other) : root_(other.root_), depth_(other.depth_) {
+        std::copy(other.path_, other.path_ + depth_, path_);
+    }
+    Iterator& operator=(Iterator const& other) {
+        root_ = other.root_;
+        depth_ = other.depth_;
+        std::copy(other.path_, other.path_ + depth_, path_);
+        return *this;
+    }
+
+    Iterator& operator++() {
+        Node* node = path_[depth_ - 1];
+        if (node->right != nullptr) {
+            for (node = node->right; node != nullptr; node = node->left)
+                path_[depth_++] = node;
+        } else {
+            // up past the nodes whose right subtree is done
+            do {
+                node = path_[--depth_];
+            } while (depth_ > 0 && path_[depth_ - 1]->right == node);
+        }
+        return *this;
+    }
+    const Iterator operator++(int) {
+        Iterator temp(*this);
+        ++*this;
+        return temp;
+    }
+    Iterator& operator--() {
+        Node* node = depth_ == 0 ? nullptr : path_[depth_ - 1];
+        if (node == nullptr || node->left != nullptr) {
+            for (node = node == nullptr ? root_ : node->left; node != nullptr; node = node->right)
+                path_[depth_++] = node;
+        } else {
+            do {
+                node = path_[--depth_];
+            } while (depth_ > 0 && path_[depth_ - 1]->left == node);
+        }
+        return *this;
+    }
+    const Iterator operator--(int) {
+        Iterator temp(*this);
+        --*this;
+        return temp;
+    }
+
+    V& operator*() const { return path_[depth_ - 1]->value; }
+    V* operator->() const { return &path_[depth_ - 1]->value; }
+    friend bool operator==(Iterator const& first, Iterator const& second) {
+        return first.current() == second.current();
+    }
+    friend bool operator!=(Iterator const& first, Iterator const& second) { return !(first == second); }
+
+private:
+    explicit Iterator(Node* root) : root_(root) {}
+    Node* current() const { return depth_ == 0 ? nullptr : path_[depth_ - 1]; }
+
+    Node* root_ = nullptr;
+    int depth_ = 0;
+    Node* path_[MAX_HEIGHT];
+};
+
+#endif //SET_PERSISTENTSET_H
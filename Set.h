@@ -1,59 +1,227 @@
 #ifndef SET_SET_H
 #define SET_SET_H
 
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
 #include <iterator>
-#include <queue>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "BackgroundReclaimer.h"
+#include "BalancePolicy.h"
+#include "FrozenSet.h"
+#include "WorkerPool.h"
+
+namespace set_detail {
+
+template <typename Allocator>
+void swap_allocators(Allocator& first, Allocator& second, std::true_type) {
+    using std::swap;
+    swap(first, second);
+}
+
+template <typename Allocator>
+void swap_allocators(Allocator&, Allocator&, std::false_type) {}
+
+template <typename>
+struct void_type {
+    using type = void;
+};
+
+// Whether copies of an allocator may be used on several threads at once: stateless ones can,
+// a stateful one says so with a nested is_thread_safe type.
+template <typename Allocator, typename = void>
+struct is_thread_safe_allocator : std::allocator_traits<Allocator>::is_always_equal {};
+
+template <typename Allocator>
+struct is_thread_safe_allocator<Allocator, typename void_type<typename Allocator::is_thread_safe>::type>
+        : Allocator::is_thread_safe {};
+
+}
 
-template <typename T>
+template <typename T, typename Compare = std::less<T>, typename Allocator = std::allocator<T>,
+          typename Balance = RedBlackBalance>
 struct Set {
 private:
-    struct Node {
+    struct Node : set_detail::SubtreeSize<set_detail::has_subtree_size<Balance>::value> {
         Node *left;
         Node *right;
-        Node *parent;
 
-        Node() : left(nullptr), right(nullptr), parent(nullptr) {}
-        Node(Node* other) : left(other->left), right(other->right), parent(other->parent) {}
-        virtual ~Node() = default;
+        Node() : left(nullptr), right(nullptr), parent_(0) {}
+
+        void pull() { this->pull_size(left, right); }
 
         T& value() { return static_cast<ValueNode&>(*this).value; }
         Node* prev();
         Node* next();
+
+        // the balance policy's tag lives in the low bits of the parent pointer, nodes are at least 4-aligned
+        Node* parent() const { return reinterpret_cast<Node*>(parent_ & ~TAG); }
+        void set_parent(Node* parent) { parent_ = reinterpret_cast<std::uintptr_t>(parent) | (parent_ & TAG); }
+        unsigned tag() const { return static_cast<unsigned>(parent_ & TAG); }
+        void set_tag(unsigned tag) { parent_ = (parent_ & ~TAG) | tag; }
+
+    private:
+        static const std::uintptr_t TAG = 3;
+        std::uintptr_t parent_;
     };
+    // Nodes are not polymorphic: only ValueNodes are ever allocated, top_node_ is a bare Node
+    // and is never destroyed through a Node pointer.
     struct ValueNode : Node {
         T value;
 
-        ValueNode(T const& value) : Node(), value(value) {}
-        ValueNode(ValueNode* other) : Node(other), value(other->value) {}
-        ~ValueNode() = default;
+        template <typename... Args>
+        explicit ValueNode(Args&&... args) : Node(), value(std::forward<Args>(args)...) {}
     };
+    static_assert(alignof(Node) >= 4, "two tag bits are packed into the parent pointer");
+
+    using node_allocator = typename std::allocator_traits<Allocator>::template rebind_alloc<ValueNode>;
+    using node_traits = std::allocator_traits<node_allocator>;
 
     template <typename V>
     struct Iterator;
+    struct NodeHandle;
+    struct InsertReturn;
 public:
 
-    Set() noexcept;
+    using value_type = T;
+    using key_type = T;
+    using key_compare = Compare;
+    using value_compare = Compare;
+    using allocator_type = Allocator;
+    using size_type = std::size_t;
+
+    Set() noexcept(std::is_nothrow_default_constructible<Compare>::value &&
+                   std::is_nothrow_default_constructible<node_allocator>::value);
+    explicit Set(Compare const& compare, Allocator const& allocator = Allocator());
+    explicit Set(Allocator const& allocator);
+    template <typename InputIt>
+    Set(InputIt first, InputIt last, Compare const& compare = Compare(), Allocator const& allocator = Allocator());
     Set(Set const& other);
+    Set(Set&& other) noexcept;
     Set &operator=(Set const& other);
+    Set &operator=(Set&& other) noexcept(std::allocator_traits<Allocator>::propagate_on_container_move_assignment::value ||
+                                         std::allocator_traits<Allocator>::is_always_equal::value);
     ~Set();
 
+    static constexpr std::size_t node_size = sizeof(ValueNode);
+
     using iterator = Iterator<T const>;
     using const_iterator = iterator;
     using reverse_iterator = std::reverse_iterator<iterator>;
     using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+    using node_type = NodeHandle;
+    using insert_return_type = InsertReturn;
 
     std::pair<iterator, bool> insert(T const& element);
+    std::pair<iterator, bool> insert(T&& element);
+    template <typename... Args>
+    std::pair<iterator, bool> emplace(Args&&... args);
+    // amortized O(1) when the element goes right before or right after hint, a normal insert
+    // otherwise; returns the element or the equal one already there
+    iterator insert(const_iterator hint, T const& element);
+    iterator insert(const_iterator hint, T&& element);
+    template <typename... Args>
+    iterator emplace_hint(const_iterator hint, Args&&... args);
+    template <typename InputIt>
+    void insert(InputIt first, InputIt last);
+    // O(n + size()) when the range is sorted, O(n log n + size()) otherwise; a range of less
+    // than size() / 16 keys is linked in one by one instead, O(n log size()) and no rebuild
+    template <typename InputIt>
+    void insert_sorted(InputIt first, InputIt last);
     iterator erase(const_iterator it);
 
+    // Node handles move elements between sets without allocating or copying them. The node
+    // goes in as it is, so both sets need equal allocators.
+    node_type extract(const_iterator position);
+    node_type extract(T const& element);
+    insert_return_type insert(node_type&& node);
+    iterator insert(const_iterator hint, node_type&& node);
+    // moves over the nodes whose keys are not here yet, the others stay in source; with
+    // unequal allocators the values are moved instead of the nodes
+    void merge(Set& source);
+    void merge(Set&& source) { merge(source); }
+
+    // Moves the elements not less than element to the returned set. Both split and join relink
+    // the nodes, iterators stay valid and follow their elements. O(log n) for the red-black,
+    // AVL and treap policies, amortized for splay, O(n) for scapegoat; without OrderStatistics
+    // the sizes are not known, the first size() of each part counts it, O(n) once. The returned
+    // set shares this one's allocator, so both may be handed to different threads only when
+    // the allocator is safe for that, as std::allocator and SlabAllocator are.
+    Set split(T const& element);
+    // All of left, then all of right; when the keys overlap the sets are merged instead and
+    // the duplicates of right are dropped. O(log n) under the same terms.
+    static Set join(Set&& left, Set&& right);
+
+    // Set algebra by divide and conquer over split and join: this tree is split at the median
+    // key of the other set and both halves recurse, in parallel near the top. O(m log(n / m + 1))
+    // for m <= n elements, so a small delta into a large set is cheap. The nodes of this set
+    // are relinked, union_with(Set&&) relinks those of other too when the allocators are
+    // equal. Dropped nodes are freed by the calling thread. If a comparison throws, this set
+    // is left empty.
+    void union_with(Set const& other);
+    void union_with(Set&& other);
+    void intersect_with(Set const& other);
+    void difference_with(Set const& other);
+
+    // Threads the set operations may use, 0 for std::thread::hardware_concurrency(). They come
+    // from one pool shared by all sets, with a worker less than the hardware threads, and the
+    // calling thread. Like deferred_clear(), it is copied, moved and swapped along with the
+    // elements.
+    void set_parallelism(unsigned threads) { parallelism_ = threads; }
+    unsigned parallelism() const { return parallelism_; }
+
     const_iterator find(T const& element);
     const_iterator lower_bound(T const& element) const;
     const_iterator upper_bound(T const& element) const;
+    std::pair<const_iterator, const_iterator> equal_range(T const& element) const;
+
+    // Many lookups at once, one result per key in order: find_batch writes iterators (end() for
+    // a missing key), contains_batch writes bools. The descents of a group of keys advance a
+    // level at a time and prefetch the nodes they go to next, so their cache misses overlap
+    // instead of following each other. Unlike find() they never splay.
+    template <typename ForwardIt, typename OutputIt>
+    OutputIt find_batch(ForwardIt first, ForwardIt last, OutputIt out) const;
+    template <typename ForwardIt, typename OutputIt>
+    OutputIt contains_batch(ForwardIt first, ForwardIt last, OutputIt out) const;
+
+    // need OrderStatistics<...> as the balance policy
+    size_type rank(T const& element) const;
+    const_iterator nth(size_type index) const;
+    // the elements from <= x <= to, both ends included; 0 when to < from
+    size_type count_range(T const& from, T const& to) const;
+
+    // an immutable copy laid out for fast lookups, O(n); VanEmdeBoasLayout keeps this tree's shape
+    template <typename Layout = EytzingerLayout>
+    FrozenSet<T, Compare, Layout> freeze() const;
 
     bool empty() const;
+    size_type size() const;
     void clear();
 
+    // When enabled, clear() and the destructor detach the tree in O(1) and free it on the
+    // background reclamation thread. The nodes then leave with a copy of the allocator,
+    // a stateful one is replaced by select_on_container_copy_construction(). Node handles and
+    // split sets may still hold other copies, so a stateful allocator that does not declare
+    // is_thread_safe keeps clearing on the calling thread.
+    void set_deferred_clear(bool enabled) { deferred_clear_ = enabled; }
+    bool deferred_clear() const { return deferred_clear_; }
+
     void swap(Set& other);
 
+    allocator_type get_allocator() const { return allocator_type(allocator_); }
+    key_compare key_comp() const { return compare_; }
+    value_compare value_comp() const { return compare_; }
+
     iterator begin() { return iterator(begin_); }
     const_iterator begin() const { return const_iterator(begin_); }
     iterator end(){ return iterator(&top_node_); }
@@ -67,275 +235,1611 @@ public:
 private:
     Node top_node_;
     Node* begin_ = &top_node_;
+    // the rightmost node, so that appending a new maximum does not descend from the root
+    Node* last_ = &top_node_;
+    // false after a split without subtree sizes: size_ is then off by an unknown amount, and
+    // size() counts the nodes; inserts and erases still keep it up to date relative to that
+    mutable size_type size_ = 0;
+    mutable bool counted_ = true;
+    Balance balance_;
+    Compare compare_;
+    node_allocator allocator_;
+    bool deferred_clear_ = false;
+    unsigned parallelism_ = 0;
     Node* get_root() const { return top_node_.left; }
 
-    void build_impl(Node* root, Node* root_other);
-    void clear_impl(Node *node);
+    template <typename... Args>
+    Node* create(Args&&... args);
+    void destroy(Node* node) { destroy(allocator_, node); }
+    static void destroy(node_allocator& allocator, Node* node);
+
+    template <typename K>
+    std::pair<iterator, bool> insert_impl(K&& element);
+    Node* insert_position(T const& element, Node*& parent, bool& left);
+    Node* hint_position(Node* hint, T const& element, Node*& parent, bool& left);
+    template <typename K>
+    iterator insert_hint_impl(Node* hint, K&& element);
+    Node* link(Node* node, Node* parent, bool left);
+    void unlink(Node* node);
+    void append(Set& right);
+    Node* release_tree() noexcept;
+    void adopt_tree(Node* root) noexcept;
+    void reset_ends() noexcept;
+    Node* join_trees(Node* left, Node* middle, Node* right);
+    Node* join_trees(Node* left, Node* right);
+    Node* split_tree(Node* root, T const& key, Node*& left, Node*& right);
+    static void detach(Node* node) noexcept;
+
+    // below this many elements the set operations stay on the calling thread
+    static constexpr size_type PARALLEL_GRAIN = 1 << 14;
+    struct Dropped;
+    unsigned thread_count() const;
+    unsigned fork_levels(size_type size) const;
+    template <typename First, typename Second>
+    void fork_join(unsigned forks, First first, Second second, Node*& first_root, Node*& second_root,
+                   Node* middle, Dropped& dropped);
+    static std::vector<Node*> nodes_of(Set const& set);
+    Node* union_trees(Node* tree, Node* const* first, Node* const* last, unsigned forks, Dropped& dropped);
+    Node* intersect_trees(Node* tree, Node* const* first, Node* const* last, unsigned forks, Dropped& dropped);
+    Node* difference_trees(Node* tree, Node* const* first, Node* const* last, unsigned forks, Dropped& dropped);
+    size_type free_dropped(Dropped& dropped);
+    void size_parts(Set& right, std::true_type) noexcept;
+    void size_parts(Set& right, std::false_type) noexcept;
+    void steal(Set& other) noexcept;
+    void destroy_list(Node* list);
+    void link_list(Node* list);
+    Node* sort_list(Node* list, size_type& count);
+    Node* merge_list(Node* list, size_type& count);
+    void assign_list(Node* list, size_type count);
+    void move_assign(Set& other, std::true_type) noexcept;
+    void move_assign(Set& other, std::false_type);
+
+    void freeze_into(FrozenSet<T, Compare, EytzingerLayout>& frozen) const;
+    void freeze_into(FrozenSet<T, Compare, VanEmdeBoasLayout>& frozen) const;
+
+    struct CopyTask;
+    void copy_tree(Node* root_other);
+    void collect_copy_tasks(Node* source, Node* parent, bool left, unsigned depth, std::vector<CopyTask>& tasks);
+    void run_copy_tasks(node_allocator& allocator, std::vector<CopyTask>& tasks, std::atomic<std::size_t>& next,
+                        std::exception_ptr& error, std::mutex& error_mutex);
+    Node* clone_node(node_allocator& allocator, Node* source);
+    Node* clone_subtree(node_allocator& allocator, Node* source, Node* parent, Node*& root);
+    template <typename A>
+    static auto reserve_nodes(A& allocator, size_type count, int) -> decltype(allocator.reserve(count), void()) {
+        allocator.reserve(count);
+    }
+    template <typename A>
+    static void reserve_nodes(A&, size_type, long) {}
+    static size_type clear_impl(node_allocator& allocator, Node *node);
+    bool defer_clear(Node* root) noexcept;
     void erase_impl(Node* node);
-    Node* upper_lower_impl (T const& element) const;
+    Node* lower_bound_impl(T const& element) const;
+    Node* upper_bound_impl(T const& element) const;
+    static constexpr std::size_t BATCH_GROUP = 16;
+    template <typename ForwardIt>
+    ForwardIt find_group(ForwardIt first, ForwardIt last, Node** found) const;
+
 };
 
-template <typename T>
-Set<T>::Set() noexcept {}
+template <typename T, typename Compare, typename Allocator, typename Balance>
+constexpr std::size_t Set<T, Compare, Allocator, Balance>::node_size;
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+Set<T, Compare, Allocator, Balance>::Set()
+        noexcept(std::is_nothrow_default_constructible<Compare>::value &&
+                 std::is_nothrow_default_constructible<node_allocator>::value) {}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+Set<T, Compare, Allocator, Balance>::Set(Compare const& compare, Allocator const& allocator)
+        : compare_(compare), allocator_(allocator) {}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+Set<T, Compare, Allocator, Balance>::Set(Allocator const& allocator) : allocator_(allocator) {}
 
-template <typename T>
-Set<T>::Set(Set const& other) {
+template <typename T, typename Compare, typename Allocator, typename Balance>
+template <typename InputIt>
+Set<T, Compare, Allocator, Balance>::Set(InputIt first, InputIt last, Compare const& compare, Allocator const& allocator)
+        : Set(compare, allocator) {
+    insert_sorted(first, last);
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+Set<T, Compare, Allocator, Balance>::Set(Set const& other)
+        : size_(other.size()), balance_(other.balance_), compare_(other.compare_),
+          allocator_(node_traits::select_on_container_copy_construction(other.allocator_)),
+          deferred_clear_(other.deferred_clear_), parallelism_(other.parallelism_) {
     try {
-        if (other.top_node_.left) {
-            top_node_.left = new ValueNode(other.top_node_.left->value());
-            top_node_.left->parent = &top_node_;
-            build_impl(top_node_.left, other.top_node_.left);
-        }
+        if (other.top_node_.left)
+            copy_tree(other.top_node_.left);
         while (begin_->left)
             begin_ = begin_->left;
+        if (top_node_.left)
+            last_ = top_node_.left;
+        while (last_->right)
+            last_ = last_->right;
     } catch (...) {
         clear();
         throw;
     }
 }
 
-template <typename T>
-void Set<T>::build_impl(Node *root, Node *root_other) {
-    std::queue<std::pair<Node *, Node* >> pairs;
-    pairs.push({root, root_other});
+// A subtree below the top levels, cloned by whichever thread gets to it first.
+template <typename T, typename Compare, typename Allocator, typename Balance>
+struct Set<T, Compare, Allocator, Balance>::CopyTask {
+    Node* source;
+    Node* parent;
+    bool left;
+    Node* root;
+};
+
+// Clones the tree of another set with the same shape, tags and augmentation. The top levels
+// are cloned here and the subtrees below them by up to thread_count() threads of the worker
+// pool, four subtrees per thread to even out their sizes. The walks follow parent pointers
+// and need no extra space. Each thread allocates its own nodes, the workers through copies of
+// the allocator made here, so the copy only runs in parallel with an allocator that is safe
+// for that (see set_deferred_clear). On one thread the whole copy is reserved first, where
+// the allocator has reserve(). If a copy throws, what was cloned is left linked for clear().
+template <typename T, typename Compare, typename Allocator, typename Balance>
+void Set<T, Compare, Allocator, Balance>::copy_tree(Node *root_other) {
+    unsigned levels = set_detail::is_thread_safe_allocator<node_allocator>::value ? fork_levels(size_) : 0;
+    if (levels == 0)
+        reserve_nodes(allocator_, size_, 0);
+
+    std::vector<CopyTask> tasks;
+    collect_copy_tasks(root_other, &top_node_, true, levels == 0 ? 0 : levels + 2, tasks);
+
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    std::atomic<std::size_t> next(0);
+    unsigned threads = levels == 0 ? 1 : thread_count();
+    std::vector<node_allocator> allocators;
+    std::vector<std::shared_ptr<set_detail::WorkerPool::Task>> workers;
+    try {
+        allocators.reserve(std::min<std::size_t>(threads - 1, tasks.size()));
+        for (unsigned i = 1; i < threads && i < tasks.size(); i++)
+            allocators.push_back(allocator_);
+        for (std::size_t i = 0; i < allocators.size(); i++) {
+            workers.push_back(set_detail::WorkerPool::fork([&, i] {
+                run_copy_tasks(allocators[i], tasks, next, error, error_mutex);
+            }));
+        }
+    } catch (...) {
+        // fewer workers, the tasks are shared by the ones there are
+    }
+    run_copy_tasks(allocator_, tasks, next, error, error_mutex);
+    for (std::shared_ptr<set_detail::WorkerPool::Task>& worker : workers)
+        worker->join();
+
+    for (CopyTask& task : tasks) {
+        if (task.left)
+            task.parent->left = task.root;
+        else task.parent->right = task.root;
+    }
+    if (error)
+        std::rethrow_exception(error);
+}
+
+// Clones the nodes above depth, linked as they go, and records the subtrees at depth.
+template <typename T, typename Compare, typename Allocator, typename Balance>
+void Set<T, Compare, Allocator, Balance>::collect_copy_tasks(Node *source, Node *parent, bool left, unsigned depth,
+                                                             std::vector<CopyTask>& tasks) {
+    if (depth == 0) {
+        tasks.push_back({source, parent, left, nullptr});
+        return;
+    }
 
-    while (!pairs.empty()) {
-        Node* node = pairs.front().first;
-        Node* other = pairs.front().second;
-        pairs.pop();
+    Node* node = clone_node(allocator_, source);
+    node->set_parent(parent);
+    if (left)
+        parent->left = node;
+    else parent->right = node;
+    if (source->left != nullptr)
+        collect_copy_tasks(source->left, node, true, depth - 1, tasks);
+    if (source->right != nullptr)
+        collect_copy_tasks(source->right, node, false, depth - 1, tasks);
+}
 
-        if (other->left) {
-            node->left = new ValueNode(other->left->value());
-            node->left->parent = node;
-            pairs.push({node->left, other->left});
+// One thread's share of a copy: tasks are taken in turn until none are left or one failed,
+// which frees what it cloned.
+template <typename T, typename Compare, typename Allocator, typename Balance>
+void Set<T, Compare, Allocator, Balance>::run_copy_tasks(node_allocator& allocator, std::vector<CopyTask>& tasks,
+                                                         std::atomic<std::size_t>& next, std::exception_ptr& error,
+                                                         std::mutex& error_mutex) {
+    for (std::size_t i = next++; i < tasks.size(); i = next++) {
+        CopyTask& task = tasks[i];
+        try {
+            clone_subtree(allocator, task.source, task.parent, task.root);
+        } catch (...) {
+            clear_impl(allocator, task.root);
+            task.root = nullptr;
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error)
+                error = std::current_exception();
+            next = tasks.size();
         }
+    }
+}
 
-        if (other->right) {
-            node->right = new ValueNode(other->right->value());
-            node->right->parent = node;
-            pairs.push({node->right, other->right});
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::Node*
+Set<T, Compare, Allocator, Balance>::clone_node(node_allocator& allocator, Node *source) {
+    ValueNode* node = node_traits::allocate(allocator, 1);
+    try {
+        node_traits::construct(allocator, node, source->value());
+    } catch (...) {
+        node_traits::deallocate(allocator, node, 1);
+        throw;
+    }
+    node->set_tag(source->tag());
+    node->copy_size(*source);
+    return node;
+}
+
+// Preorder over both trees at once: a child of source that the copy lacks is cloned next,
+// a node with both done hands back to its parent.
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::Node*
+Set<T, Compare, Allocator, Balance>::clone_subtree(node_allocator& allocator, Node *source, Node *parent,
+                                                   Node*& root) {
+    root = clone_node(allocator, source);
+    root->set_parent(parent);
+    Node* from = source;
+    Node* to = root;
+    while (true) {
+        if (from->left != nullptr && to->left == nullptr) {
+            to->left = clone_node(allocator, from->left);
+            to->left->set_parent(to);
+            from = from->left;
+            to = to->left;
+        } else if (from->right != nullptr && to->right == nullptr) {
+            to->right = clone_node(allocator, from->right);
+            to->right->set_parent(to);
+            from = from->right;
+            to = to->right;
+        } else if (from == source) {
+            return root;
+        } else {
+            from = from->parent();
+            to = to->parent();
         }
     }
+}
 
+template <typename T, typename Compare, typename Allocator, typename Balance>
+template <typename... Args>
+typename Set<T, Compare, Allocator, Balance>::Node* Set<T, Compare, Allocator, Balance>::create(Args&&... args) {
+    ValueNode* node = node_traits::allocate(allocator_, 1);
+    try {
+        node_traits::construct(allocator_, node, std::forward<Args>(args)...);
+    } catch (...) {
+        node_traits::deallocate(allocator_, node, 1);
+        throw;
+    }
+    return node;
 }
 
-template <typename T>
-void Set<T>::clear_impl(Node *node) {
-    if (node == nullptr)
-        return;
+template <typename T, typename Compare, typename Allocator, typename Balance>
+void Set<T, Compare, Allocator, Balance>::destroy(node_allocator& allocator, Node *node) {
+    ValueNode* value_node = static_cast<ValueNode*>(node);
+    node_traits::destroy(allocator, value_node);
+    node_traits::deallocate(allocator, value_node, 1);
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::size_type
+Set<T, Compare, Allocator, Balance>::clear_impl(node_allocator& allocator, Node *node) {
+    // rotate left children up until the node has none, then free it and go right:
+    // no recursion and no extra space however deep the tree is
+    size_type count = 0;
+    while (node != nullptr) {
+        if (node->left != nullptr) {
+            Node* left = node->left;
+            node->left = left->right;
+            left->right = node;
+            node = left;
+        } else {
+            Node* right = node->right;
+            destroy(allocator, node);
+            node = right;
+            ++count;
+        }
+    }
+    return count;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+bool Set<T, Compare, Allocator, Balance>::defer_clear(Node *root) noexcept {
+    if (!set_detail::is_thread_safe_allocator<node_allocator>::value)
+        return false;
+    try {
+        node_allocator allocator = allocator_;
+        node_allocator replacement = node_traits::is_always_equal::value
+                                     ? allocator_ : node_traits::select_on_container_copy_construction(allocator_);
+        set_detail::BackgroundReclaimer::submit([root, allocator]() mutable {
+            clear_impl(allocator, root);
+        });
+        allocator_ = replacement;
+        return true;
+    } catch (...) {
+        return false;
+    }
+}
 
-    clear_impl(node->left);
-    clear_impl(node->right);
-    delete node;
+template <typename T, typename Compare, typename Allocator, typename Balance>
+Set<T, Compare, Allocator, Balance>::Set(Set&& other) noexcept
+        : balance_(std::move(other.balance_)), compare_(std::move(other.compare_)),
+          allocator_(std::move(other.allocator_)), deferred_clear_(other.deferred_clear_),
+          parallelism_(other.parallelism_) {
+    steal(other);
 }
 
-template <typename T>
-Set<T>& Set<T>::operator=(Set const &other) {
+template <typename T, typename Compare, typename Allocator, typename Balance>
+Set<T, Compare, Allocator, Balance>& Set<T, Compare, Allocator, Balance>::operator=(Set const &other) {
     Set temp(other);
     swap(temp);
     return *this;
 }
 
-template <typename T>
-Set<T>::~Set() {
+template <typename T, typename Compare, typename Allocator, typename Balance>
+Set<T, Compare, Allocator, Balance>& Set<T, Compare, Allocator, Balance>::operator=(Set&& other)
+        noexcept(std::allocator_traits<Allocator>::propagate_on_container_move_assignment::value ||
+                 std::allocator_traits<Allocator>::is_always_equal::value) {
+    if (this != &other)
+        move_assign(other, std::integral_constant<bool, node_traits::propagate_on_container_move_assignment::value ||
+                                                        node_traits::is_always_equal::value>());
+    return *this;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+void Set<T, Compare, Allocator, Balance>::steal(Set &other) noexcept {
+    if (other.top_node_.left != nullptr) {
+        top_node_.left = other.top_node_.left;
+        top_node_.left->set_parent(&top_node_);
+        begin_ = other.begin_;
+        last_ = other.last_;
+        other.top_node_.left = nullptr;
+        other.begin_ = &other.top_node_;
+        other.last_ = &other.top_node_;
+    }
+    size_ = other.size_;
+    counted_ = other.counted_;
+    other.size_ = 0;
+    other.counted_ = true;
+    other.balance_.reset();
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+void Set<T, Compare, Allocator, Balance>::move_assign(Set &other, std::true_type) noexcept {
+    clear();
+    if (node_traits::propagate_on_container_move_assignment::value)
+        allocator_ = std::move(other.allocator_);
+    compare_ = std::move(other.compare_);
+    balance_ = std::move(other.balance_);
+    deferred_clear_ = other.deferred_clear_;
+    parallelism_ = other.parallelism_;
+    steal(other);
+}
+
+// the nodes cannot change hands between unequal allocators, only the values can
+template <typename T, typename Compare, typename Allocator, typename Balance>
+void Set<T, Compare, Allocator, Balance>::move_assign(Set &other, std::false_type) {
+    if (allocator_ == other.allocator_) {
+        move_assign(other, std::true_type());
+        return;
+    }
+
     clear();
+    compare_ = other.compare_;
+    deferred_clear_ = other.deferred_clear_;
+    parallelism_ = other.parallelism_;
+    for (Node* node = other.begin_; node != &other.top_node_; node = node->next())
+        insert(std::move(node->value()));
+    other.clear();
 }
 
-template <typename T>
-std::pair<typename Set<T>::iterator, bool> Set<T>::insert(T const &element) {
+template <typename T, typename Compare, typename Allocator, typename Balance>
+Set<T, Compare, Allocator, Balance>::~Set() {
+    clear();
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+std::pair<typename Set<T, Compare, Allocator, Balance>::iterator, bool> Set<T, Compare, Allocator, Balance>::insert(T const &element) {
+    return insert_impl(element);
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+std::pair<typename Set<T, Compare, Allocator, Balance>::iterator, bool> Set<T, Compare, Allocator, Balance>::insert(T &&element) {
+    return insert_impl(std::move(element));
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+template <typename... Args>
+std::pair<typename Set<T, Compare, Allocator, Balance>::iterator, bool> Set<T, Compare, Allocator, Balance>::emplace(Args&&... args) {
+    // the key only exists once it is constructed, so the node is built first
+    Node* node = create(std::forward<Args>(args)...);
+    Node* parent;
+    bool left;
+    Node* existing;
+    try {
+        existing = insert_position(node->value(), parent, left);
+    } catch (...) {
+        destroy(node);
+        throw;
+    }
+
+    if (existing != nullptr) {
+        destroy(node);
+        return {iterator(existing), false};
+    }
+    return {iterator(link(node, parent, left)), true};
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::iterator Set<T, Compare, Allocator, Balance>::insert(const_iterator hint, T const &element) {
+    return insert_hint_impl(hint.node, element);
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::iterator Set<T, Compare, Allocator, Balance>::insert(const_iterator hint, T &&element) {
+    return insert_hint_impl(hint.node, std::move(element));
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+template <typename... Args>
+typename Set<T, Compare, Allocator, Balance>::iterator
+Set<T, Compare, Allocator, Balance>::emplace_hint(const_iterator hint, Args&&... args) {
+    Node* node = create(std::forward<Args>(args)...);
+    Node* parent;
+    bool left;
+    Node* existing;
+    try {
+        existing = hint_position(hint.node, node->value(), parent, left);
+    } catch (...) {
+        destroy(node);
+        throw;
+    }
+
+    if (existing != nullptr) {
+        destroy(node);
+        return iterator(existing);
+    }
+    return iterator(link(node, parent, left));
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+template <typename InputIt>
+void Set<T, Compare, Allocator, Balance>::insert(InputIt first, InputIt last) {
+    insert_sorted(first, last);
+}
+
+// The new nodes are allocated in one pass into a list linked through right pointers,
+// sorted only if the input was not, merged with the flattened tree and rebuilt bottom-up.
+template <typename T, typename Compare, typename Allocator, typename Balance>
+template <typename InputIt>
+void Set<T, Compare, Allocator, Balance>::insert_sorted(InputIt first, InputIt last) {
+    Node head;
+    Node* tail = &head;
+    size_type count = 0;
+    bool sorted = true;
+    try {
+        for (; first != last; ++first) {
+            Node* node = create(*first);
+            tail->right = node;
+            if (sorted && tail != &head && !compare_(tail->value(), node->value())) {
+                if (!compare_(node->value(), tail->value())) {
+                    tail->right = nullptr;
+                    destroy(node);
+                    continue;
+                }
+                sorted = false;
+            }
+            tail = node;
+            ++count;
+        }
+        if (!sorted)
+            head.right = sort_list(head.right, count);
+    } catch (...) {
+        destroy_list(head.right);
+        throw;
+    }
+
+    if (count == 0)
+        return;
+    // a few keys are cheaper to link in one by one than to rebuild the whole tree for
+    if (count * 16 < size()) {
+        link_list(head.right);
+        return;
+    }
+    Node* list = merge_list(head.right, count);
+    assign_list(list, count);
+}
+
+// Links a sorted list of new nodes into the tree, each next to the one before. Existing nodes
+// win over equal new ones; if a comparison throws, the nodes not linked yet are freed.
+template <typename T, typename Compare, typename Allocator, typename Balance>
+void Set<T, Compare, Allocator, Balance>::link_list(Node *list) {
+    Node* hint = &top_node_;
+    try {
+        while (list != nullptr) {
+            Node* node = list;
+            Node* parent;
+            bool left;
+            Node* existing = hint_position(hint, node->value(), parent, left);
+            list = list->right;
+            if (existing != nullptr) {
+                destroy(node);
+                hint = existing;
+            } else {
+                node->right = nullptr;
+                hint = link(node, parent, left);
+            }
+        }
+    } catch (...) {
+        destroy_list(list);
+        throw;
+    }
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+void Set<T, Compare, Allocator, Balance>::destroy_list(Node *list) {
+    while (list != nullptr) {
+        Node* next = list->right;
+        destroy(list);
+        list = next;
+    }
+}
+
+// Sorts a list and drops the duplicates, keeping the first of equal keys like insert() does.
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::Node* Set<T, Compare, Allocator, Balance>::sort_list(Node *list, size_type& count) {
+    std::vector<Node*> nodes;
+    nodes.reserve(count);
+    for (Node* node = list; node != nullptr; node = node->right)
+        nodes.push_back(node);
+
+    std::stable_sort(nodes.begin(), nodes.end(), [this](Node* first, Node* second) {
+        return compare_(first->value(), second->value());
+    });
+    std::vector<bool> duplicate(count);
+    for (size_type i = 1; i < count; i++)
+        duplicate[i] = !compare_(nodes[i - 1]->value(), nodes[i]->value());
+
+    // nothing below can throw, the list is only relinked once every comparison is done
+    Node head;
+    Node* tail = &head;
+    for (size_type i = 0; i < nodes.size(); i++) {
+        if (duplicate[i]) {
+            destroy(nodes[i]);
+            --count;
+        } else {
+            tail->right = nodes[i];
+            tail = nodes[i];
+        }
+    }
+    tail->right = nullptr;
+    return head.right;
+}
+
+// Merges a sorted list of new nodes into the tree, which is left empty. Existing nodes win
+// over equal new ones. If a comparison throws, the new nodes are freed and the tree is
+// rebuilt from the existing ones.
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::Node* Set<T, Compare, Allocator, Balance>::merge_list(Node *list, size_type& count) {
+    if (get_root() == nullptr)
+        return list;
+
+    static const unsigned FRESH = 1;
+    for (Node* node = list; node != nullptr; node = node->right)
+        node->set_tag(FRESH);
+
+    Node* existing;
+    size_type existing_count = set_detail::flatten(get_root(), existing);
+    for (Node* node = existing; node != nullptr; node = node->right)
+        node->set_tag(0);
+    top_node_.left = nullptr;
+    begin_ = &top_node_;
+    last_ = &top_node_;
+    count += existing_count;
+
+    Node head;
+    Node* tail = &head;
+    try {
+        while (existing != nullptr && list != nullptr) {
+            if (compare_(list->value(), existing->value())) {
+                tail->right = list;
+                tail = list;
+                list = list->right;
+            } else if (compare_(existing->value(), list->value())) {
+                tail->right = existing;
+                tail = existing;
+                existing = existing->right;
+            } else {
+                Node* duplicate = list;
+                list = list->right;
+                destroy(duplicate);
+                --count;
+            }
+        }
+        tail->right = existing != nullptr ? existing : list;
+    } catch (...) {
+        tail->right = existing;
+        destroy_list(list);
+
+        Node kept;
+        tail = &kept;
+        for (Node* node = head.right; node != nullptr;) {
+            Node* next = node->right;
+            if (node->tag() == FRESH) {
+                destroy(node);
+            } else {
+                tail->right = node;
+                tail = node;
+            }
+            node = next;
+        }
+        tail->right = nullptr;
+        assign_list(kept.right, existing_count);
+        throw;
+    }
+    return head.right;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+void Set<T, Compare, Allocator, Balance>::assign_list(Node *list, size_type count) {
+    begin_ = list != nullptr ? list : &top_node_;
+    Node* root = set_detail::build_balanced(list, count);
+    top_node_.left = root;
+    last_ = root != nullptr ? root : &top_node_;
+    while (last_->right)
+        last_ = last_->right;
+    if (root)
+        root->set_parent(&top_node_);
+    size_ = count;
+    counted_ = true;
+    balance_.after_build(&top_node_, count);
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+template <typename K>
+std::pair<typename Set<T, Compare, Allocator, Balance>::iterator, bool> Set<T, Compare, Allocator, Balance>::insert_impl(K&& element) {
+    Node* parent;
+    bool left;
+    Node* existing = insert_position(element, parent, left);
+    if (existing != nullptr)
+        return {iterator(existing), false};
+
+    return {iterator(link(create(std::forward<K>(element)), parent, left)), true};
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::Node* Set<T, Compare, Allocator, Balance>::insert_position(T const &element, Node*& parent, bool& left) {
+    left = true;
     if (get_root() == nullptr) {
-        top_node_.left = new ValueNode(element);
-        top_node_.left->parent = &top_node_;
-        begin_ = top_node_.left;
-        return {begin(), true};
+        parent = &top_node_;
+        return nullptr;
     }
 
-    if (element < *begin()) {
-        Node* node = begin_;
-        node->left = new ValueNode(element);
-        node->left->parent = node;
-        begin_ = node->left;
-        return {begin(), true};
+    if (compare_(element, *begin())) {
+        parent = begin_;
+        return nullptr;
+    }
+    if (compare_(last_->value(), element)) {
+        parent = last_;
+        left = false;
+        return nullptr;
     }
 
     Node* node = get_root();
     while (true) {
-        if (node->value() == element)
-            return {iterator(node), false};
-
-        if (element < node->value()) {
-            if (node->left == nullptr) {
-                node->left = new ValueNode(element);
-                node->left->parent = node;
-                return {iterator(node->left), true};
-            } else node = node->left;
-        } else {
-            if (node->right == nullptr) {
-                node->right = new ValueNode(element);
-                node->right->parent = node;
-                return {iterator(node->right), true};
-            } else node = node->right;
+        left = compare_(element, node->value());
+        if (!left && !compare_(node->value(), element)) {
+            balance_.after_access(&top_node_, node);
+            return node;
+        }
+
+        Node* child = left ? node->left : node->right;
+        if (child == nullptr) {
+            parent = node;
+            return nullptr;
         }
+        node = child;
     }
 }
 
-template <typename T>
-typename Set<T>::iterator Set<T>::erase(const_iterator it) {
+template <typename T, typename Compare, typename Allocator, typename Balance>
+template <typename K>
+typename Set<T, Compare, Allocator, Balance>::iterator Set<T, Compare, Allocator, Balance>::insert_hint_impl(Node* hint, K&& element) {
+    Node* parent;
+    bool left;
+    Node* existing = hint_position(hint, element, parent, left);
+    if (existing != nullptr)
+        return iterator(existing);
+
+    return iterator(link(create(std::forward<K>(element)), parent, left));
+}
+
+// A new node between two neighbours goes to the left of the later one if that slot is free,
+// otherwise to the right of the earlier one, which is then free: no descent from the root.
+// Only the neighbours on either side of hint are tried before falling back to one.
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::Node*
+Set<T, Compare, Allocator, Balance>::hint_position(Node* hint, T const &element, Node*& parent, bool& left) {
+    if (hint != &top_node_ && !compare_(element, hint->value())) {
+        if (!compare_(hint->value(), element))
+            return hint;
+        // right after hint
+        Node* next = hint->next();
+        if (next == &top_node_ || compare_(element, next->value())) {
+            left = hint->right != nullptr;
+            parent = left ? next : hint;
+            return nullptr;
+        }
+        return insert_position(element, parent, left);
+    }
+
+    // right before hint; the front and an empty tree are handled by insert_position
+    if (hint == begin_)
+        return insert_position(element, parent, left);
+    Node* prev = hint == &top_node_ ? last_ : hint->prev();
+    if (compare_(prev->value(), element)) {
+        left = hint->left == nullptr;
+        parent = left ? hint : prev;
+        return nullptr;
+    }
+    if (!compare_(element, prev->value()))
+        return prev;
+    return insert_position(element, parent, left);
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::Node* Set<T, Compare, Allocator, Balance>::link(Node *node, Node *parent, bool left) {
+    if (left) {
+        parent->left = node;
+        if (parent == begin_)
+            begin_ = node;
+        if (parent == &top_node_)
+            last_ = node;
+    } else {
+        parent->right = node;
+        if (parent == last_)
+            last_ = node;
+    }
+    node->set_parent(parent);
+    set_detail::pull_path(parent);
+    ++size_;
+    balance_.after_insert(&top_node_, node);
+    return node;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::iterator Set<T, Compare, Allocator, Balance>::erase(const_iterator it) {
     if (it == end())
         return end();
 
     Node* node = it.node;
     iterator ret(node->next());
+    unlink(node);
+    destroy(node);
+    return ret;
+}
 
+// Takes node out of the tree, leaving it as fresh as a new one.
+template <typename T, typename Compare, typename Allocator, typename Balance>
+void Set<T, Compare, Allocator, Balance>::unlink(Node *node) {
+    if (node == begin_)
+        begin_ = node->next();
+    if (node == last_)
+        last_ = node->prev();
     erase_impl(node);
-    delete node;
+    --size_;
 
-    return ret;
+    node->left = nullptr;
+    node->right = nullptr;
+    node->set_parent(nullptr);
+    node->set_tag(0);
+    node->pull();
 }
 
-template <typename T>
-void Set<T>::erase_impl(Node *node) {
-    if (node->left == nullptr && node->right == nullptr) {
-        if (node == begin_) {
-            if (node->parent == &top_node_) {
-                top_node_.left = nullptr;
-                begin_ = &top_node_;
-            } else {
-                begin_ = node->parent;
-            }
-        }
-        if (node == node->parent->left)
-            node->parent->left = nullptr;
-        else node->parent->right = nullptr;
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::node_type Set<T, Compare, Allocator, Balance>::extract(const_iterator position) {
+    if (position == end())
+        return node_type();
+    unlink(position.node);
+    return node_type(position.node, allocator_);
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::node_type Set<T, Compare, Allocator, Balance>::extract(T const &element) {
+    Node* node = lower_bound_impl(element);
+    if (node == &top_node_ || compare_(element, node->value()))
+        return node_type();
+    return extract(const_iterator(node));
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::insert_return_type Set<T, Compare, Allocator, Balance>::insert(node_type&& node) {
+    if (node.empty())
+        return {end(), false, node_type()};
+
+    Node* parent;
+    bool left;
+    Node* existing = insert_position(node.node_->value(), parent, left);
+    if (existing != nullptr)
+        return {iterator(existing), false, std::move(node)};
+    return {iterator(link(node.release(), parent, left)), true, node_type()};
+}
 
+template <typename T, typename Compare, typename Allocator, typename Balance>
+Set<T, Compare, Allocator, Balance> Set<T, Compare, Allocator, Balance>::split(T const &element) {
+    Set result(compare_, Allocator(allocator_));
+    result.deferred_clear_ = deferred_clear_;
+    result.parallelism_ = parallelism_;
+    if (get_root() == nullptr)
+        return result;
+
+    // a splay tree brings the boundary up, the path is short then
+    Node* bound = lower_bound_impl(element);
+    if (bound != &top_node_)
+        balance_.after_access(&top_node_, bound);
+
+    Node* lower;
+    Node* upper;
+    // split_tree compares before it relinks anything, a throw leaves the set as it was
+    Node* equal = split_tree(get_root(), element, lower, upper);
+    release_tree();
+    if (equal != nullptr)
+        upper = join_trees(nullptr, equal, upper);
+
+    adopt_tree(lower);
+    result.adopt_tree(upper);
+    size_parts(result, std::integral_constant<bool, Node::augmented>());
+    balance_.after_join(&top_node_);
+    result.balance_.after_join(&result.top_node_);
+    return result;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+Set<T, Compare, Allocator, Balance> Set<T, Compare, Allocator, Balance>::join(Set &&left, Set &&right) {
+    Set result(std::move(left));
+    result.append(right);
+    return result;
+}
+
+// The smallest node of right becomes the middle of the join.
+template <typename T, typename Compare, typename Allocator, typename Balance>
+void Set<T, Compare, Allocator, Balance>::append(Set &right) {
+    if (right.get_root() == nullptr)
+        return;
+    if (!(allocator_ == right.allocator_) || (get_root() != nullptr && !compare_(last_->value(), *right.begin()))) {
+        merge(right);
         return;
     }
 
-    if (node->left == nullptr || node->right == nullptr) {
-        if (node == node->parent->left) {
-            if (node->right != nullptr) {
-                if (node == begin_) {
-                    begin_ = node->right;
-                    while (begin_->left != nullptr)
-                        begin_ = begin_->left;
-                }
-                node->parent->left = node->right;
-                node->right->parent = node->parent;
-            } else {
-                node->parent->left = node->left;
-                node->left->parent = node->parent;
-            }
+    Node* middle = right.begin_;
+    right.unlink(middle);
+    size_type size = size_ + right.size_ + 1;
+    bool counted = counted_ && right.counted_;
+    Node* root = right.release_tree();
+    adopt_tree(join_trees(release_tree(), middle, root));
+    size_ = size;
+    counted_ = counted;
+    balance_.after_join(&top_node_);
+}
+
+// Takes the whole tree out, leaving the set empty.
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::Node* Set<T, Compare, Allocator, Balance>::release_tree() noexcept {
+    Node* root = get_root();
+    top_node_.left = nullptr;
+    begin_ = &top_node_;
+    last_ = &top_node_;
+    size_ = 0;
+    counted_ = true;
+    balance_.reset();
+    return root;
+}
+
+// Makes root, the result of joins, the tree of an empty set; the size is up to the caller.
+template <typename T, typename Compare, typename Allocator, typename Balance>
+void Set<T, Compare, Allocator, Balance>::adopt_tree(Node *root) noexcept {
+    top_node_.left = root;
+    if (root != nullptr)
+        root->set_parent(&top_node_);
+    reset_ends();
+}
+
+// The trees below are free standing: their roots' parent pointers are stale and never read.
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::Node*
+Set<T, Compare, Allocator, Balance>::join_trees(Node *left, Node *middle, Node *right) {
+    Node top;
+    balance_.join(&top, left, middle, right);
+    return top.left;
+}
+
+// Without a middle node the largest node of left takes its place: the right spine above
+// it rejoins bottom-up, O(log n), no comparisons.
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::Node*
+Set<T, Compare, Allocator, Balance>::join_trees(Node *left, Node *right) {
+    if (left == nullptr)
+        return right;
+    if (right == nullptr)
+        return left;
+
+    Node* last = left;
+    while (last->right != nullptr)
+        last = last->right;
+    Node* rest = last->left;
+    Node* node = last == left ? nullptr : last->parent();
+    detach(last);
+    while (node != nullptr) {
+        Node* up = node == left ? nullptr : node->parent();
+        Node* node_left = node->left;
+        detach(node);
+        rest = join_trees(node_left, node, rest);
+        node = up;
+    }
+    return join_trees(rest, last, right);
+}
+
+// Cuts root's tree into the nodes less than key and the nodes greater than it, and returns
+// the equal node, detached, or nullptr. The search path is taken apart bottom-up: each node
+// on it joins the part below it on its side together with its subtree off the path. The
+// joins on one side cost the differences of their trees' heights, which add up to O(log n).
+// All comparisons are done before the tree is touched.
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::Node*
+Set<T, Compare, Allocator, Balance>::split_tree(Node *root, T const &key, Node*& left, Node*& right) {
+    left = nullptr;
+    right = nullptr;
+    if (root == nullptr)
+        return nullptr;
+
+    Node* node = root;
+    Node* equal = nullptr;
+    bool went_right = false;
+    while (true) {
+        if (compare_(node->value(), key)) {
+            went_right = true;
+        } else if (compare_(key, node->value())) {
+            went_right = false;
         } else {
-            if (node->right != nullptr) {
-                node->parent->right= node->right;
-                node->right->parent = node->parent;
-            } else {
-                node->parent->right = node->left;
-                node->left->parent = node->parent;
-            }
+            equal = node;
+            break;
         }
+        Node* next = went_right ? node->right : node->left;
+        if (next == nullptr)
+            break;
+        node = next;
+    }
 
+    if (equal != nullptr) {
+        left = equal->left;
+        right = equal->right;
+        node = equal == root ? nullptr : equal->parent();
+        went_right = node != nullptr && node->right == equal;
+        detach(equal);
+    }
+    while (node != nullptr) {
+        Node* up = node == root ? nullptr : node->parent();
+        bool up_right = up != nullptr && up->right == node;
+        Node* node_left = node->left;
+        Node* node_right = node->right;
+        detach(node);
+        if (went_right)
+            left = join_trees(node_left, node, left);
+        else right = join_trees(right, node, node_right);
+        node = up;
+        went_right = up_right;
+    }
+    return equal;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+void Set<T, Compare, Allocator, Balance>::detach(Node *node) noexcept {
+    node->left = nullptr;
+    node->right = nullptr;
+    node->set_tag(0);
+}
+
+// Trees that leave a set operation, chained through their roots' parent pointers; the
+// recursions on other threads only hand them over, the allocator is used by the caller alone.
+template <typename T, typename Compare, typename Allocator, typename Balance>
+struct Set<T, Compare, Allocator, Balance>::Dropped {
+    std::mutex mutex;
+    Node* trees = nullptr;
+
+    void add(Node* root) noexcept {
+        if (root == nullptr)
+            return;
+        std::lock_guard<std::mutex> lock(mutex);
+        root->set_parent(trees);
+        trees = root;
+    }
+};
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+constexpr typename Set<T, Compare, Allocator, Balance>::size_type Set<T, Compare, Allocator, Balance>::PARALLEL_GRAIN;
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+void Set<T, Compare, Allocator, Balance>::union_with(Set const &other) {
+    if (&other == this || other.empty())
+        return;
+    union_with(Set(other.begin(), other.end(), compare_, Allocator(allocator_)));
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+void Set<T, Compare, Allocator, Balance>::union_with(Set &&other) {
+    if (&other == this || other.empty())
+        return;
+    if (!(allocator_ == other.allocator_)) {
+        union_with(static_cast<Set const&>(other));
         return;
     }
 
-    Node* next = node->next();
-    erase_impl(next);
+    std::vector<Node*> nodes = nodes_of(other);
+    size_type size = this->size() + nodes.size();
+    unsigned forks = fork_levels(size);
+    Dropped dropped;
+    other.release_tree();
+    for (Node* node : nodes)
+        detach(node);
+    Node* root;
+    try {
+        root = union_trees(release_tree(), nodes.data(), nodes.data() + nodes.size(), forks, dropped);
+    } catch (...) {
+        free_dropped(dropped);
+        throw;
+    }
+    adopt_tree(root);
+    size_ = size - free_dropped(dropped);
+    balance_.after_join(&top_node_);
+}
 
-    next->parent = node->parent;
-    if (node == node->parent->right)
-        node->parent->right = next;
-    else node->parent->left = next;
+template <typename T, typename Compare, typename Allocator, typename Balance>
+void Set<T, Compare, Allocator, Balance>::intersect_with(Set const &other) {
+    if (&other == this)
+        return;
 
-    if (node->left) {
-        next->left = node->left;
-        node->left->parent = next;
+    std::vector<Node*> nodes = nodes_of(other);
+    size_type size = this->size();
+    unsigned forks = fork_levels(size + nodes.size());
+    Dropped dropped;
+    Node* root;
+    try {
+        root = intersect_trees(release_tree(), nodes.data(), nodes.data() + nodes.size(), forks, dropped);
+    } catch (...) {
+        free_dropped(dropped);
+        throw;
     }
+    adopt_tree(root);
+    size_ = size - free_dropped(dropped);
+    balance_.after_join(&top_node_);
+}
 
-    if (node->right) {
-        next->right = node->right;
-        node->right->parent = next;
+template <typename T, typename Compare, typename Allocator, typename Balance>
+void Set<T, Compare, Allocator, Balance>::difference_with(Set const &other) {
+    if (&other == this) {
+        clear();
+        return;
     }
+
+    std::vector<Node*> nodes = nodes_of(other);
+    size_type size = this->size();
+    unsigned forks = fork_levels(size + nodes.size());
+    Dropped dropped;
+    Node* root;
+    try {
+        root = difference_trees(release_tree(), nodes.data(), nodes.data() + nodes.size(), forks, dropped);
+    } catch (...) {
+        free_dropped(dropped);
+        throw;
+    }
+    adopt_tree(root);
+    size_ = size - free_dropped(dropped);
+    balance_.after_join(&top_node_);
 }
 
-template <typename T>
-typename Set<T>::const_iterator Set<T>::find(T const &element) {
-    Node* node = upper_lower_impl(element);
-    if (node != nullptr && node->value() == element) {
-        return const_iterator(node);
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::size_type Set<T, Compare, Allocator, Balance>::free_dropped(Dropped& dropped) {
+    size_type count = 0;
+    while (dropped.trees != nullptr) {
+        Node* next = dropped.trees->parent();
+        count += clear_impl(allocator_, dropped.trees);
+        dropped.trees = next;
     }
-    else return end();
+    return count;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+unsigned Set<T, Compare, Allocator, Balance>::thread_count() const {
+    return parallelism_ != 0 ? parallelism_ : std::thread::hardware_concurrency();
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+unsigned Set<T, Compare, Allocator, Balance>::fork_levels(size_type size) const {
+    unsigned threads = thread_count();
+    if (threads <= 1 || size < PARALLEL_GRAIN)
+        return 0;
+    unsigned levels = 0;
+    while ((1u << levels) < threads && levels < 16)
+        ++levels;
+    return levels;
 }
 
-template <typename T>
-typename Set<T>::const_iterator Set<T>::lower_bound(T const &element) const {
-    Node* node = upper_lower_impl(element);
-    if (node == nullptr || node == &top_node_)
+// Runs two independent recursions, the first one forked to the worker pool while forks are
+// left. A recursion that throws has dropped its own trees, so what is left to drop here is
+// the other result and middle; the first exception then goes on.
+template <typename T, typename Compare, typename Allocator, typename Balance>
+template <typename First, typename Second>
+void Set<T, Compare, Allocator, Balance>::fork_join(unsigned forks, First first, Second second, Node*& first_root,
+                                                    Node*& second_root, Node* middle, Dropped& dropped) {
+    first_root = nullptr;
+    second_root = nullptr;
+    std::shared_ptr<set_detail::WorkerPool::Task> pending;
+    if (forks > 0) {
+        try {
+            pending = set_detail::WorkerPool::fork([&first_root, &first] { first_root = first(); });
+        } catch (...) {
+            // nothing to fork with, the first runs here too
+        }
+    }
+
+    std::exception_ptr error;
+    if (pending == nullptr) {
+        try {
+            first_root = first();
+        } catch (...) {
+            error = std::current_exception();
+        }
+    }
+    try {
+        second_root = second();
+    } catch (...) {
+        if (!error)
+            error = std::current_exception();
+    }
+    if (pending != nullptr) {
+        try {
+            pending->join();
+        } catch (...) {
+            if (!error)
+                error = std::current_exception();
+        }
+    }
+
+    if (error) {
+        dropped.add(first_root);
+        dropped.add(second_root);
+        dropped.add(middle);
+        std::rethrow_exception(error);
+    }
+}
+
+// The other set's nodes in order: the recursions below split its range in halves, so they
+// are O(log m) deep whatever the shape of its tree.
+template <typename T, typename Compare, typename Allocator, typename Balance>
+std::vector<typename Set<T, Compare, Allocator, Balance>::Node*>
+Set<T, Compare, Allocator, Balance>::nodes_of(Set const &set) {
+    std::vector<Node*> nodes;
+    nodes.reserve(set.size());
+    for (Node* node = set.begin_; node != &set.top_node_; node = node->next())
+        nodes.push_back(node);
+    return nodes;
+}
+
+// Each recursion owns the tree it gets, and for union the lone nodes of its range too; if it
+// throws, all of them are in dropped.
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::Node*
+Set<T, Compare, Allocator, Balance>::union_trees(Node *tree, Node* const* first, Node* const* last, unsigned forks,
+                                                 Dropped& dropped) {
+    if (first == last)
+        return tree;
+
+    Node* const* middle = first + (last - first) / 2;
+    Node* left;
+    Node* right;
+    Node* equal;
+    try {
+        equal = split_tree(tree, (*middle)->value(), left, right);
+    } catch (...) {
+        dropped.add(tree);
+        for (Node* const* node = first; node != last; ++node)
+            dropped.add(*node);
+        throw;
+    }
+
+    // on equal keys the node of this set stays
+    Node* node = *middle;
+    if (equal != nullptr) {
+        dropped.add(node);
+        node = equal;
+    }
+
+    unsigned next = forks > 0 ? forks - 1 : 0;
+    Node* lower;
+    Node* upper;
+    fork_join(forks, [&] { return union_trees(left, first, middle, next, dropped); },
+              [&] { return union_trees(right, middle + 1, last, next, dropped); }, lower, upper, node, dropped);
+    return join_trees(lower, node, upper);
+}
+
+// The other set's nodes are only read.
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::Node*
+Set<T, Compare, Allocator, Balance>::intersect_trees(Node *tree, Node* const* first, Node* const* last, unsigned forks,
+                                                     Dropped& dropped) {
+    if (tree == nullptr || first == last) {
+        dropped.add(tree);
+        return nullptr;
+    }
+
+    Node* const* middle = first + (last - first) / 2;
+    Node* left;
+    Node* right;
+    Node* equal;
+    try {
+        equal = split_tree(tree, (*middle)->value(), left, right);
+    } catch (...) {
+        dropped.add(tree);
+        throw;
+    }
+
+    unsigned next = forks > 0 ? forks - 1 : 0;
+    Node* lower;
+    Node* upper;
+    fork_join(forks, [&] { return intersect_trees(left, first, middle, next, dropped); },
+              [&] { return intersect_trees(right, middle + 1, last, next, dropped); }, lower, upper, equal, dropped);
+    return equal != nullptr ? join_trees(lower, equal, upper) : join_trees(lower, upper);
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::Node*
+Set<T, Compare, Allocator, Balance>::difference_trees(Node *tree, Node* const* first, Node* const* last, unsigned forks,
+                                                      Dropped& dropped) {
+    if (tree == nullptr || first == last)
+        return tree;
+
+    Node* const* middle = first + (last - first) / 2;
+    Node* left;
+    Node* right;
+    Node* equal;
+    try {
+        equal = split_tree(tree, (*middle)->value(), left, right);
+    } catch (...) {
+        dropped.add(tree);
+        throw;
+    }
+    dropped.add(equal);
+
+    unsigned next = forks > 0 ? forks - 1 : 0;
+    Node* lower;
+    Node* upper;
+    fork_join(forks, [&] { return difference_trees(left, first, middle, next, dropped); },
+              [&] { return difference_trees(right, middle + 1, last, next, dropped); }, lower, upper, nullptr, dropped);
+    return join_trees(lower, upper);
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+void Set<T, Compare, Allocator, Balance>::reset_ends() noexcept {
+    begin_ = &top_node_;
+    while (begin_->left)
+        begin_ = begin_->left;
+    last_ = get_root() != nullptr ? get_root() : &top_node_;
+    while (last_->right)
+        last_ = last_->right;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+void Set<T, Compare, Allocator, Balance>::size_parts(Set& right, std::true_type) noexcept {
+    size_ = get_root() != nullptr ? get_root()->size : 0;
+    right.size_ = right.get_root() != nullptr ? right.get_root()->size : 0;
+}
+
+// counting either part would cost O(n): that is left to size(), if it is ever asked
+template <typename T, typename Compare, typename Allocator, typename Balance>
+void Set<T, Compare, Allocator, Balance>::size_parts(Set& right, std::false_type) noexcept {
+    counted_ = false;
+    right.counted_ = false;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::iterator Set<T, Compare, Allocator, Balance>::insert(const_iterator hint, node_type&& node) {
+    if (node.empty())
         return end();
-    else if (node->value() < element)
-        return const_iterator(node->next());
-    else return const_iterator(node);
 
+    Node* parent;
+    bool left;
+    Node* existing = hint_position(hint.node, node.node_->value(), parent, left);
+    if (existing != nullptr)
+        return iterator(existing);
+    return iterator(link(node.release(), parent, left));
 }
-template <typename T>
-typename Set<T>::const_iterator Set<T>::upper_bound(T const &element) const {
-    if (element < begin_->value())
-        return begin();
 
-    Node* node = upper_lower_impl(element);
+// The source is walked in order and every node that gets in is unlinked from it and linked
+// here: no allocation, no copy. A throwing comparison leaves both sets valid, with the nodes
+// moved so far.
+template <typename T, typename Compare, typename Allocator, typename Balance>
+void Set<T, Compare, Allocator, Balance>::merge(Set &source) {
+    if (&source == this)
+        return;
 
+    bool relink = allocator_ == source.allocator_;
+    for (Node* node = source.begin_; node != &source.top_node_;) {
+        Node* next = node->next();
+        Node* parent;
+        bool left;
+        if (insert_position(node->value(), parent, left) == nullptr) {
+            if (relink) {
+                source.unlink(node);
+                link(node, parent, left);
+            } else {
+                link(create(std::move(node->value())), parent, left);
+                source.unlink(node);
+                source.destroy(node);
+            }
+        }
+        node = next;
+    }
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+void Set<T, Compare, Allocator, Balance>::erase_impl(Node *node) {
+    balance_.erase(&top_node_, node);
+}
 
-    if (node == nullptr || node == &top_node_)
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::const_iterator Set<T, Compare, Allocator, Balance>::find(T const &element) {
+    Node* node = lower_bound_impl(element);
+    if (node == &top_node_ || compare_(element, node->value()))
         return end();
 
-    if (node->value() <= element)
-        return const_iterator(node->next());
-    else return const_iterator(node);
+    balance_.after_access(&top_node_, node);
+    return const_iterator(node);
 }
 
-template <typename T>
-typename Set<T>::Node* Set<T>::upper_lower_impl(T const &element) const {
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::const_iterator Set<T, Compare, Allocator, Balance>::lower_bound(T const &element) const {
+    return const_iterator(lower_bound_impl(element));
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::const_iterator Set<T, Compare, Allocator, Balance>::upper_bound(T const &element) const {
+    return const_iterator(upper_bound_impl(element));
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+std::pair<typename Set<T, Compare, Allocator, Balance>::const_iterator, typename Set<T, Compare, Allocator, Balance>::const_iterator>
+Set<T, Compare, Allocator, Balance>::equal_range(T const &element) const {
+    // one descent: stop at the equal node, its upper bound is the minimum of its right subtree
+    // or, when that is empty, the last node the descent turned left at
+    Node* upper = const_cast<Node*>(&top_node_);
     Node* node = get_root();
-    if (node == nullptr)
-        return nullptr;
+    while (node != nullptr) {
+        if (compare_(element, node->value())) {
+            upper = node;
+            node = node->left;
+        } else if (compare_(node->value(), element)) {
+            node = node->right;
+        } else {
+            if (node->right != nullptr) {
+                upper = node->right;
+                while (upper->left != nullptr)
+                    upper = upper->left;
+            }
+            return {const_iterator(node), const_iterator(upper)};
+        }
+    }
+    return {const_iterator(upper), const_iterator(upper)};
+}
 
-    while (true) {
-        if (node->value() == element)
-            return node;
+template <typename T, typename Compare, typename Allocator, typename Balance>
+template <typename ForwardIt, typename OutputIt>
+OutputIt Set<T, Compare, Allocator, Balance>::find_batch(ForwardIt first, ForwardIt last, OutputIt out) const {
+    while (first != last) {
+        Node* found[BATCH_GROUP];
+        ForwardIt group_end = find_group(first, last, found);
+        for (std::size_t i = 0; first != group_end; ++first, ++i)
+            *out++ = found[i] != nullptr ? const_iterator(found[i]) : end();
+    }
+    return out;
+}
 
-        if (element < node->value()) {
-            if (node->left == nullptr)
-                break;
-            else node = node->left;
+template <typename T, typename Compare, typename Allocator, typename Balance>
+template <typename ForwardIt, typename OutputIt>
+OutputIt Set<T, Compare, Allocator, Balance>::contains_batch(ForwardIt first, ForwardIt last, OutputIt out) const {
+    while (first != last) {
+        Node* found[BATCH_GROUP];
+        ForwardIt group_end = find_group(first, last, found);
+        for (std::size_t i = 0; first != group_end; ++first, ++i)
+            *out++ = found[i] != nullptr;
+    }
+    return out;
+}
+
+// Looks up to BATCH_GROUP keys in lock step: each round moves every unfinished descent one
+// level down and prefetches its next node, so by the time a descent is resumed its node is
+// usually in cache. found gets the equal node or nullptr per key.
+template <typename T, typename Compare, typename Allocator, typename Balance>
+template <typename ForwardIt>
+ForwardIt Set<T, Compare, Allocator, Balance>::find_group(ForwardIt first, ForwardIt last, Node** found) const {
+    ForwardIt keys[BATCH_GROUP];
+    Node* nodes[BATCH_GROUP];
+    std::size_t count = 0;
+    for (; count < BATCH_GROUP && first != last; ++count, ++first) {
+        keys[count] = first;
+        nodes[count] = get_root();
+        found[count] = nullptr;
+    }
+
+    for (bool active = true; active;) {
+        active = false;
+        for (std::size_t i = 0; i < count; i++) {
+            Node* node = nodes[i];
+            if (node == nullptr)
+                continue;
+            // the lower bound so far, checked for equality once the descent ends
+            bool right = compare_(node->value(), *keys[i]);
+            found[i] = right ? found[i] : node;
+            node = right ? node->right : node->left;
+            // a prefetch never faults, not even on nullptr
+            __builtin_prefetch(node);
+            nodes[i] = node;
+            active |= node != nullptr;
+        }
+    }
+
+    for (std::size_t i = 0; i < count; i++) {
+        if (found[i] != nullptr && compare_(*keys[i], found[i]->value()))
+            found[i] = nullptr;
+    }
+    return first;
+}
+
+// Both bounds remember the last node the descent turned left at, so a query touches only
+// the nodes on one root-to-leaf path and never walks the tree with next().
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::Node* Set<T, Compare, Allocator, Balance>::lower_bound_impl(T const &element) const {
+    Node* result = const_cast<Node*>(&top_node_);
+    Node* node = get_root();
+    while (node != nullptr) {
+        if (compare_(node->value(), element)) {
+            node = node->right;
         } else {
-            if (node->right == nullptr)
-                break;
-            else node = node->right;
+            result = node;
+            node = node->left;
         }
     }
+    return result;
+}
 
-    while (node != &top_node_ && node->value() < element) {
-        Node *next = node->next();
-        if (next == &top_node_ || element < next->value())
-            break;
-        node = node->next();
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::Node* Set<T, Compare, Allocator, Balance>::upper_bound_impl(T const &element) const {
+    Node* result = const_cast<Node*>(&top_node_);
+    Node* node = get_root();
+    while (node != nullptr) {
+        if (compare_(element, node->value())) {
+            result = node;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
     }
-    return node;
+    return result;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::size_type Set<T, Compare, Allocator, Balance>::rank(T const &element) const {
+    static_assert(Node::augmented, "rank() needs an OrderStatistics<...> balance policy");
+    size_type rank = 0;
+    Node* node = get_root();
+    while (node != nullptr) {
+        if (compare_(node->value(), element)) {
+            rank += (node->left ? node->left->size : 0) + 1;
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+    return rank;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::const_iterator Set<T, Compare, Allocator, Balance>::nth(size_type index) const {
+    static_assert(Node::augmented, "nth() needs an OrderStatistics<...> balance policy");
+    if (index >= size_)
+        return end();
+
+    Node* node = get_root();
+    while (true) {
+        size_type left = node->left ? node->left->size : 0;
+        if (index == left)
+            return const_iterator(node);
+        if (index < left) {
+            node = node->left;
+        } else {
+            index -= left + 1;
+            node = node->right;
+        }
+    }
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::size_type Set<T, Compare, Allocator, Balance>::count_range(T const &from, T const &to) const {
+    if (compare_(to, from))
+        return 0;
+    // rank(from) counts the elements less than from, this those not greater than to
+    size_type through = 0;
+    Node* node = get_root();
+    while (node != nullptr) {
+        if (!compare_(to, node->value())) {
+            through += (node->left ? node->left->size : 0) + 1;
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+    return through - rank(from);
 }
 
-template <typename T>
-void Set<T>::clear() {
-    clear_impl(top_node_.left);
+template <typename T, typename Compare, typename Allocator, typename Balance>
+template <typename Layout>
+FrozenSet<T, Compare, Layout> Set<T, Compare, Allocator, Balance>::freeze() const {
+    FrozenSet<T, Compare, Layout> frozen(compare_);
+    freeze_into(frozen);
+    return frozen;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+void Set<T, Compare, Allocator, Balance>::freeze_into(FrozenSet<T, Compare, EytzingerLayout>& frozen) const {
+    std::vector<T const*> sorted;
+    sorted.reserve(size());
+    for (Node* node = begin_; node != &top_node_; node = node->next())
+        sorted.push_back(&node->value());
+    frozen.layout(sorted);
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+void Set<T, Compare, Allocator, Balance>::freeze_into(FrozenSet<T, Compare, VanEmdeBoasLayout>& frozen) const {
+    frozen.layout_tree(get_root(), size());
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+void Set<T, Compare, Allocator, Balance>::clear() {
+    Node* root = top_node_.left;
     top_node_.left = nullptr;
     begin_ = &top_node_;
+    last_ = &top_node_;
+    size_ = 0;
+    counted_ = true;
+    balance_.reset();
+
+    if (root == nullptr || (deferred_clear_ && defer_clear(root)))
+        return;
+    clear_impl(allocator_, root);
 }
 
-template <typename T>
-bool Set<T>::empty() const {
+template <typename T, typename Compare, typename Allocator, typename Balance>
+bool Set<T, Compare, Allocator, Balance>::empty() const {
     return get_root() == nullptr;
 }
 
-template <typename T>
-typename Set<T>::Node* Set<T>::Node::next() {
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::size_type Set<T, Compare, Allocator, Balance>::size() const {
+    if (!counted_) {
+        size_ = 0;
+        for (Node* node = begin_; node != &top_node_; node = node->next())
+            ++size_;
+        counted_ = true;
+    }
+    return size_;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::Node* Set<T, Compare, Allocator, Balance>::Node::next() {
     Node* node = this;
     if (node->right != nullptr) {
         node = node->right;
@@ -344,13 +1848,13 @@ typename Set<T>::Node* Set<T>::Node::next() {
         return node;
     }
 
-    while (node->parent != nullptr && node == node->parent->right)
-        node = node->parent;
-    return node->parent == nullptr ? node : node->parent;
+    while (node->parent() != nullptr && node == node->parent()->right)
+        node = node->parent();
+    return node->parent() == nullptr ? node : node->parent();
 }
 
-template <typename T>
-typename Set<T>::Node* Set<T>::Node::prev() {
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::Node* Set<T, Compare, Allocator, Balance>::Node::prev() {
     Node* node = this;
     if (node->left != nullptr) {
         node = node->left;
@@ -359,44 +1863,146 @@ typename Set<T>::Node* Set<T>::Node::prev() {
         return node;
     }
 
-    while (node->parent != nullptr && node == node->parent->left)
-        node = node->parent;
-    return node->parent == nullptr ? node : node->parent;
+    while (node->parent() != nullptr && node == node->parent()->left)
+        node = node->parent();
+    return node->parent() == nullptr ? node : node->parent();
 }
 
 
-template <typename T>
-void Set<T>::swap(Set &other) {
+template <typename T, typename Compare, typename Allocator, typename Balance>
+void Set<T, Compare, Allocator, Balance>::swap(Set &other) {
+    std::swap(size_, other.size_);
+    std::swap(counted_, other.counted_);
+    std::swap(balance_, other.balance_);
+    std::swap(compare_, other.compare_);
+    std::swap(deferred_clear_, other.deferred_clear_);
+    std::swap(parallelism_, other.parallelism_);
+    set_detail::swap_allocators(allocator_, other.allocator_,
+                                typename node_traits::propagate_on_container_swap());
     if (top_node_.left == nullptr && other.top_node_.left == nullptr)
         return;
 
     if (top_node_.left != nullptr && other.top_node_.left != nullptr) {
         std::swap(top_node_.left, other.top_node_.left);
-        std::swap(top_node_.left->parent, other.top_node_.left->parent);
+        top_node_.left->set_parent(&top_node_);
+        other.top_node_.left->set_parent(&other.top_node_);
         std::swap(begin_, other.begin_);
+        std::swap(last_, other.last_);
     } else if (top_node_.left == nullptr) {
         top_node_.left = other.top_node_.left;
-        top_node_.left->parent = &top_node_;
+        top_node_.left->set_parent(&top_node_);
         begin_ = other.begin_;
+        last_ = other.last_;
         other.top_node_.left = nullptr;
         other.begin_ = &other.top_node_;
+        other.last_ = &other.top_node_;
     } else {
         other.top_node_.left = top_node_.left;
-        other.top_node_.left->parent = &other.top_node_;
+        other.top_node_.left->set_parent(&other.top_node_);
         other.begin_ = begin_;
+        other.last_ = last_;
         top_node_.left = nullptr;
         begin_ = &top_node_;
+        last_ = &top_node_;
     }
 }
 
-template <typename T>
-void swap(Set<T>& first, Set<T>& second) {
+// Owns a node taken out of a Set, and a copy of the allocator to free it with.
+template <typename T, typename Compare, typename Allocator, typename Balance>
+struct Set<T, Compare, Allocator, Balance>::NodeHandle {
+    using value_type = T;
+    using allocator_type = Allocator;
+
+    NodeHandle() noexcept {}
+    NodeHandle(NodeHandle&& other) noexcept;
+    NodeHandle& operator=(NodeHandle&& other) noexcept;
+    ~NodeHandle() { reset(); }
+
+    bool empty() const noexcept { return node_ == nullptr; }
+    explicit operator bool() const noexcept { return node_ != nullptr; }
+    // the key may be changed while the node is out of any set
+    T& value() const { return node_->value(); }
+    allocator_type get_allocator() const { return allocator_type(allocator_); }
+
+    void swap(NodeHandle& other) noexcept;
+
+private:
+    friend struct Set;
+
+    Node* node_ = nullptr;
+    // alive only while node_ is set
+    union {
+        node_allocator allocator_;
+    };
+
+    NodeHandle(Node* node, node_allocator const& allocator) : node_(node) {
+        new (&allocator_) node_allocator(allocator);
+    }
+    Node* release() noexcept;
+    void reset() noexcept;
+};
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+Set<T, Compare, Allocator, Balance>::NodeHandle::NodeHandle(NodeHandle&& other) noexcept {
+    if (other.node_ != nullptr) {
+        new (&allocator_) node_allocator(std::move(other.allocator_));
+        node_ = other.release();
+    }
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::NodeHandle&
+Set<T, Compare, Allocator, Balance>::NodeHandle::operator=(NodeHandle&& other) noexcept {
+    if (&other != this) {
+        reset();
+        if (other.node_ != nullptr) {
+            new (&allocator_) node_allocator(std::move(other.allocator_));
+            node_ = other.release();
+        }
+    }
+    return *this;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+void Set<T, Compare, Allocator, Balance>::NodeHandle::swap(NodeHandle& other) noexcept {
+    NodeHandle temp(std::move(other));
+    other = std::move(*this);
+    *this = std::move(temp);
+}
+
+// hands the node over, the allocator copy goes with the handle
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename Set<T, Compare, Allocator, Balance>::Node* Set<T, Compare, Allocator, Balance>::NodeHandle::release() noexcept {
+    Node* node = node_;
+    node_ = nullptr;
+    allocator_.~node_allocator();
+    return node;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+void Set<T, Compare, Allocator, Balance>::NodeHandle::reset() noexcept {
+    if (node_ != nullptr) {
+        Set::destroy(allocator_, node_);
+        node_ = nullptr;
+        allocator_.~node_allocator();
+    }
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+struct Set<T, Compare, Allocator, Balance>::InsertReturn {
+    iterator position;
+    bool inserted;
+    node_type node;
+};
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+void swap(Set<T, Compare, Allocator, Balance>& first, Set<T, Compare, Allocator, Balance>& second) {
     first.swap(second);
 }
 
-template <typename T>
+template <typename T, typename Compare, typename Allocator, typename Balance>
 template <typename V>
-struct Set<T>::Iterator {
+struct Set<T, Compare, Allocator, Balance>::Iterator {
     using iterator_category = std::bidirectional_iterator_tag;
     using difference_type = std::ptrdiff_t;
     using value_type = V;
@@ -440,4 +2046,6 @@ private:
 
 };
 
+#include "BTreeSet.h"
+
 #endif //SET_SET_H
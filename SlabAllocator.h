@@ -0,0 +1,289 @@
+#ifndef SET_SLABALLOCATOR_H
+#define SET_SLABALLOCATOR_H
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace set_detail {
+
+// The slots of one slot size: it owns the chunks they are carved from and keeps the slots
+// that allocators hand back when they go away. Allocators sharing a resource may live on
+// different threads, so every call locks; the allocators only come here to refill.
+class SlabPool {
+public:
+    struct FreeSlot {
+        FreeSlot* next;
+    };
+
+    SlabPool(std::size_t slot_size, std::size_t alignment)
+            : slot_size_(round_up(slot_size < sizeof(FreeSlot) ? sizeof(FreeSlot) : slot_size, alignment)),
+              alignment_(alignment) {}
+    SlabPool(SlabPool const&) = delete;
+    SlabPool& operator=(SlabPool const&) = delete;
+
+    ~SlabPool() {
+        for (void* chunk : chunks_)
+            ::operator delete(chunk);
+    }
+
+    // A new chunk of count slots, freed with the pool.
+    char* new_chunk(std::size_t count) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        chunks_.reserve(chunks_.size() + 1);
+        char* chunk = static_cast<char*>(::operator new(count * slot_size_));
+        chunks_.push_back(chunk);
+        return chunk;
+    }
+
+    // Every slot handed back so far, nullptr if there are none.
+    FreeSlot* take_returned() noexcept {
+        std::lock_guard<std::mutex> lock(mutex_);
+        FreeSlot* slots = returned_;
+        returned_ = nullptr;
+        return slots;
+    }
+
+    void give_back(FreeSlot* first, FreeSlot* last) noexcept {
+        std::lock_guard<std::mutex> lock(mutex_);
+        last->next = returned_;
+        returned_ = first;
+    }
+
+    std::size_t slot_size() const { return slot_size_; }
+    std::size_t alignment() const { return alignment_; }
+
+private:
+    static std::size_t round_up(std::size_t size, std::size_t alignment) {
+        return (size + alignment - 1) / alignment * alignment;
+    }
+
+    std::size_t slot_size_;
+    std::size_t alignment_;
+    FreeSlot* returned_ = nullptr;
+    std::vector<void*> chunks_;
+    std::mutex mutex_;
+};
+
+// One allocator's own slots of a pool: a free list, reused first, and the rest of its last
+// chunk. Nothing here locks; a cache that runs dry refills from the pool, and one that goes
+// away gives its slots back to it.
+class SlabCache {
+public:
+    explicit SlabCache(SlabPool* pool = nullptr) noexcept : pool_(pool) {}
+    SlabCache(SlabCache const&) = delete;
+    SlabCache(SlabCache&& other) noexcept
+            : pool_(other.pool_), free_(other.free_), cursor_(other.cursor_), limit_(other.limit_),
+              chunk_slots_(other.chunk_slots_) {
+        other.free_ = nullptr;
+        other.cursor_ = other.limit_ = nullptr;
+    }
+
+    SlabCache& operator=(SlabCache&& other) noexcept {
+        if (this != &other) {
+            release();
+            pool_ = other.pool_;
+            free_ = other.free_;
+            cursor_ = other.cursor_;
+            limit_ = other.limit_;
+            chunk_slots_ = other.chunk_slots_;
+            other.free_ = nullptr;
+            other.cursor_ = other.limit_ = nullptr;
+        }
+        return *this;
+    }
+
+    ~SlabCache() { release(); }
+
+    SlabPool* pool() const { return pool_; }
+
+    void* allocate() {
+        if (free_ == nullptr && cursor_ == limit_)
+            refill();
+        if (free_ != nullptr) {
+            SlabPool::FreeSlot* slot = free_;
+            free_ = slot->next;
+            return slot;
+        }
+
+        void* slot = cursor_;
+        cursor_ += pool_->slot_size();
+        return slot;
+    }
+
+    void deallocate(void* slot) noexcept {
+        push_free(slot);
+    }
+
+    // Makes room for count more slots in one contiguous chunk; what is left of the current
+    // chunk goes on the free list, which is used first.
+    void reserve(std::size_t count) {
+        std::size_t slot_size = pool_->slot_size();
+        if (static_cast<std::size_t>(limit_ - cursor_) >= count * slot_size)
+            return;
+        char* chunk = pool_->new_chunk(count);
+        free_rest();
+        cursor_ = chunk;
+        limit_ = chunk + count * slot_size;
+    }
+
+private:
+    static const std::size_t MAX_CHUNK_SLOTS = 1 << 16;
+
+    void push_free(void* slot) noexcept {
+        SlabPool::FreeSlot* free_slot = static_cast<SlabPool::FreeSlot*>(slot);
+        free_slot->next = free_;
+        free_ = free_slot;
+    }
+
+    void free_rest() noexcept {
+        for (; cursor_ != limit_; cursor_ += pool_->slot_size())
+            push_free(cursor_);
+    }
+
+    // the slots others gave back come first, a new chunk only when there are none
+    void refill() {
+        free_ = pool_->take_returned();
+        if (free_ != nullptr)
+            return;
+        char* chunk = pool_->new_chunk(chunk_slots_);
+        cursor_ = chunk;
+        limit_ = chunk + chunk_slots_ * pool_->slot_size();
+        if (chunk_slots_ < MAX_CHUNK_SLOTS)
+            chunk_slots_ *= 2;
+    }
+
+    void release() noexcept {
+        if (pool_ == nullptr)
+            return;
+        free_rest();
+        if (free_ == nullptr)
+            return;
+        SlabPool::FreeSlot* last = free_;
+        while (last->next != nullptr)
+            last = last->next;
+        pool_->give_back(free_, last);
+        free_ = nullptr;
+    }
+
+    SlabPool* pool_;
+    SlabPool::FreeSlot* free_ = nullptr;
+    char* cursor_ = nullptr;
+    char* limit_ = nullptr;
+    std::size_t chunk_slots_ = 64;
+};
+
+// One pool per slot size, shared by all the rebound copies of an allocator.
+class SlabResource {
+public:
+    SlabPool& pool(std::size_t slot_size, std::size_t alignment) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (std::unique_ptr<SlabPool> const& pool : pools_)
+            if (pool->slot_size() == slot_size && pool->alignment() == alignment)
+                return *pool;
+
+        pools_.reserve(pools_.size() + 1);
+        pools_.emplace_back(new SlabPool(slot_size, alignment));
+        return *pools_.back();
+    }
+
+private:
+    std::vector<std::unique_ptr<SlabPool>> pools_;
+    std::mutex mutex_;
+};
+
+}
+
+// Fixed-size node allocator for node based containers: single objects come from slabs
+// owned by the allocator (and its copies), arrays fall back to operator new. A copied
+// container gets a fresh set of slabs. Each allocator object keeps its own free list and
+// allocates without locking; its copies, as the sets that split, join and node handles
+// leave, get their own and may be used from different threads.
+template <typename T>
+struct SlabAllocator {
+    static_assert(alignof(T) <= alignof(std::max_align_t), "over-aligned types are not supported");
+
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+    using is_always_equal = std::false_type;
+    // copies only share the pools, which lock, and may be used on different threads
+    using is_thread_safe = std::true_type;
+
+    template <typename U>
+    struct rebind {
+        using other = SlabAllocator<U>;
+    };
+
+    SlabAllocator() : resource_(std::make_shared<set_detail::SlabResource>()) {}
+    // a copy starts with no slots of its own, a moved allocator takes them along
+    SlabAllocator(SlabAllocator const& other) noexcept : resource_(other.resource_), cache_(other.cache_.pool()) {}
+    SlabAllocator(SlabAllocator&& other) noexcept : resource_(other.resource_), cache_(std::move(other.cache_)) {}
+    template <typename U>
+    SlabAllocator(SlabAllocator<U> const& other) noexcept : resource_(other.resource_) {}
+
+    // the cache goes first, its slots are given back to the pool it came from
+    SlabAllocator& operator=(SlabAllocator const& other) noexcept {
+        cache_ = set_detail::SlabCache(other.cache_.pool());
+        resource_ = other.resource_;
+        return *this;
+    }
+
+    SlabAllocator& operator=(SlabAllocator&& other) noexcept {
+        cache_ = std::move(other.cache_);
+        resource_ = other.resource_;
+        return *this;
+    }
+
+    T* allocate(std::size_t n) {
+        if (n != 1)
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        return static_cast<T*>(cache().allocate());
+    }
+
+    void deallocate(T* pointer, std::size_t n) noexcept {
+        if (n != 1)
+            ::operator delete(pointer);
+        else cache().deallocate(pointer);
+    }
+
+    // The next count single objects come out of one contiguous block.
+    void reserve(std::size_t count) { cache().reserve(count); }
+
+    SlabAllocator select_on_container_copy_construction() const { return SlabAllocator(); }
+
+private:
+    template <typename U>
+    friend struct SlabAllocator;
+    template <typename First, typename Second>
+    friend bool operator==(SlabAllocator<First> const& first, SlabAllocator<Second> const& second);
+
+    // the pool is resolved on first use: rebinding must not throw, and only the node type
+    // ever allocates
+    set_detail::SlabCache& cache() {
+        if (cache_.pool() == nullptr)
+            cache_ = set_detail::SlabCache(&resource_->pool(sizeof(T), alignof(T)));
+        return cache_;
+    }
+
+    // declared first, so the cache gives its slots back while the pool is still there
+    std::shared_ptr<set_detail::SlabResource> resource_;
+    set_detail::SlabCache cache_;
+};
+
+template <typename First, typename Second>
+bool operator==(SlabAllocator<First> const& first, SlabAllocator<Second> const& second) {
+    return first.resource_ == second.resource_;
+}
+
+template <typename First, typename Second>
+bool operator!=(SlabAllocator<First> const& first, SlabAllocator<Second> const& second) {
+    return !(first == second);
+}
+
+#endif //SET_SLABALLOCATOR_H
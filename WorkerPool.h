@@ -0,0 +1,152 @@
+#ifndef SET_WORKERPOOL_H
+#define SET_WORKERPOOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+namespace set_detail {
+
+// Process-wide threads for the fork-join work of the containers: parallel copies and set
+// operations. They start with the first task, one fewer than the hardware threads, since the
+// thread that forks works too. A forked task waits in a queue and is run by whoever gets to
+// it first, a worker or the thread that joins it: a join only ever waits for a task that is
+// running, so nested forks cannot deadlock, and with every worker busy a fork costs no more
+// than a call. At exit the workers are joined; tasks forked after that run at their join.
+class WorkerPool {
+public:
+    class Task {
+    public:
+        explicit Task(std::function<void()> job) : job_(std::move(job)) {}
+        Task(Task const&) = delete;
+        Task& operator=(Task const&) = delete;
+
+        // Runs the job here unless a worker has taken it, in which case waits for it. What the
+        // job threw is thrown again.
+        void join() {
+            if (claim()) {
+                run();
+            } else {
+                std::unique_lock<std::mutex> lock(mutex_);
+                finished_.wait(lock, [this] { return done_; });
+            }
+            if (error_)
+                std::rethrow_exception(error_);
+        }
+
+    private:
+        friend class WorkerPool;
+
+        bool claim() {
+            bool expected = false;
+            return taken_.compare_exchange_strong(expected, true, std::memory_order_acq_rel);
+        }
+
+        void run() noexcept {
+            try {
+                job_();
+            } catch (...) {
+                error_ = std::current_exception();
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            done_ = true;
+            finished_.notify_all();
+        }
+
+        std::function<void()> job_;
+        std::atomic<bool> taken_{false};
+        std::exception_ptr error_;
+        std::mutex mutex_;
+        std::condition_variable finished_;
+        bool done_ = false;
+    };
+
+    // Hands job to the pool; the task must be joined before anything the job uses goes away.
+    static std::shared_ptr<Task> fork(std::function<void()> job) {
+        std::shared_ptr<Task> task = std::make_shared<Task>(std::move(job));
+        if (!shut_down().load(std::memory_order_acquire))
+            instance().push(task);
+        return task;
+    }
+
+    WorkerPool(WorkerPool const&) = delete;
+    WorkerPool& operator=(WorkerPool const&) = delete;
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        ready_.notify_all();
+        for (std::thread& worker : workers_)
+            worker.join();
+        shut_down().store(true, std::memory_order_release);
+    }
+
+private:
+    WorkerPool() = default;
+
+    static WorkerPool& instance() {
+        static WorkerPool pool;
+        return pool;
+    }
+
+    static std::atomic<bool>& shut_down() {
+        static std::atomic<bool> flag(false);
+        return flag;
+    }
+
+    // Without threads to be had the task is still queued: its join runs it.
+    void push(std::shared_ptr<Task> const& task) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!started_) {
+            started_ = true;
+            unsigned count = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+            workers_.reserve(count);
+            try {
+                for (unsigned i = 0; i < count; i++)
+                    workers_.emplace_back(&WorkerPool::run, this);
+            } catch (std::system_error const&) {
+            }
+        }
+        tasks_.push_back(task);
+        ready_.notify_one();
+    }
+
+    // a task its joiner already took is only dropped
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            ready_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+            if (stop_)
+                return;
+
+            std::shared_ptr<Task> task = std::move(tasks_.front());
+            tasks_.pop_front();
+            lock.unlock();
+            if (task->claim())
+                task->run();
+            task.reset();
+            lock.lock();
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<std::shared_ptr<Task>> tasks_;
+    std::vector<std::thread> workers_;
+    bool started_ = false;
+    bool stop_ = false;
+};
+
+}
+
+#endif //SET_WORKERPOOL_H
@@ -0,0 +1,21 @@
+
+# Consider dependencies only in project.
+set(CMAKE_DEPENDS_IN_PROJECT_ONLY OFF)
+
+# The set of languages for which implicit dependencies are needed:
+set(CMAKE_DEPENDS_LANGUAGES
+  )
+
+# The set of dependency files which are needed:
+set(CMAKE_DEPENDS_DEPENDENCY_FILES
+  "/root/repo/gtest/gtest-all.cc" "CMakeFiles/tests.dir/gtest/gtest-all.cc.o" "gcc" "CMakeFiles/tests.dir/gtest/gtest-all.cc.o.d"
+  "/root/repo/gtest/gtest_main.cc" "CMakeFiles/tests.dir/gtest/gtest_main.cc.o" "gcc" "CMakeFiles/tests.dir/gtest/gtest_main.cc.o.d"
+  "/root/repo/tests.cpp" "CMakeFiles/tests.dir/tests.cpp.o" "gcc" "CMakeFiles/tests.dir/tests.cpp.o.d"
+  )
+
+# Targets to which this target links.
+set(CMAKE_TARGET_LINKED_INFO_FILES
+  )
+
+# Fortran module output directory.
+set(CMAKE_Fortran_TARGET_MODULE_DIR "")
@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/set.dir/main.cpp.o"
+  "CMakeFiles/set.dir/main.cpp.o.d"
+  "set"
+  "set.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/set.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
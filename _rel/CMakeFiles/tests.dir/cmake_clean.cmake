@@ -0,0 +1,15 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/tests.dir/gtest/gtest-all.cc.o"
+  "CMakeFiles/tests.dir/gtest/gtest-all.cc.o.d"
+  "CMakeFiles/tests.dir/gtest/gtest_main.cc.o"
+  "CMakeFiles/tests.dir/gtest/gtest_main.cc.o.d"
+  "CMakeFiles/tests.dir/tests.cpp.o"
+  "CMakeFiles/tests.dir/tests.cpp.o.d"
+  "tests"
+  "tests.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/tests.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
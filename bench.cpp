@@ -0,0 +1,484 @@
+// Benchmarks Set against std::set.
+//
+//     bench [max_size] [min_size]
+//
+// Sizes go from min_size (default 1000) to max_size (default 1000000) in steps of 10.
+// Every container and size runs in its own child process, so the reported peak RSS
+// belongs to that run alone. ConcurrentSet and LockFreeSet instead run mixes of lookups
+// and updates on 1 to 64 threads, against Set behind a mutex. Results are printed as a
+// table and written as tab separated lines to bench_output.txt. Build with
+// -DCMAKE_BUILD_TYPE=Release for meaningful numbers.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#define BENCH_FORK 1
+#endif
+
+#include "ConcurrentSet.h"
+#include "LockFreeSet.h"
+#include "Set.h"
+#include "SlabAllocator.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Result {
+    std::string workload;
+    std::size_t ops;
+    double seconds;
+};
+
+// Written to by every measured loop so that none of them can be optimized away.
+std::uint64_t volatile checksum = 0;
+
+// Zipfian ranks in [0, n) with skew theta, as in Gray et al., "Quickly generating
+// billion-record synthetic databases". Setup is O(n), every draw O(1).
+class Zipfian {
+public:
+    Zipfian(std::size_t n, double theta) : n_(n), theta_(theta) {
+        double zeta_n = 0;
+        for (std::size_t i = 1; i <= n; i++)
+            zeta_n += 1 / std::pow(static_cast<double>(i), theta);
+        double zeta_2 = 1 + 1 / std::pow(2.0, theta);
+
+        alpha_ = 1 / (1 - theta);
+        zeta_n_ = zeta_n;
+        eta_ = (1 - std::pow(2.0 / n, 1 - theta)) / (1 - zeta_2 / zeta_n);
+    }
+
+    template <typename Random>
+    std::size_t operator()(Random& random) {
+        double u = std::uniform_real_distribution<double>(0, 1)(random);
+        double uz = u * zeta_n_;
+        if (uz < 1)
+            return 0;
+        if (uz < 1 + std::pow(0.5, theta_))
+            return 1;
+        std::size_t rank = static_cast<std::size_t>(n_ * std::pow(eta_ * u - eta_ + 1, alpha_));
+        return rank < n_ ? rank : n_ - 1;
+    }
+
+private:
+    std::size_t n_;
+    double theta_;
+    double alpha_;
+    double zeta_n_;
+    double eta_;
+};
+
+template <typename Body>
+Result measure(char const* workload, std::size_t ops, Body body) {
+    Clock::time_point start = Clock::now();
+    body();
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    return {workload, ops, seconds};
+}
+
+// Answers whether each key is present, through contains_batch() where the container has it.
+template <typename Container>
+auto contains_all(Container& c, int const* first, int const* last, bool* out, int)
+        -> decltype(c.contains_batch(first, last, out), void()) {
+    c.contains_batch(first, last, out);
+}
+
+template <typename Container>
+void contains_all(Container& c, int const* first, int const* last, bool* out, long) {
+    for (; first != last; ++first)
+        *out++ = c.find(*first) != c.end();
+}
+
+// Adds every key of other, through union_with() where the container has it.
+template <typename Container>
+auto unite(Container& c, Container&& other, int) -> decltype(c.union_with(std::move(other)), void()) {
+    c.union_with(std::move(other));
+}
+
+template <typename Container>
+void unite(Container& c, Container&& other, long) {
+    c.insert(other.begin(), other.end());
+}
+
+// Every container stores the even keys 0, 2, ..., 2n - 2, odd keys are misses.
+template <typename Container>
+std::vector<Result> run(std::size_t n) {
+    std::vector<Result> results;
+    std::mt19937_64 random(42);
+
+    std::vector<int> keys(n);
+    for (std::size_t i = 0; i < n; i++)
+        keys[i] = static_cast<int>(2 * i);
+    std::vector<int> shuffled = keys;
+    std::shuffle(shuffled.begin(), shuffled.end(), random);
+
+    std::size_t lookups = std::max<std::size_t>(n, 1 << 20);
+    std::vector<int> hits(lookups);
+    std::vector<int> bounds(lookups);
+    for (std::size_t i = 0; i < lookups; i++) {
+        hits[i] = keys[random() % n];
+        bounds[i] = static_cast<int>(random() % (2 * n + 2)) - 1;
+    }
+
+    {
+        Container c;
+        results.push_back(measure("insert_sorted", n, [&] {
+            for (int key : keys)
+                c.insert(key);
+        }));
+    }
+    {
+        Container* c = nullptr;
+        results.push_back(measure("build_sorted", n, [&] {
+            c = new Container(keys.begin(), keys.end());
+        }));
+        checksum += *c->begin();
+        delete c;
+    }
+    {
+        Container c;
+        results.push_back(measure("insert_reverse", n, [&] {
+            for (std::size_t i = n; i-- > 0;)
+                c.insert(keys[i]);
+        }));
+    }
+    {
+        std::vector<int> skewed(n);
+        Zipfian zipfian(n, 0.99);
+        for (std::size_t i = 0; i < n; i++)
+            skewed[i] = shuffled[zipfian(random)];
+
+        Container c;
+        results.push_back(measure("insert_zipfian", n, [&] {
+            for (int key : skewed)
+                c.insert(key);
+        }));
+    }
+
+    Container c;
+    results.push_back(measure("insert_random", n, [&] {
+        for (int key : shuffled)
+            c.insert(key);
+    }));
+
+    results.push_back(measure("find_hit", lookups, [&] {
+        for (int key : hits)
+            checksum += c.find(key) != c.end();
+    }));
+    results.push_back(measure("find_miss", lookups, [&] {
+        for (int key : hits)
+            checksum += c.find(key + 1) != c.end();
+    }));
+    results.push_back(measure("find_batch", lookups, [&] {
+        // in requests of 256 keys, a plain find() loop for containers without contains_batch()
+        bool found[256];
+        for (std::size_t i = 0; i < lookups; i += 256) {
+            std::size_t count = std::min<std::size_t>(256, lookups - i);
+            contains_all(c, hits.data() + i, hits.data() + i + count, found, 0);
+            checksum += std::count(found, found + count, true);
+        }
+    }));
+    results.push_back(measure("lower_bound", lookups, [&] {
+        for (int key : bounds)
+            checksum += c.lower_bound(key) != c.end();
+    }));
+    results.push_back(measure("upper_bound", lookups, [&] {
+        for (int key : bounds)
+            checksum += c.upper_bound(key) != c.end();
+    }));
+
+    std::size_t passes = (lookups + n - 1) / n;
+    results.push_back(measure("iterate", passes * n, [&] {
+        for (std::size_t pass = 0; pass < passes; pass++)
+            for (int key : c)
+                checksum += key;
+    }));
+
+    results.push_back(measure("erase_churn", n, [&] {
+        // erase a random element and insert a fresh one, the size stays n
+        int next = static_cast<int>(2 * n);
+        for (std::size_t i = 0; i < n; i++) {
+            c.erase(c.find(shuffled[i]));
+            c.insert(next);
+            shuffled[i] = next;
+            next += 2;
+        }
+    }));
+
+    {
+        // a delta of n / 64 odd keys merged into the set
+        std::vector<int> delta;
+        for (std::size_t i = 0; i < n; i += 64)
+            delta.push_back(static_cast<int>(2 * (random() % n) + 1));
+        Container other(delta.begin(), delta.end());
+        results.push_back(measure("union_delta", delta.size(), [&] {
+            unite(c, std::move(other), 0);
+        }));
+        checksum += c.size();
+    }
+
+    {
+        Container* copy = nullptr;
+        results.push_back(measure("copy", n, [&] {
+            copy = new Container(c);
+        }));
+        checksum += *copy->begin();
+        results.push_back(measure("clear", n, [&] {
+            copy->clear();
+        }));
+        delete copy;
+    }
+
+    return results;
+}
+
+// Set behind one mutex, the baseline for ConcurrentSet.
+class LockedSet {
+public:
+    bool insert(int x) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return set_.insert(x).second;
+    }
+
+    bool erase(int x) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Set<int>::const_iterator it = set_.find(x);
+        if (it == set_.end())
+            return false;
+        set_.erase(it);
+        return true;
+    }
+
+    bool contains(int x) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return set_.find(x) != set_.end();
+    }
+
+private:
+    std::mutex mutex_;
+    Set<int> set_;
+};
+
+// Whether an insert added the element, for inserts that answer with a bool or with a pair.
+bool inserted(bool added) {
+    return added;
+}
+
+template <typename Iterator>
+bool inserted(std::pair<Iterator, bool> const& result) {
+    return result.second;
+}
+
+// Keys in [0, n), half of them present. Every workload runs the same number of operations,
+// spread over its threads; "r90_t8" is 90% contains, the rest inserts and erases in equal
+// parts, on 8 threads. The set stays about half full throughout.
+template <typename Container>
+std::vector<Result> run_concurrent(std::size_t n) {
+    std::vector<Result> results;
+    std::size_t ops = std::max<std::size_t>(n, 1 << 20);
+    std::vector<std::uint64_t> draws(ops);
+    std::mt19937_64 random(42);
+    for (std::uint64_t& draw : draws)
+        draw = random();
+
+    for (unsigned reads : {100u, 90u, 50u}) {
+        for (unsigned threads : {1u, 2u, 4u, 8u, 16u, 32u, 64u}) {
+            Container c;
+            for (std::size_t i = 0; i < n; i += 2)
+                c.insert(static_cast<int>(i));
+            std::string workload = "r" + std::to_string(reads) + "_t" + std::to_string(threads);
+            results.push_back(measure(workload.c_str(), ops, [&] {
+                std::vector<std::thread> workers;
+                for (unsigned t = 0; t < threads; t++)
+                    workers.emplace_back([&, t] {
+                        std::uint64_t sum = 0;
+                        for (std::size_t i = ops * t / threads; i < ops * (t + 1) / threads; i++) {
+                            int key = static_cast<int>(draws[i] % n);
+                            unsigned kind = static_cast<unsigned>((draws[i] >> 40) % 200);
+                            if (kind < 2 * reads)
+                                sum += c.contains(key);
+                            else if (kind % 2 == 0)
+                                sum += inserted(c.insert(key));
+                            else sum += c.erase(key);
+                        }
+                        checksum = checksum + sum;
+                    });
+                for (std::thread& worker : workers)
+                    worker.join();
+            }));
+        }
+    }
+    return results;
+}
+
+struct Runner {
+    char const* name;
+    std::function<std::vector<Result>(std::size_t)> run;
+};
+
+std::vector<Runner> runners() {
+    return {
+            {"std::set", run<std::set<int>>},
+            {"Set", run<Set<int>>},
+            {"Set<AvlBalance>", run<Set<int, std::less<int>, std::allocator<int>, AvlBalance>>},
+            {"Set<SlabAllocator>", run<Set<int, std::less<int>, SlabAllocator<int>>>},
+            {"Set<BTreeBalance>", run<Set<int, std::less<int>, std::allocator<int>, BTreeBalance<>>>},
+            {"ConcurrentSet", run_concurrent<ConcurrentSet<int>>},
+            {"LockFreeSet", run_concurrent<LockFreeSet<int>>},
+            {"Set+mutex", run_concurrent<LockedSet>},
+    };
+}
+
+void report(FILE* output, char const* name, std::size_t n, std::vector<Result> const& results, long peak_rss_kb) {
+    for (Result const& result : results) {
+        double ns_per_op = result.seconds * 1e9 / result.ops;
+        double mops = result.ops / result.seconds / 1e6;
+        std::printf("%-20s %-15s %12zu %12.1f %12.2f %12ld\n",
+                    name, result.workload.c_str(), n, ns_per_op, mops, peak_rss_kb);
+        std::fprintf(output, "%s\t%s\t%zu\t%.3f\t%.4f\t%ld\n",
+                     name, result.workload.c_str(), n, ns_per_op, mops, peak_rss_kb);
+    }
+    std::fflush(stdout);
+    std::fflush(output);
+}
+
+#ifdef BENCH_FORK
+
+bool write_all(int fd, void const* data, std::size_t size) {
+    char const* bytes = static_cast<char const*>(data);
+    while (size > 0) {
+        ssize_t written = write(fd, bytes, size);
+        if (written <= 0)
+            return false;
+        bytes += written;
+        size -= written;
+    }
+    return true;
+}
+
+bool read_all(int fd, void* data, std::size_t size) {
+    char* bytes = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t got = read(fd, bytes, size);
+        if (got <= 0)
+            return false;
+        bytes += got;
+        size -= got;
+    }
+    return true;
+}
+
+// Runs one container and size in a child process, returns false if it died.
+bool run_isolated(Runner const& runner, std::size_t n, FILE* output) {
+    int fds[2];
+    if (pipe(fds) != 0)
+        return false;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        std::vector<Result> results = runner.run(n);
+        for (Result const& result : results) {
+            std::size_t length = result.workload.size();
+            write_all(fds[1], &length, sizeof(length));
+            write_all(fds[1], result.workload.data(), length);
+            write_all(fds[1], &result.ops, sizeof(result.ops));
+            write_all(fds[1], &result.seconds, sizeof(result.seconds));
+        }
+        close(fds[1]);
+        _exit(0);
+    }
+    close(fds[1]);
+    if (pid < 0) {
+        close(fds[0]);
+        return false;
+    }
+
+    std::vector<Result> results;
+    std::size_t length;
+    while (read_all(fds[0], &length, sizeof(length))) {
+        Result result;
+        result.workload.resize(length);
+        if (!read_all(fds[0], &result.workload[0], length) ||
+            !read_all(fds[0], &result.ops, sizeof(result.ops)) ||
+            !read_all(fds[0], &result.seconds, sizeof(result.seconds)))
+            break;
+        results.push_back(result);
+    }
+    close(fds[0]);
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0)
+        return false;
+
+    long peak_rss_kb = usage.ru_maxrss;
+#ifdef __APPLE__
+    peak_rss_kb /= 1024;
+#endif
+    report(output, runner.name, n, results, peak_rss_kb);
+    return WIFEXITED(status);
+}
+
+#endif
+
+}
+
+int main(int argc, char** argv) {
+    std::size_t max_size = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+    std::size_t min_size = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1000;
+    if (min_size == 0 || max_size < min_size) {
+        std::fprintf(stderr, "usage: %s [max_size] [min_size]\n", argv[0]);
+        return 1;
+    }
+
+#ifndef __OPTIMIZE__
+    std::printf("warning: built without optimizations\n");
+#endif
+
+    FILE* output = std::fopen("bench_output.txt", "w");
+    if (output == nullptr) {
+        std::perror("bench_output.txt");
+        return 1;
+    }
+    std::fprintf(output, "# container\tworkload\tsize\tns_per_op\tmops_per_s\tpeak_rss_kb\n");
+    std::printf("%-20s %-15s %12s %12s %12s %12s\n", "container", "workload", "size", "ns/op", "Mops/s", "peak RSS KB");
+
+    int status = 0;
+    for (std::size_t n = min_size; n <= max_size; n *= 10) {
+        for (Runner const& runner : runners()) {
+#ifdef BENCH_FORK
+            std::fflush(stdout);
+            std::fflush(output);
+            if (!run_isolated(runner, n, output)) {
+                std::fprintf(stderr, "%s failed at size %zu\n", runner.name, n);
+                status = 1;
+            }
+#else
+            report(output, runner.name, n, runner.run(n), -1);
+#endif
+        }
+        if (n > max_size / 10)
+            break;
+    }
+
+    std::fclose(output);
+    return status;
+}
@@ -2,8 +2,21 @@
 #include <cstddef>
 #include <vector>
 #include <random>
+#include <atomic>
+#include <cstdint>
+#include <set>
+#include <memory>
+#include <string>
+#include <numeric>
+#include <thread>
 #include "gtest/gtest.h"
 #include "Set.h"
+#include "SlabAllocator.h"
+#include "FlatSet.h"
+#include "PersistentSet.h"
+#include "ConcurrentSet.h"
+#include "LockFreeSet.h"
+#include "EpochReclaimer.h"
 
 #include <algorithm>
 
@@ -343,4 +356,1756 @@ TEST(correctness, throwing_new) {
     EXPECT_ANY_THROW(s.insert(throwing_new(1)));
 
     EXPECT_FALSE(s.empty());
-}
\ No newline at end of file
+}
+TEST(correctness, sorted_insert_erase) {
+    Set<int> s;
+    for (int i = 0; i < 100000; i++)
+        s.insert(i);
+    for (int i = 0; i < 100000; i += 2)
+        s.erase(s.find(i));
+
+    int expected = 1;
+    for (int i : s) {
+        EXPECT_EQ(expected, i);
+        expected += 2;
+    }
+    EXPECT_EQ(100001, expected);
+}
+
+TEST(correctness, random_insert_erase) {
+    std::default_random_engine rnd;
+    std::set<int> reference;
+    Set<int> s;
+    for (int i = 0; i < 20000; i++) {
+        int x = rnd() % 1000;
+        if (rnd() % 3 == 0) {
+            EXPECT_EQ(reference.count(x) != 0, s.find(x) != s.end());
+            if (reference.erase(x))
+                s.erase(s.find(x));
+        } else {
+            EXPECT_EQ(reference.insert(x).second, s.insert(x).second);
+        }
+    }
+    EXPECT_TRUE(std::equal(reference.begin(), reference.end(), s.begin()));
+    EXPECT_TRUE(std::equal(reference.rbegin(), reference.rend(), s.rbegin()));
+}
+
+template <typename Balance>
+void check_random_insert_erase() {
+    std::default_random_engine rnd;
+    std::set<int> reference;
+    Set<int, std::less<int>, std::allocator<int>, Balance> s;
+    for (int i = 0; i < 20000; i++) {
+        int x = rnd() % 1000;
+        if (rnd() % 3 == 0) {
+            EXPECT_EQ(reference.count(x) != 0, s.find(x) != s.end());
+            if (reference.erase(x))
+                s.erase(s.find(x));
+        } else {
+            EXPECT_EQ(reference.insert(x).second, s.insert(x).second);
+        }
+    }
+    EXPECT_TRUE(std::equal(reference.begin(), reference.end(), s.begin()));
+    EXPECT_TRUE(std::equal(reference.rbegin(), reference.rend(), s.rbegin()));
+
+    Set<int, std::less<int>, std::allocator<int>, Balance> copy = s;
+    s.clear();
+    for (int i = 0; i < 50000; i++)
+        s.insert(i);
+    for (int i = 0; i < 50000; i += 2)
+        s.erase(s.find(i));
+    EXPECT_EQ(1, *s.begin());
+    EXPECT_EQ(49999, *s.rbegin());
+    EXPECT_TRUE(std::equal(reference.begin(), reference.end(), copy.begin()));
+}
+
+TEST(correctness, balance_policies) {
+    check_random_insert_erase<RedBlackBalance>();
+    check_random_insert_erase<AvlBalance>();
+    check_random_insert_erase<TreapBalance>();
+    check_random_insert_erase<ScapegoatBalance>();
+    check_random_insert_erase<SplayBalance>();
+}
+
+TEST(correctness, node_size) {
+    // three links, the balance tag is packed into the parent pointer, no vtable
+    EXPECT_EQ(3 * sizeof(void*) + sizeof(void*), Set<int>::node_size);
+    EXPECT_EQ(3 * sizeof(void*) + sizeof(void*), (Set<int, std::less<int>, std::allocator<int>, AvlBalance>::node_size));
+    EXPECT_EQ(3 * sizeof(void*) + sizeof(long long), Set<long long>::node_size);
+}
+
+TEST(correctness, custom_compare) {
+    Set<int, std::greater<int>> s;
+    for (int i = 0; i < 100; i++)
+        s.insert(i);
+
+    EXPECT_EQ(99, *s.begin());
+    EXPECT_EQ(0, *s.rbegin());
+    EXPECT_EQ(50, *s.find(50));
+    EXPECT_EQ(49, *s.lower_bound(49));
+}
+
+TEST(correctness, slab_allocator) {
+    SlabAllocator<long> allocator;
+    long* first = allocator.allocate(1);
+    long* second = allocator.allocate(1);
+    EXPECT_EQ(first + 1, second);
+
+    allocator.deallocate(first, 1);
+    EXPECT_EQ(first, allocator.allocate(1));
+
+    SlabAllocator<int> rebound(allocator);
+    EXPECT_TRUE(rebound == allocator);
+    EXPECT_FALSE(SlabAllocator<long>() == allocator);
+
+    // a copy keeps a free list of its own, and gives it back to the pool when it goes away
+    {
+        SlabAllocator<long> copy(allocator);
+        EXPECT_TRUE(copy == allocator);
+        allocator.deallocate(second, 1);
+        long* third = copy.allocate(1);
+        EXPECT_NE(second, third);
+        EXPECT_EQ(second, allocator.allocate(1));
+        copy.deallocate(third, 1);
+    }
+    SlabAllocator<long> moved(std::move(allocator));
+    moved.deallocate(second, 1);
+    EXPECT_EQ(second, moved.allocate(1));
+
+    moved.deallocate(first, 1);
+    moved.deallocate(second, 1);
+}
+
+TEST(correctness, slab_allocated_set) {
+    std::default_random_engine rnd;
+    std::set<int> reference;
+    Set<int, std::less<int>, SlabAllocator<int>> s;
+    for (int i = 0; i < 20000; i++) {
+        int x = rnd() % 1000;
+        if (rnd() % 3 == 0) {
+            if (reference.erase(x))
+                s.erase(s.find(x));
+        } else {
+            EXPECT_EQ(reference.insert(x).second, s.insert(x).second);
+        }
+    }
+
+    Set<int, std::less<int>, SlabAllocator<int>> copy = s;
+    EXPECT_FALSE(copy.get_allocator() == s.get_allocator());
+    s.clear();
+    EXPECT_TRUE(std::equal(reference.begin(), reference.end(), copy.begin()));
+
+    swap(s, copy);
+    EXPECT_TRUE(copy.empty());
+    EXPECT_TRUE(std::equal(reference.begin(), reference.end(), s.begin()));
+}
+
+TEST(correctness, move) {
+    Set<int> s;
+    for (int i = 0; i < 100; i++)
+        s.insert(i);
+    auto first = s.begin();
+
+    Set<int> moved(std::move(s));
+    EXPECT_TRUE(s.empty());
+    EXPECT_EQ(first, moved.begin());
+    EXPECT_EQ(99, *moved.rbegin());
+
+    s.insert(5);
+    s = std::move(moved);
+    EXPECT_TRUE(moved.empty());
+    EXPECT_EQ(0, *s.begin());
+    EXPECT_EQ(99, *--s.end());
+
+    EXPECT_TRUE(std::is_nothrow_move_constructible<Set<int>>::value);
+    EXPECT_TRUE(std::is_nothrow_move_assignable<Set<int>>::value);
+
+    std::vector<Set<int>> sets(1, s);
+    sets.resize(100);
+    EXPECT_EQ(0, *sets.front().begin());
+}
+
+struct pointee_less {
+    bool operator()(std::unique_ptr<int> const& first, std::unique_ptr<int> const& second) const {
+        return *first < *second;
+    }
+};
+
+TEST(correctness, move_only_keys) {
+    Set<std::unique_ptr<int>, pointee_less> s;
+    std::unique_ptr<int> key(new int(2));
+    EXPECT_TRUE(s.insert(std::move(key)).second);
+    EXPECT_FALSE(key);
+
+    EXPECT_TRUE(s.emplace(new int(1)).second);
+    EXPECT_FALSE(s.emplace(new int(2)).second);
+    EXPECT_EQ(1, **s.begin());
+    EXPECT_EQ(2, **++s.begin());
+}
+
+TEST(correctness, emplace_string) {
+    Set<std::string> s;
+    std::string key(100, 'a');
+    s.insert(std::move(key));
+    EXPECT_TRUE(key.empty());
+
+    EXPECT_TRUE(s.emplace(3, 'b').second);
+    EXPECT_FALSE(s.emplace(3, 'b').second);
+    EXPECT_EQ("bbb", *s.rbegin());
+}
+
+TEST(correctness, equal_range) {
+    Set<int> s;
+    for (int i = 0; i < 1000; i += 2)
+        s.insert(i);
+
+    for (int i = -1; i < 1000; i++) {
+        auto range = s.equal_range(i);
+        EXPECT_EQ(s.lower_bound(i), range.first);
+        EXPECT_EQ(s.upper_bound(i), range.second);
+        EXPECT_EQ(i % 2 == 0 && i >= 0 ? 1 : 0, std::distance(range.first, range.second));
+    }
+    EXPECT_EQ(s.end(), s.equal_range(1000).first);
+    EXPECT_EQ(s.end(), s.upper_bound(998));
+    EXPECT_EQ(s.begin(), s.upper_bound(-1));
+
+    Set<int> empty;
+    EXPECT_EQ(empty.end(), empty.upper_bound(1));
+    EXPECT_EQ(empty.end(), empty.equal_range(1).second);
+}
+
+TEST(correctness, size) {
+    Set<int> s;
+    EXPECT_EQ(0u, s.size());
+    for (int i = 0; i < 100; i++)
+        s.insert(i % 50);
+    EXPECT_EQ(50u, s.size());
+
+    s.erase(s.find(10));
+    EXPECT_EQ(49u, s.size());
+
+    Set<int> copy = s;
+    EXPECT_EQ(49u, copy.size());
+    Set<int> moved(std::move(copy));
+    EXPECT_EQ(49u, moved.size());
+    EXPECT_EQ(0u, copy.size());
+
+    s.clear();
+    EXPECT_EQ(0u, s.size());
+    swap(s, moved);
+    EXPECT_EQ(49u, s.size());
+}
+
+template <typename Balance>
+void check_order_statistics() {
+    std::default_random_engine rnd;
+    std::set<int> reference;
+    Set<int, std::less<int>, std::allocator<int>, OrderStatistics<Balance>> s;
+    for (int i = 0; i < 5000; i++) {
+        int x = rnd() % 1000;
+        if (rnd() % 3 == 0) {
+            if (reference.erase(x))
+                s.erase(s.find(x));
+        } else {
+            reference.insert(x);
+            s.insert(x);
+        }
+    }
+
+    auto copy = s;
+    ASSERT_EQ(reference.size(), copy.size());
+    std::vector<int> sorted(reference.begin(), reference.end());
+    for (std::size_t i = 0; i < sorted.size(); i++) {
+        EXPECT_EQ(sorted[i], *copy.nth(i));
+        EXPECT_EQ(i, copy.rank(sorted[i]));
+    }
+    EXPECT_EQ(copy.end(), copy.nth(sorted.size()));
+    EXPECT_EQ(sorted.size(), copy.rank(1000));
+    EXPECT_EQ(0u, copy.rank(-1));
+
+    for (int i = 0; i < 100; i++) {
+        int from = rnd() % 1100 - 50;
+        int to = rnd() % 1100 - 50;
+        std::size_t expected = from <= to ? std::distance(reference.lower_bound(from), reference.upper_bound(to)) : 0;
+        EXPECT_EQ(expected, copy.count_range(from, to));
+    }
+    // both ends count, and a reversed range is empty
+    for (int x : {sorted.front(), sorted[sorted.size() / 2], sorted.back()}) {
+        EXPECT_EQ(1u, copy.count_range(x, x));
+        EXPECT_EQ(0u, copy.count_range(x + 1, x));
+    }
+    EXPECT_EQ(0u, copy.count_range(-10, -10));
+    EXPECT_EQ(0u, copy.count_range(1000, -1));
+    EXPECT_EQ(sorted.size(), copy.count_range(sorted.front(), sorted.back()));
+}
+
+TEST(correctness, order_statistics) {
+    check_order_statistics<RedBlackBalance>();
+    check_order_statistics<AvlBalance>();
+    check_order_statistics<TreapBalance>();
+    check_order_statistics<ScapegoatBalance>();
+    check_order_statistics<SplayBalance>();
+    EXPECT_EQ(Set<int>::node_size + sizeof(std::size_t),
+              (Set<int, std::less<int>, std::allocator<int>, OrderStatistics<RedBlackBalance>>::node_size));
+}
+
+template <typename Balance>
+void check_bulk_build() {
+    using S = Set<int, std::less<int>, std::allocator<int>, OrderStatistics<Balance>>;
+    std::vector<int> sorted;
+    for (int i = 0; i < 10000; i++)
+        sorted.push_back(2 * i);
+
+    S s(sorted.begin(), sorted.end());
+    EXPECT_EQ(sorted.size(), s.size());
+    EXPECT_TRUE(std::equal(sorted.begin(), sorted.end(), s.begin()));
+    EXPECT_EQ(sorted.back(), *s.rbegin());
+    EXPECT_EQ(5000u, s.rank(10000));
+
+    // the tree is valid for the policy: keep modifying it
+    for (int i = 0; i < 20000; i += 3)
+        s.insert(i);
+    for (int i = 0; i < 20000; i += 5)
+        if (s.find(i) != s.end())
+            s.erase(s.find(i));
+
+    std::set<int> reference(sorted.begin(), sorted.end());
+    for (int i = 0; i < 20000; i += 3)
+        reference.insert(i);
+    for (int i = 0; i < 20000; i += 5)
+        reference.erase(i);
+    EXPECT_EQ(reference.size(), s.size());
+    EXPECT_TRUE(std::equal(reference.begin(), reference.end(), s.begin()));
+
+    std::vector<int> unsorted;
+    std::default_random_engine rnd;
+    for (int i = 0; i < 5000; i++)
+        unsorted.push_back(rnd() % 40000);
+    auto first = s.begin();
+    s.insert_sorted(unsorted.begin(), unsorted.end());
+    reference.insert(unsorted.begin(), unsorted.end());
+    EXPECT_EQ(first, s.begin());
+    EXPECT_EQ(reference.size(), s.size());
+    EXPECT_TRUE(std::equal(reference.begin(), reference.end(), s.begin()));
+    for (std::size_t i = 0; i < reference.size(); i += 97)
+        EXPECT_EQ(i, s.rank(*s.nth(i)));
+
+    // a range this small is linked in node by node, the tree is not rebuilt
+    std::vector<int> few{-7, -7, 1, 3, 4, 40001, 40001};
+    auto second = std::next(s.begin());
+    s.insert_sorted(few.begin(), few.end());
+    reference.insert(few.begin(), few.end());
+    EXPECT_EQ(-7, *s.begin());
+    EXPECT_EQ(40001, *s.rbegin());
+    EXPECT_EQ(reference.size(), s.size());
+    EXPECT_TRUE(std::equal(reference.begin(), reference.end(), s.begin()));
+    EXPECT_EQ(second, s.find(*second));
+    for (std::size_t i = 0; i < reference.size(); i += 97)
+        EXPECT_EQ(i, s.rank(*s.nth(i)));
+    for (int i = 0; i < 40000; i += 7)
+        s.insert(i);
+}
+
+TEST(correctness, bulk_build) {
+    check_bulk_build<RedBlackBalance>();
+    check_bulk_build<AvlBalance>();
+    check_bulk_build<TreapBalance>();
+    check_bulk_build<ScapegoatBalance>();
+    check_bulk_build<SplayBalance>();
+
+    int duplicates[] = {1, 1, 2, 3, 3, 3};
+    Set<int> s(std::begin(duplicates), std::end(duplicates));
+    EXPECT_EQ(3u, s.size());
+    Set<int> empty(duplicates, duplicates);
+    EXPECT_TRUE(empty.empty());
+}
+
+TEST(correctness, bulk_build_throwing) {
+    Set<throwing_new> s;
+    s.insert(throwing_new(3));
+    std::vector<throwing_new> keys{throwing_new(1), throwing_new(2)};
+    EXPECT_ANY_THROW(s.insert_sorted(keys.begin(), keys.end()));
+    EXPECT_EQ(1u, s.size());
+    EXPECT_EQ(3, s.begin()->x);
+}
+
+TEST(correctness, clear_deep_tree) {
+    // ascending inserts into a splay tree leave a single path a million nodes long
+    Set<int, std::less<int>, std::allocator<int>, SplayBalance> s;
+    for (int i = 0; i < 1000000; i++)
+        s.insert(i);
+    s.clear();
+    EXPECT_TRUE(s.empty());
+
+    for (int i = 0; i < 1000000; i++)
+        s.insert(i);
+}
+
+struct counted {
+    static std::atomic<int> alive;
+    int x;
+
+    counted(int x) : x(x) { ++alive; }
+    counted(counted const& other) : x(other.x) { ++alive; }
+    ~counted() { --alive; }
+
+    friend bool operator<(counted const& a, counted const& b) { return a.x < b.x; }
+};
+
+std::atomic<int> counted::alive(0);
+
+// Stateful and not thread safe: counts live objects and notes any call from another thread.
+template <typename T>
+struct thread_bound_allocator {
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    std::shared_ptr<int> live = std::make_shared<int>(0);
+    std::shared_ptr<bool> foreign = std::make_shared<bool>(false);
+    std::thread::id owner = std::this_thread::get_id();
+
+    thread_bound_allocator() = default;
+    template <typename U>
+    thread_bound_allocator(thread_bound_allocator<U> const& other)
+            : live(other.live), foreign(other.foreign), owner(other.owner) {}
+
+    T* allocate(std::size_t n) {
+        note();
+        ++*live;
+        return std::allocator<T>().allocate(n);
+    }
+    void deallocate(T* pointer, std::size_t n) {
+        note();
+        --*live;
+        std::allocator<T>().deallocate(pointer, n);
+    }
+    void note() {
+        if (std::this_thread::get_id() != owner)
+            *foreign = true;
+    }
+};
+
+template <typename T, typename U>
+bool operator==(thread_bound_allocator<T> const& first, thread_bound_allocator<U> const& second) {
+    return first.live == second.live;
+}
+
+template <typename T, typename U>
+bool operator!=(thread_bound_allocator<T> const& first, thread_bound_allocator<U> const& second) {
+    return !(first == second);
+}
+
+TEST(correctness, deferred_clear) {
+    {
+        Set<counted> s;
+        s.set_deferred_clear(true);
+        for (int i = 0; i < 100000; i++)
+            s.insert(counted(i));
+        EXPECT_EQ(100000, counted::alive);
+
+        s.clear();
+        EXPECT_TRUE(s.empty());
+        s.insert(counted(1));
+        EXPECT_EQ(1, s.begin()->x);
+    }
+    set_detail::BackgroundReclaimer::drain();
+    EXPECT_EQ(0, counted::alive);
+    EXPECT_EQ(0u, set_detail::BackgroundReclaimer::pending());
+
+    Set<int, std::less<int>, SlabAllocator<int>> slab;
+    slab.set_deferred_clear(true);
+    for (int i = 0; i < 10000; i++)
+        slab.insert(i);
+    auto allocator = slab.get_allocator();
+    slab.clear();
+    EXPECT_FALSE(allocator == slab.get_allocator());
+    for (int i = 0; i < 10000; i++)
+        slab.insert(i);
+    set_detail::BackgroundReclaimer::drain();
+    EXPECT_EQ(10000u, slab.size());
+
+    // a node handle keeps using the old pool while the background thread frees into it
+    for (int round = 0; round < 20; round++) {
+        std::vector<Set<int, std::less<int>, SlabAllocator<int>>::node_type> handles;
+        for (int i = 0; i < 1000; i++)
+            handles.push_back(slab.extract(i * 7 % 10000));
+        slab.clear();
+        handles.clear();
+        for (int i = 0; i < 10000; i++)
+            slab.insert(i);
+    }
+    set_detail::BackgroundReclaimer::drain();
+
+    // an allocator that is not safe to share clears on the calling thread
+    Set<int, std::less<int>, thread_bound_allocator<int>> bound;
+    bound.set_deferred_clear(true);
+    for (int i = 0; i < 1000; i++)
+        bound.insert(i);
+    auto handle = bound.extract(5);
+    bound.clear();
+    EXPECT_EQ(0u, set_detail::BackgroundReclaimer::pending());
+    EXPECT_EQ(1, *bound.get_allocator().live);
+    handle = decltype(handle)();
+    EXPECT_EQ(0, *bound.get_allocator().live);
+    EXPECT_FALSE(*bound.get_allocator().foreign);
+}
+
+template <std::size_t NodeBytes>
+void check_btree() {
+    using S = Set<int, std::less<int>, std::allocator<int>, BTreeBalance<NodeBytes>>;
+    check_random_insert_erase<BTreeBalance<NodeBytes>>();
+
+    std::default_random_engine rnd;
+    std::set<int> reference;
+    S s;
+    for (int i = 0; i < 30000; i++) {
+        int x = rnd() % 5000;
+        if (rnd() % 2 == 0) {
+            auto expected = reference.upper_bound(x);
+            auto it = reference.find(x);
+            if (it != reference.end()) {
+                // erase returns the next element even when the leaves were rebalanced
+                reference.erase(it);
+                auto next = s.erase(s.find(x));
+                EXPECT_TRUE(expected == reference.end() ? next == s.end() : *next == *expected);
+            }
+        } else {
+            auto result = s.insert(x);
+            EXPECT_EQ(reference.insert(x).second, result.second);
+            EXPECT_EQ(x, *result.first);
+        }
+    }
+    EXPECT_EQ(reference.size(), s.size());
+    EXPECT_TRUE(std::equal(reference.begin(), reference.end(), s.begin()));
+    EXPECT_TRUE(std::equal(reference.rbegin(), reference.rend(), s.rbegin()));
+    for (int x = -1; x <= 5000; x++) {
+        auto lower = reference.lower_bound(x);
+        auto upper = reference.upper_bound(x);
+        EXPECT_TRUE(lower == reference.end() ? s.lower_bound(x) == s.end() : *s.lower_bound(x) == *lower);
+        EXPECT_TRUE(upper == reference.end() ? s.upper_bound(x) == s.end() : *s.upper_bound(x) == *upper);
+        EXPECT_EQ(reference.count(x), static_cast<std::size_t>(std::distance(s.equal_range(x).first, s.equal_range(x).second)));
+    }
+
+    std::vector<int> keys;
+    for (int i = 0; i < 20000; i++)
+        keys.push_back(rnd() % 40000);
+    s.insert(keys.begin(), keys.end());
+    reference.insert(keys.begin(), keys.end());
+    EXPECT_EQ(reference.size(), s.size());
+    EXPECT_TRUE(std::equal(reference.begin(), reference.end(), s.begin()));
+
+    S copy(s);
+    S moved(std::move(s));
+    EXPECT_TRUE(s.empty());
+    EXPECT_EQ(s.begin(), s.end());
+    while (!moved.empty())
+        moved.erase(moved.begin());
+    EXPECT_EQ(reference.size(), copy.size());
+    EXPECT_TRUE(std::equal(reference.begin(), reference.end(), copy.begin()));
+}
+
+TEST(correctness, btree) {
+    check_btree<256>();
+    // a few keys per node: deep trees, every split and merge path
+    check_btree<64>();
+
+    Set<std::string, std::less<std::string>, std::allocator<std::string>, BTreeBalance<128>> strings;
+    for (int i = 0; i < 1000; i++)
+        strings.emplace(std::to_string(i));
+    for (int i = 0; i < 1000; i += 2)
+        strings.erase(strings.find(std::to_string(i)));
+    EXPECT_EQ(500u, strings.size());
+    EXPECT_EQ("1", *strings.begin());
+    EXPECT_EQ("999", *strings.rbegin());
+
+    Set<int, std::less<int>, SlabAllocator<int>, BTreeBalance<>> slab;
+    for (int i = 0; i < 10000; i++)
+        slab.insert(i);
+    auto slab_copy = slab;
+    EXPECT_EQ(10000u, slab_copy.size());
+    EXPECT_EQ(9999, *slab_copy.rbegin());
+}
+
+template <typename T>
+void check_node_search(std::vector<T> const& values) {
+    using search = set_detail::NodeSearch<T, std::less<T>>;
+    std::default_random_engine rnd;
+    std::less<T> less;
+    for (std::size_t count = 0; count <= 70; count++) {
+        std::vector<T> keys;
+        for (std::size_t i = 0; i < count; i++)
+            keys.push_back(values[rnd() % values.size()]);
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+        for (T const& element : values) {
+            std::size_t lower = std::lower_bound(keys.begin(), keys.end(), element) - keys.begin();
+            std::size_t upper = std::upper_bound(keys.begin(), keys.end(), element) - keys.begin();
+            EXPECT_EQ(lower, search::lower(keys.data(), keys.size(), element, less));
+            EXPECT_EQ(upper, search::upper(keys.data(), keys.size(), element, less));
+#ifdef SET_SIMD_SEARCH
+            EXPECT_EQ(lower, set_detail::simd::count_sse2<false>(keys.data(), keys.size(), element));
+            EXPECT_EQ(upper, set_detail::simd::count_sse2<true>(keys.data(), keys.size(), element));
+#endif
+        }
+    }
+}
+
+TEST(correctness, node_search) {
+    std::vector<std::int32_t> ints{INT32_MIN, INT32_MIN + 1, -1000, -1, 0, 1, 7, 1000, INT32_MAX - 1, INT32_MAX};
+    std::vector<std::uint32_t> unsigneds{0, 1, 2, 1000, 0x7fffffffu, 0x80000000u, 0x80000001u, UINT32_MAX - 1, UINT32_MAX};
+    std::vector<std::int64_t> longs{INT64_MIN, -(1ll << 40), -1, 0, 1, 1ll << 33, INT64_MAX};
+    std::vector<float> floats{-1e30f, -2.5f, -0.0f, 0.5f, 1.0f, 3.25f, 1e30f};
+    for (int i = -200; i < 200; i += 3) {
+        ints.push_back(i);
+        unsigneds.push_back(0x80000000u + i);
+        longs.push_back((1ll << 32) + i);
+        floats.push_back(i / 8.0f);
+    }
+    check_node_search(ints);
+    check_node_search(unsigneds);
+    check_node_search(longs);
+    check_node_search(floats);
+
+    Set<std::uint32_t, std::less<std::uint32_t>, std::allocator<std::uint32_t>, BTreeBalance<>> s;
+    for (std::uint32_t value : unsigneds)
+        s.insert(value);
+    std::set<std::uint32_t> reference(unsigneds.begin(), unsigneds.end());
+    EXPECT_TRUE(std::equal(reference.begin(), reference.end(), s.begin()));
+    EXPECT_EQ(*reference.lower_bound(0x80000000u), *s.lower_bound(0x80000000u));
+}
+
+TEST(correctness, flat_set) {
+    std::default_random_engine rnd;
+    std::set<int> reference;
+    FlatSet<int> s;
+    for (int i = 0; i < 20000; i++) {
+        int x = rnd() % 1000;
+        if (rnd() % 3 == 0) {
+            EXPECT_EQ(reference.count(x) != 0, s.find(x) != s.end());
+            if (reference.erase(x))
+                s.erase(s.find(x));
+        } else {
+            EXPECT_EQ(reference.insert(x).second, s.insert(x).second);
+        }
+    }
+    EXPECT_EQ(reference.size(), s.size());
+    EXPECT_TRUE(std::equal(reference.begin(), reference.end(), s.begin()));
+    EXPECT_TRUE(std::equal(reference.rbegin(), reference.rend(), s.rbegin()));
+
+    std::vector<int> batch;
+    for (int i = 0; i < 5000; i++)
+        batch.push_back(rnd() % 3000);
+    s.insert(batch.begin(), batch.end());
+    reference.insert(batch.begin(), batch.end());
+    EXPECT_EQ(reference.size(), s.size());
+    EXPECT_TRUE(std::equal(reference.begin(), reference.end(), s.begin()));
+
+    // random access
+    EXPECT_EQ(static_cast<std::ptrdiff_t>(s.size()), s.end() - s.begin());
+    EXPECT_EQ(*std::next(reference.begin(), 100), s.begin()[100]);
+    EXPECT_EQ(100u, s.rank(*s.nth(100)));
+    EXPECT_EQ(1u, s.count_range(*s.nth(100), *s.nth(100)));
+    EXPECT_EQ(11u, s.count_range(*s.nth(100), *s.nth(110)));
+    EXPECT_EQ(0u, s.count_range(*s.nth(110), *s.nth(100)));
+    EXPECT_EQ(*reference.lower_bound(1500), *s.lower_bound(1500));
+    EXPECT_EQ(*reference.upper_bound(1500), *s.upper_bound(1500));
+
+    Set<int> tree = s.to_set();
+    EXPECT_EQ(s.size(), tree.size());
+    EXPECT_TRUE(std::equal(s.begin(), s.end(), tree.begin()));
+    auto btree = s.to_set<BTreeBalance<>>();
+    EXPECT_TRUE(std::equal(s.begin(), s.end(), btree.begin()));
+    FlatSet<int> back(tree);
+    EXPECT_TRUE(std::equal(reference.begin(), reference.end(), back.begin()));
+
+    FlatSet<std::string, std::greater<std::string>> strings;
+    std::string words[] = {"b", "a", "c", "a", "d"};
+    strings.insert(std::begin(words), std::end(words));
+    strings.emplace("e");
+    EXPECT_EQ(5u, strings.size());
+    EXPECT_EQ("e", *strings.begin());
+    EXPECT_EQ("a", *strings.rbegin());
+}
+
+template <typename Frozen, typename Source>
+void check_frozen(Frozen const& frozen, Source const& source, int from, int to) {
+    EXPECT_EQ(source.size(), frozen.size());
+    EXPECT_TRUE(std::equal(source.begin(), source.end(), frozen.begin()));
+    EXPECT_TRUE(std::equal(source.rbegin(), source.rend(), frozen.rbegin()));
+    for (int x = from; x <= to; x++) {
+        auto lower = source.lower_bound(x);
+        auto upper = source.upper_bound(x);
+        EXPECT_TRUE(lower == source.end() ? frozen.lower_bound(x) == frozen.end() : *frozen.lower_bound(x) == *lower);
+        EXPECT_TRUE(upper == source.end() ? frozen.upper_bound(x) == frozen.end() : *frozen.upper_bound(x) == *upper);
+        EXPECT_EQ(source.count(x) != 0, frozen.contains(x));
+    }
+}
+
+TEST(correctness, freeze) {
+    std::default_random_engine rnd;
+    for (int size : {0, 1, 2, 3, 7, 8, 15, 16, 17, 100, 1000, 4097}) {
+        std::set<int> reference;
+        Set<int> s;
+        while (static_cast<int>(reference.size()) < size) {
+            int x = rnd() % (4 * size) - size;
+            reference.insert(x);
+            s.insert(x);
+        }
+        FrozenSet<int> frozen = s.freeze();
+        check_frozen(frozen, reference, -size - 2, 3 * size + 2);
+
+        Set<int, std::less<int>, std::allocator<int>, BTreeBalance<>> btree(reference.begin(), reference.end());
+        FrozenSet<int> copy = btree.freeze();
+        check_frozen(copy, reference, -size - 2, 3 * size + 2);
+
+        FrozenSet<int, std::less<int>, VanEmdeBoasLayout> veb = s.freeze<VanEmdeBoasLayout>();
+        check_frozen(veb, reference, -size - 2, 3 * size + 2);
+        FrozenSet<int, std::less<int>, VanEmdeBoasLayout> veb_copy = veb;
+        check_frozen(veb_copy, reference, -size - 2, 3 * size + 2);
+        check_frozen(btree.freeze<VanEmdeBoasLayout>(), reference, -size - 2, 3 * size + 2);
+
+        // a splay tree built in order is a path, the layout keeps that shape
+        Set<int, std::less<int>, std::allocator<int>, SplayBalance> path;
+        for (int x : reference)
+            path.insert(x);
+        check_frozen(path.freeze<VanEmdeBoasLayout>(), reference, -size - 2, 3 * size + 2);
+    }
+
+    std::vector<std::string> words{"pear", "apple", "fig", "apple", "kiwi"};
+    FrozenSet<std::string, std::greater<std::string>> strings(words.begin(), words.end());
+    EXPECT_EQ(4u, strings.size());
+    EXPECT_EQ("pear", *strings.begin());
+    EXPECT_EQ("apple", *strings.rbegin());
+    EXPECT_EQ("fig", *strings.lower_bound("grape"));
+    EXPECT_TRUE(strings.find("plum") == strings.end());
+
+    FrozenSet<std::string, std::greater<std::string>, VanEmdeBoasLayout> veb(words.begin(), words.end());
+    EXPECT_EQ(4u, veb.size());
+    EXPECT_TRUE(std::equal(strings.begin(), strings.end(), veb.begin()));
+    EXPECT_EQ("fig", *veb.lower_bound("grape"));
+}
+
+template <typename S>
+void check_find_batch(S& s, std::set<int> const& reference, std::vector<int> const& keys) {
+    std::vector<typename S::const_iterator> found;
+    s.find_batch(keys.begin(), keys.end(), std::back_inserter(found));
+    std::vector<bool> contained(keys.size());
+    EXPECT_TRUE(s.contains_batch(keys.begin(), keys.end(), contained.begin()) == contained.end());
+    ASSERT_EQ(keys.size(), found.size());
+    for (std::size_t i = 0; i < keys.size(); i++) {
+        bool present = reference.count(keys[i]) != 0;
+        EXPECT_EQ(present, contained[i]);
+        if (present)
+            EXPECT_EQ(keys[i], *found[i]);
+        else
+            EXPECT_TRUE(found[i] == s.end());
+    }
+}
+
+TEST(correctness, find_batch) {
+    std::default_random_engine rnd;
+    for (int size : {0, 1, 5, 100, 10000}) {
+        std::set<int> reference;
+        Set<int> s;
+        Set<int, std::less<int>, std::allocator<int>, BTreeBalance<>> btree;
+        Set<int, std::less<int>, std::allocator<int>, SplayBalance> splay;
+        for (int i = 0; i < size; i++) {
+            int x = rnd() % (2 * size);
+            reference.insert(x);
+            s.insert(x);
+            btree.insert(x);
+            splay.insert(x);
+        }
+        // a number of keys that is not a multiple of the group size
+        std::vector<int> keys;
+        for (int i = 0; i < 3 * size + 37; i++)
+            keys.push_back(static_cast<int>(rnd() % (2 * size + 3)) - 1);
+
+        check_find_batch(s, reference, keys);
+        check_find_batch(btree, reference, keys);
+        check_find_batch(splay, reference, keys);
+    }
+}
+
+template <typename Balance>
+void check_hinted_insert() {
+    std::default_random_engine rnd;
+    std::set<int> reference;
+    Set<int, std::less<int>, std::allocator<int>, OrderStatistics<Balance>> s;
+
+    // nearly sorted appends, with the hint at the end or next to the key
+    for (int i = 0; i < 3000; i++) {
+        int x = i * 4 + static_cast<int>(rnd() % 8);
+        reference.insert(x);
+        auto it = rnd() % 2 ? s.insert(s.end(), x) : s.emplace_hint(s.lower_bound(x), x);
+        EXPECT_EQ(x, *it);
+    }
+    // random keys with a good, a close and a useless hint, then some erasing at the back
+    for (int i = 0; i < 3000; i++) {
+        int x = static_cast<int>(rnd() % 13000);
+        reference.insert(x);
+        auto hint = s.upper_bound(x);
+        if (i % 3 == 1 && hint != s.end())
+            ++hint;
+        else if (i % 3 == 2)
+            hint = s.nth(rnd() % s.size());
+        EXPECT_EQ(x, *s.insert(hint, x));
+        if (i % 10 == 0) {
+            reference.erase(std::prev(reference.end()));
+            s.erase(std::prev(s.end()));
+        }
+    }
+
+    ASSERT_EQ(reference.size(), s.size());
+    EXPECT_TRUE(std::equal(reference.begin(), reference.end(), s.begin()));
+    EXPECT_TRUE(std::equal(reference.rbegin(), reference.rend(), s.rbegin()));
+    std::vector<int> sorted(reference.begin(), reference.end());
+    for (std::size_t i = 0; i < sorted.size(); i += 7)
+        EXPECT_EQ(i, s.rank(sorted[i]));
+
+    // a new maximum after the old one was erased
+    int top = *s.rbegin();
+    s.erase(std::prev(s.end()));
+    s.insert(top + 1);
+    EXPECT_EQ(top + 1, *s.rbegin());
+    EXPECT_EQ(reference.size(), s.size());
+}
+
+TEST(correctness, hinted_insert) {
+    check_hinted_insert<RedBlackBalance>();
+    check_hinted_insert<AvlBalance>();
+    check_hinted_insert<TreapBalance>();
+    check_hinted_insert<ScapegoatBalance>();
+    check_hinted_insert<SplayBalance>();
+
+    Set<std::string> strings;
+    auto it = strings.emplace_hint(strings.end(), 3, 'b');
+    EXPECT_EQ("bbb", *it);
+    EXPECT_TRUE(strings.insert(strings.begin(), "bbb") == it);
+    strings.insert(it, "a");
+    strings.insert(strings.end(), "c");
+    EXPECT_EQ("a", *strings.begin());
+    EXPECT_EQ("c", *strings.rbegin());
+
+    Set<int, std::less<int>, std::allocator<int>, BTreeBalance<>> btree;
+    for (int i = 0; i < 1000; i++)
+        btree.insert(btree.end(), i);
+    EXPECT_EQ(1000u, btree.size());
+    EXPECT_EQ(999, *btree.rbegin());
+}
+
+TEST(correctness, node_handles) {
+    Set<std::string> incoming;
+    Set<std::string> active;
+    for (char c = 'a'; c <= 'j'; c++)
+        incoming.insert(std::string(3, c));
+    active.insert("ccc");
+
+    std::string const* address = &*incoming.find("aaa");
+    Set<std::string>::node_type node = incoming.extract(incoming.find("aaa"));
+    EXPECT_FALSE(node.empty());
+    EXPECT_EQ(9u, incoming.size());
+    EXPECT_TRUE(incoming.find("aaa") == incoming.end());
+    node.value() = "abc";
+    auto result = active.insert(std::move(node));
+    EXPECT_TRUE(result.inserted);
+    EXPECT_TRUE(result.node.empty());
+    EXPECT_EQ(address, &*result.position);
+    EXPECT_EQ("abc", *active.begin());
+
+    // a duplicate comes back in the result
+    result = active.insert(incoming.extract("ccc"));
+    EXPECT_FALSE(result.inserted);
+    EXPECT_EQ("ccc", result.node.value());
+    EXPECT_EQ("ccc", *result.position);
+    EXPECT_TRUE(incoming.extract("zzz").empty());
+    auto hinted = active.insert(active.end(), incoming.extract(std::prev(incoming.end())));
+    EXPECT_EQ("jjj", *hinted);
+    EXPECT_TRUE(active.insert(Set<std::string>::node_type()).position == active.end());
+
+    address = &*incoming.find("bbb");
+    incoming.insert("ccc");
+    active.merge(incoming);
+    EXPECT_EQ(1u, incoming.size());
+    EXPECT_EQ("ccc", *incoming.begin());
+    EXPECT_EQ(address, &*active.find("bbb"));
+    std::vector<std::string> expected{"abc", "bbb", "ccc", "ddd", "eee", "fff", "ggg", "hhh", "iii", "jjj"};
+    EXPECT_TRUE(std::equal(expected.begin(), expected.end(), active.begin()));
+    EXPECT_EQ(expected.size(), active.size());
+
+    // with a shared slab merge relinks the nodes, with separate ones it moves the values
+    std::default_random_engine rnd;
+    for (bool shared : {true, false}) {
+        using S = Set<int, std::less<int>, SlabAllocator<int>, OrderStatistics<TreapBalance>>;
+        SlabAllocator<int> slab;
+        S first(slab);
+        S second(shared ? slab : SlabAllocator<int>());
+        std::set<int> reference;
+        for (int i = 0; i < 2000; i++) {
+            int x = rnd() % 3000;
+            reference.insert(x);
+            (i % 2 ? first : second).insert(x);
+        }
+        std::set<int> left(second.begin(), second.end());
+        first.merge(second);
+        ASSERT_EQ(reference.size(), first.size());
+        EXPECT_TRUE(std::equal(reference.begin(), reference.end(), first.begin()));
+        for (int x : second)
+            EXPECT_TRUE(left.count(x) && first.find(x) != first.end());
+        std::size_t rank = 0;
+        for (int x : reference)
+            EXPECT_EQ(rank++, first.rank(x));
+    }
+}
+
+template <typename Balance>
+void check_split_join() {
+    using S = Set<int, std::less<int>, std::allocator<int>, OrderStatistics<Balance>>;
+    std::default_random_engine rnd;
+    std::set<int> reference;
+    S s;
+    for (int i = 0; i < 5000; i++) {
+        int x = rnd() % 20000;
+        reference.insert(x);
+        s.insert(x);
+    }
+
+    for (int round = 0; round < 50; round++) {
+        int key = static_cast<int>(rnd() % 22000) - 1000;
+        auto kept = s.lower_bound(key);
+        int const* address = kept == s.end() ? nullptr : &*kept;
+
+        S upper = s.split(key);
+        std::set<int> expected_upper(reference.lower_bound(key), reference.end());
+        std::set<int> expected_lower(reference.begin(), reference.lower_bound(key));
+        ASSERT_EQ(expected_lower.size(), s.size());
+        ASSERT_EQ(expected_upper.size(), upper.size());
+        EXPECT_TRUE(std::equal(expected_lower.begin(), expected_lower.end(), s.begin()));
+        EXPECT_TRUE(std::equal(expected_upper.rbegin(), expected_upper.rend(), upper.rbegin()));
+        if (address != nullptr) {
+            EXPECT_EQ(address, &*upper.begin());
+        }
+        if (!upper.empty()) {
+            EXPECT_EQ(expected_upper.size() - 1, upper.rank(*upper.rbegin()));
+        }
+
+        // both parts stay valid trees
+        for (int i = 0; i < 20; i++) {
+            int x = rnd() % 20000;
+            if (x < key) {
+                s.insert(x);
+                expected_lower.insert(x);
+            } else {
+                upper.insert(x);
+                expected_upper.insert(x);
+            }
+        }
+        if (!s.empty()) {
+            expected_lower.erase(*s.begin());
+            s.erase(s.begin());
+        }
+
+        s = S::join(std::move(s), std::move(upper));
+        reference = expected_lower;
+        reference.insert(expected_upper.begin(), expected_upper.end());
+        ASSERT_EQ(reference.size(), s.size());
+        EXPECT_TRUE(std::equal(reference.begin(), reference.end(), s.begin()));
+        EXPECT_TRUE(std::equal(reference.rbegin(), reference.rend(), s.rbegin()));
+    }
+
+    std::size_t rank = 0;
+    for (int x : reference)
+        EXPECT_EQ(rank++, s.rank(x));
+
+    // overlapping keys are merged
+    S other;
+    other.insert(*reference.begin());
+    other.insert(-5);
+    s = S::join(std::move(s), std::move(other));
+    EXPECT_EQ(reference.size() + 1, s.size());
+    EXPECT_EQ(-5, *s.begin());
+}
+
+struct throwing_less {
+    static std::atomic<int> comparisons_left;
+
+    bool operator()(int a, int b) const {
+        if (--comparisons_left < 0)
+            throw std::runtime_error("compare");
+        return a < b;
+    }
+};
+
+std::atomic<int> throwing_less::comparisons_left(1 << 30);
+
+template <typename Balance>
+void check_throwing_split() {
+    using S = Set<int, throwing_less, std::allocator<int>, Balance>;
+    throwing_less::comparisons_left = 1 << 30;
+    S s;
+    for (int i = 0; i < 1000; i++)
+        s.insert(i * 7 % 1000);
+
+    // a comparison that throws anywhere in split leaves every element in place
+    for (int limit = 0; limit < 40; limit++) {
+        throwing_less::comparisons_left = limit;
+        try {
+            S upper = s.split(500);
+            throwing_less::comparisons_left = 1 << 30;
+            s = S::join(std::move(s), std::move(upper));
+        } catch (std::runtime_error const&) {
+            throwing_less::comparisons_left = 1 << 30;
+        }
+        ASSERT_EQ(1000u, s.size());
+        int expected = 0;
+        for (int x : s)
+            EXPECT_EQ(expected++, x);
+        EXPECT_EQ(1000, expected);
+    }
+}
+
+TEST(correctness, split_join) {
+    check_split_join<RedBlackBalance>();
+    check_split_join<AvlBalance>();
+    check_split_join<TreapBalance>();
+    check_split_join<ScapegoatBalance>();
+    check_split_join<SplayBalance>();
+    check_throwing_split<RedBlackBalance>();
+    check_throwing_split<SplayBalance>();
+    check_throwing_split<OrderStatistics<AvlBalance>>();
+
+    // without subtree sizes the parts are counted by their first size()
+    Set<int> s;
+    for (int i = 0; i < 1000; i++)
+        s.insert(i);
+    Set<int> upper = s.split(900);
+    EXPECT_EQ(900u, s.size());
+    EXPECT_EQ(100u, upper.size());
+    Set<int> lower = s.split(10);
+    EXPECT_EQ(10u, s.size());
+    EXPECT_EQ(890u, lower.size());
+    EXPECT_TRUE(s.split(-1).size() == 10 && s.empty());
+    s = Set<int>::join(std::move(lower), std::move(upper));
+    EXPECT_EQ(990u, s.size());
+    EXPECT_EQ(10, *s.begin());
+    EXPECT_EQ(999, *s.rbegin());
+    // and what changes before that is counted with them
+    Set<int> tail = s.split(500);
+    tail.insert(5000);
+    tail.erase(tail.find(500));
+    s.insert(-1);
+    s = Set<int>::join(std::move(s), std::move(tail));
+    EXPECT_EQ(991u, s.size());
+    EXPECT_EQ(991u, Set<int>(s).size());
+
+    // the halves share a slab pool but not their free lists, and may grow on different threads
+    using Slab = Set<int, std::less<int>, SlabAllocator<int>>;
+    Slab slab;
+    for (int i = 0; i < 2000; i++)
+        slab.insert(i);
+    Slab shard = slab.split(1000);
+    EXPECT_TRUE(slab.get_allocator() == shard.get_allocator());
+    std::thread grower([&shard] {
+        for (int i = 2000; i < 40000; i++)
+            shard.insert(i);
+        for (int i = 1000; i < 1500; i++)
+            shard.erase(shard.find(i));
+    });
+    for (int i = -38000; i < 0; i++)
+        slab.insert(i);
+    for (int i = 500; i < 1000; i++)
+        slab.erase(slab.find(i));
+    grower.join();
+    EXPECT_EQ(38500u, slab.size());
+    EXPECT_EQ(38500u, shard.size());
+    slab = Slab::join(std::move(slab), std::move(shard));
+    EXPECT_EQ(77000u, slab.size());
+    EXPECT_EQ(-38000, *slab.begin());
+    EXPECT_EQ(39999, *slab.rbegin());
+}
+
+template <typename Balance>
+void check_set_operations(std::size_t size, std::size_t other_size, unsigned threads) {
+    using S = Set<int, std::less<int>, std::allocator<int>, OrderStatistics<Balance>>;
+    std::default_random_engine rnd(static_cast<unsigned>(size + other_size));
+    std::set<int> first, second;
+    S s, other;
+    s.set_parallelism(threads);
+    int range = static_cast<int>(2 * (size + other_size)) + 1;
+    while (first.size() < size) {
+        int x = rnd() % range;
+        first.insert(x);
+        s.insert(x);
+    }
+    while (second.size() < other_size) {
+        int x = rnd() % range;
+        second.insert(x);
+        other.insert(x);
+    }
+
+    auto check = [](S const& result, std::vector<int> const& expected) {
+        ASSERT_EQ(expected.size(), result.size());
+        EXPECT_TRUE(std::equal(expected.begin(), expected.end(), result.begin()));
+        EXPECT_TRUE(std::equal(expected.rbegin(), expected.rend(), result.rbegin()));
+        for (std::size_t i = 0; i < expected.size(); i += 1 + expected.size() / 64)
+            EXPECT_EQ(i, result.rank(expected[i]));
+    };
+
+    std::vector<int> expected;
+    std::set_union(first.begin(), first.end(), second.begin(), second.end(), std::back_inserter(expected));
+    S united = s;
+    united.set_parallelism(threads);
+    united.union_with(other);
+    check(united, expected);
+    EXPECT_EQ(second.size(), other.size());
+    S moved = s;
+    moved.set_parallelism(threads);
+    S consumed = other;
+    moved.union_with(std::move(consumed));
+    check(moved, expected);
+    EXPECT_TRUE(consumed.empty());
+
+    expected.clear();
+    std::set_intersection(first.begin(), first.end(), second.begin(), second.end(), std::back_inserter(expected));
+    S common = s;
+    common.set_parallelism(threads);
+    common.intersect_with(other);
+    check(common, expected);
+
+    expected.clear();
+    std::set_difference(first.begin(), first.end(), second.begin(), second.end(), std::back_inserter(expected));
+    s.difference_with(other);
+    check(s, expected);
+
+    // the results are still valid trees
+    s.insert(-1);
+    s.erase(s.find(-1));
+    check(s, expected);
+}
+
+TEST(correctness, set_operations) {
+    check_set_operations<RedBlackBalance>(3000, 2000, 1);
+    check_set_operations<AvlBalance>(3000, 2000, 1);
+    check_set_operations<TreapBalance>(3000, 2000, 1);
+    check_set_operations<ScapegoatBalance>(3000, 2000, 1);
+    check_set_operations<SplayBalance>(3000, 2000, 1);
+    // a small delta into a large set, and both sides past the grain so the work forks
+    check_set_operations<RedBlackBalance>(20000, 30, 4);
+    check_set_operations<AvlBalance>(30, 20000, 4);
+    check_set_operations<RedBlackBalance>(20000, 20000, 4);
+    check_set_operations<AvlBalance>(20000, 20000, 4);
+    check_set_operations<TreapBalance>(20000, 20000, 4);
+    check_set_operations<ScapegoatBalance>(20000, 20000, 4);
+    check_set_operations<SplayBalance>(20000, 20000, 4);
+    check_set_operations<RedBlackBalance>(0, 100, 4);
+
+    // nodes cannot move between unequal allocators, they are copied
+    Set<int, std::less<int>, SlabAllocator<int>> s, other;
+    for (int i = 0; i < 100; i++) {
+        s.insert(2 * i);
+        other.insert(3 * i);
+    }
+    s.union_with(std::move(other));
+    EXPECT_EQ(166u, s.size());
+    EXPECT_EQ(100u, other.size());
+    s.intersect_with(s);
+    EXPECT_EQ(166u, s.size());
+    s.union_with(s);
+    EXPECT_EQ(166u, s.size());
+    s.difference_with(s);
+    EXPECT_TRUE(s.empty());
+}
+
+int forked_sum(int depth) {
+    if (depth == 0)
+        return 1;
+    int left = 0;
+    auto task = set_detail::WorkerPool::fork([&left, depth] { left = forked_sum(depth - 1); });
+    int right = forked_sum(depth - 1);
+    task->join();
+    return left + right;
+}
+
+TEST(correctness, worker_pool) {
+    // far more forks than workers, nested: the joins take what no worker got to
+    EXPECT_EQ(1 << 12, forked_sum(12));
+
+    auto task = set_detail::WorkerPool::fork([] { throw std::runtime_error("task"); });
+    EXPECT_THROW(task->join(), std::runtime_error);
+}
+
+template <typename Balance>
+void check_parallel_copy() {
+    using S = Set<int, std::less<int>, std::allocator<int>, OrderStatistics<Balance>>;
+    std::default_random_engine rnd;
+    S s;
+    s.set_parallelism(4);
+    for (int i = 0; i < 50000; i++)
+        s.insert(rnd() % 200000);
+
+    S copy = s;
+    ASSERT_EQ(s.size(), copy.size());
+    EXPECT_TRUE(std::equal(s.begin(), s.end(), copy.begin()));
+    EXPECT_TRUE(std::equal(s.rbegin(), s.rend(), copy.rbegin()));
+    EXPECT_EQ(s.size() - 1, copy.rank(*copy.rbegin()));
+    EXPECT_NE(&*s.begin(), &*copy.begin());
+
+    // the copy keeps the tags and can go on changing on its own
+    std::set<int> reference(s.begin(), s.end());
+    for (int i = 0; i < 5000; i++) {
+        int x = rnd() % 200000;
+        if (reference.count(x)) {
+            copy.erase(copy.find(x));
+            reference.erase(x);
+        } else {
+            copy.insert(x);
+            reference.insert(x);
+        }
+    }
+    ASSERT_EQ(reference.size(), copy.size());
+    EXPECT_TRUE(std::equal(reference.begin(), reference.end(), copy.begin()));
+    std::size_t rank = 0;
+    for (int x : reference)
+        EXPECT_EQ(rank++, copy.rank(x));
+}
+
+struct throwing_copy {
+    static std::atomic<int> copies_left;
+    static std::atomic<int> alive;
+    int x;
+
+    throwing_copy(int x) : x(x) { ++alive; }
+    throwing_copy(throwing_copy const& other) : x(other.x) {
+        if (--copies_left < 0)
+            throw std::runtime_error("copy");
+        ++alive;
+    }
+    ~throwing_copy() { --alive; }
+
+    friend bool operator<(throwing_copy const& a, throwing_copy const& b) { return a.x < b.x; }
+};
+
+std::atomic<int> throwing_copy::copies_left(0);
+std::atomic<int> throwing_copy::alive(0);
+
+TEST(correctness, parallel_copy) {
+    check_parallel_copy<RedBlackBalance>();
+    check_parallel_copy<AvlBalance>();
+    check_parallel_copy<TreapBalance>();
+    check_parallel_copy<ScapegoatBalance>();
+    check_parallel_copy<SplayBalance>();
+
+    Set<int, std::less<int>, SlabAllocator<int>> slab;
+    slab.set_parallelism(3);
+    for (int i = 0; i < 40000; i++)
+        slab.insert(i * 7 % 40000);
+    Set<int, std::less<int>, SlabAllocator<int>> slab_copy(slab);
+    ASSERT_EQ(40000u, slab_copy.size());
+    EXPECT_TRUE(std::equal(slab.begin(), slab.end(), slab_copy.begin()));
+
+    // an allocator not safe to use from other threads copies on this one, a slot per node
+    Set<int, std::less<int>, thread_bound_allocator<int>> bound;
+    bound.set_parallelism(4);
+    for (int i = 0; i < 40000; i++)
+        bound.insert(i);
+    Set<int, std::less<int>, thread_bound_allocator<int>> bound_copy(bound);
+    EXPECT_EQ(80000, *bound.get_allocator().live);
+    EXPECT_FALSE(*bound.get_allocator().foreign);
+    EXPECT_TRUE(std::equal(bound.begin(), bound.end(), bound_copy.begin()));
+
+    // a throwing copy anywhere in the tree leaves nothing behind
+    {
+        Set<throwing_copy> s;
+        s.set_parallelism(4);
+        throwing_copy::copies_left = 1 << 30;
+        for (int i = 0; i < 40000; i++)
+            s.insert(throwing_copy(i));
+        for (int limit : {0, 1, 100, 20000, 39999}) {
+            throwing_copy::copies_left = limit;
+            EXPECT_ANY_THROW(Set<throwing_copy> copy(s));
+            EXPECT_EQ(40000, throwing_copy::alive);
+        }
+        throwing_copy::copies_left = 1 << 30;
+        Set<throwing_copy> copy(s);
+        EXPECT_EQ(80000, throwing_copy::alive);
+    }
+    EXPECT_EQ(0, throwing_copy::alive);
+}
+
+TEST(correctness, persistent_set) {
+    std::default_random_engine rnd;
+    std::vector<PersistentSet<int>> versions(1);
+    std::vector<std::set<int>> expected(1);
+    for (int i = 0; i < 3000; i++) {
+        int x = rnd() % 1000;
+        bool erase = rnd() % 3 == 0;
+        PersistentSet<int> next = erase ? versions.back().erase(x) : versions.back().insert(x);
+        std::set<int> reference = expected.back();
+        if (erase)
+            reference.erase(x);
+        else reference.insert(x);
+        EXPECT_EQ(next.size() == versions.back().size(), next.same_version(versions.back()));
+        versions.push_back(next);
+        expected.push_back(reference);
+    }
+
+    // every version still holds what it held when it was made
+    for (std::size_t i = 0; i < versions.size(); i += 97) {
+        PersistentSet<int> const& version = versions[i];
+        ASSERT_EQ(expected[i].size(), version.size());
+        EXPECT_TRUE(std::equal(expected[i].begin(), expected[i].end(), version.begin()));
+        EXPECT_TRUE(std::equal(expected[i].rbegin(), expected[i].rend(), version.rbegin()));
+        for (int x = -1; x <= 1000; x += 7) {
+            EXPECT_EQ(expected[i].count(x) != 0, version.contains(x));
+            auto lower = expected[i].lower_bound(x);
+            auto upper = expected[i].upper_bound(x);
+            EXPECT_EQ(lower == expected[i].end(), version.lower_bound(x) == version.end());
+            if (lower != expected[i].end()) {
+                EXPECT_EQ(*lower, *version.lower_bound(x));
+            }
+            if (upper != expected[i].end()) {
+                EXPECT_EQ(*upper, *version.upper_bound(x));
+            }
+            EXPECT_EQ(expected[i].count(x) != 0, version.find(x) != version.end());
+        }
+    }
+
+    PersistentSet<int> from_range(expected.back().rbegin(), expected.back().rend());
+    EXPECT_TRUE(std::equal(expected.back().begin(), expected.back().end(), from_range.begin()));
+    Set<int> set(expected.back().begin(), expected.back().end());
+    PersistentSet<int> from_set(set);
+    EXPECT_EQ(set.size(), from_set.size());
+    EXPECT_TRUE(std::equal(set.begin(), set.end(), from_set.begin()));
+    auto it = from_set.end();
+    EXPECT_EQ(*set.rbegin(), *--it);
+
+    // snapshots read on another thread while the writer goes on
+    PersistentSet<int> snapshot = versions.back();
+    std::thread reader([&] {
+        for (int round = 0; round < 20; round++) {
+            long sum = 0;
+            for (int x : snapshot)
+                sum += x;
+            EXPECT_EQ(std::accumulate(expected.back().begin(), expected.back().end(), 0L), sum);
+        }
+    });
+    PersistentSet<int> writer = versions.back();
+    for (int i = 0; i < 3000; i++)
+        writer = writer.insert(1000 + i).erase(static_cast<int>(rnd() % 1000));
+    versions.clear();
+    reader.join();
+
+    // a throwing copy leaves both versions as they were
+    {
+        throwing_copy::copies_left = 1 << 30;
+        PersistentSet<throwing_copy> s;
+        for (int i = 0; i < 100; i++)
+            s = s.insert(throwing_copy(i));
+        int alive = throwing_copy::alive;
+        for (int limit : {0, 1, 2}) {
+            throwing_copy::copies_left = limit;
+            EXPECT_ANY_THROW(s.insert(throwing_copy(-1)));
+            throwing_copy::copies_left = limit;
+            EXPECT_ANY_THROW(s.erase(throwing_copy(50)));
+            EXPECT_EQ(alive, throwing_copy::alive);
+        }
+        throwing_copy::copies_left = 1 << 30;
+        EXPECT_EQ(100u, s.size());
+        EXPECT_EQ(99u, s.erase(throwing_copy(50)).size());
+    }
+    EXPECT_EQ(0, throwing_copy::alive);
+}
+
+template <typename S>
+void check_concurrent_set(unsigned threads) {
+    std::mt19937 rnd(23);
+    S s;
+    std::set<int> reference;
+    for (int i = 0; i < 20000; i++) {
+        int x = static_cast<int>(rnd() % 3000);
+        if (rnd() % 3 == 0)
+            EXPECT_EQ(reference.erase(x) != 0, s.erase(x));
+        else
+            EXPECT_EQ(reference.insert(x).second, s.insert(x));
+        int y = static_cast<int>(rnd() % 3100);
+        EXPECT_EQ(reference.count(y) != 0, s.contains(y));
+        int bound = -1;
+        std::set<int>::iterator it = reference.lower_bound(y);
+        EXPECT_EQ(it != reference.end(), s.lower_bound(y, bound));
+        if (it != reference.end()) {
+            EXPECT_EQ(*it, bound);
+        }
+    }
+    EXPECT_EQ(reference.size(), s.size());
+    for (int x : reference)
+        EXPECT_TRUE(s.erase(x));
+    EXPECT_TRUE(s.empty());
+    int bound;
+    EXPECT_FALSE(s.lower_bound(0, bound));
+
+    // writers on disjoint keys: each inserts its own, then erases the odd ones
+    int const per_thread = 20000;
+    std::vector<std::thread> writers;
+    for (unsigned t = 0; t < threads; t++)
+        writers.emplace_back([&s, t, threads, per_thread] {
+            for (int i = 0; i < per_thread; i++)
+                EXPECT_TRUE(s.insert(static_cast<int>(i * threads + t)));
+            for (int i = 1; i < per_thread; i += 2)
+                EXPECT_TRUE(s.erase(static_cast<int>(i * threads + t)));
+        });
+    for (std::thread& writer : writers)
+        writer.join();
+    EXPECT_EQ(threads * per_thread / 2, s.size());
+    for (int i = 0; i < static_cast<int>(threads) * per_thread; i++)
+        EXPECT_EQ((i / threads) % 2 == 0, s.contains(i));
+
+    // then the rest, which merges the tree back down under all of them
+    writers.clear();
+    for (unsigned t = 0; t < threads; t++)
+        writers.emplace_back([&s, t, threads, per_thread] {
+            for (int i = 0; i < per_thread; i += 2)
+                EXPECT_TRUE(s.erase(static_cast<int>(i * threads + t)));
+        });
+    for (std::thread& writer : writers)
+        writer.join();
+    EXPECT_TRUE(s.empty());
+    EXPECT_FALSE(s.lower_bound(0, bound));
+
+    // readers never miss the even keys while writers come and go on the odd ones
+    S mixed;
+    for (int i = 0; i < 20000; i += 2)
+        mixed.insert(i);
+    std::atomic<bool> done{false};
+    std::vector<std::thread> readers;
+    for (unsigned t = 0; t < threads; t++)
+        readers.emplace_back([&mixed, &done, t] {
+            std::mt19937 local(t);
+            while (!done.load()) {
+                int x = static_cast<int>(local() % 19999);
+                int bound = -1;
+                if (x % 2 == 0) {
+                    EXPECT_TRUE(mixed.contains(x));
+                }
+                EXPECT_TRUE(mixed.lower_bound(x, bound));
+                EXPECT_TRUE(bound == x || (x % 2 == 1 && bound == x + 1));
+            }
+        });
+    for (int round = 0; round < 5; round++) {
+        for (int i = 1; i < 20000; i += 2)
+            mixed.insert(i);
+        for (int i = 1; i < 20000; i += 2)
+            mixed.erase(i);
+        // keys past the readers' come and go whole, so nodes are merged away beside them
+        for (int i = 20000; i < 30000; i++)
+            mixed.insert(i);
+        for (int i = 20000; i < 30000; i++)
+            mixed.erase(i);
+    }
+    done.store(true);
+    for (std::thread& reader : readers)
+        reader.join();
+    EXPECT_EQ(10000u, mixed.size());
+}
+
+struct plain_key {
+    explicit plain_key(int x) : x(x) {}
+    int x;
+};
+
+struct plain_key_less {
+    bool operator()(plain_key a, plain_key b) const { return a.x < b.x; }
+};
+
+TEST(correctness, concurrent_set) {
+    check_concurrent_set<ConcurrentSet<int>>(4);
+    // small nodes, for deep trees and many splits
+    check_concurrent_set<ConcurrentSet<int, std::less<int>, std::allocator<int>, 64>>(4);
+
+    // keys need not be default constructible
+    ConcurrentSet<plain_key, plain_key_less, std::allocator<plain_key>, 64> keys;
+    for (int i = 0; i < 2000; i++)
+        EXPECT_TRUE(keys.insert(plain_key(i * 7 % 2000)));
+    EXPECT_EQ(2000u, keys.size());
+    plain_key found(-1);
+    EXPECT_TRUE(keys.lower_bound(plain_key(1000), found));
+    EXPECT_EQ(1000, found.x);
+    EXPECT_TRUE(keys.contains(plain_key(1999)));
+    EXPECT_FALSE(keys.contains(plain_key(2000)));
+
+    // a sliding window: the leaves it leaves behind are merged away and freed
+    thread_bound_allocator<int> allocator;
+    {
+        ConcurrentSet<int, std::less<int>, thread_bound_allocator<int>, 64> window(std::less<int>(), allocator);
+        for (int i = 0; i < 200000; i++) {
+            EXPECT_TRUE(window.insert(i));
+            if (i >= 1000)
+                EXPECT_TRUE(window.erase(i - 1000));
+        }
+        EXPECT_EQ(1000u, window.size());
+        int bound = -1;
+        EXPECT_TRUE(window.lower_bound(0, bound));
+        EXPECT_EQ(199000, bound);
+        EXPECT_LT(*allocator.live, 2000);
+        for (int i = 199000; i < 200000; i++)
+            EXPECT_TRUE(window.erase(i));
+        EXPECT_FALSE(window.lower_bound(0, bound));
+        EXPECT_LT(*allocator.live, 200);
+    }
+    EXPECT_EQ(0, *allocator.live);
+}
+
+TEST(correctness, lock_free_set) {
+    std::mt19937 rnd(24);
+    LockFreeSet<std::string> s;
+    std::set<std::string> reference;
+    for (int i = 0; i < 20000; i++) {
+        std::string x = std::to_string(rnd() % 2000);
+        if (rnd() % 3 == 0) {
+            EXPECT_EQ(reference.erase(x), s.erase(x));
+        } else {
+            std::pair<LockFreeSet<std::string>::iterator, bool> inserted = s.insert(x);
+            EXPECT_EQ(reference.insert(x).second, inserted.second);
+            EXPECT_EQ(x, *inserted.first);
+        }
+        std::string y = std::to_string(rnd() % 2100);
+        EXPECT_EQ(reference.count(y) != 0, s.contains(y));
+        EXPECT_EQ(reference.count(y) != 0, s.find(y) != s.end());
+        LockFreeSet<std::string>::iterator lower = s.lower_bound(y);
+        LockFreeSet<std::string>::iterator upper = s.upper_bound(y);
+        EXPECT_EQ(reference.lower_bound(y) == reference.end(), lower == s.end());
+        EXPECT_EQ(reference.upper_bound(y) == reference.end(), upper == s.end());
+        if (lower != s.end()) {
+            EXPECT_EQ(*reference.lower_bound(y), *lower);
+        }
+        if (upper != s.end()) {
+            EXPECT_EQ(*reference.upper_bound(y), *upper);
+        }
+    }
+    EXPECT_EQ(reference.size(), s.size());
+    EXPECT_TRUE(std::equal(reference.begin(), reference.end(), s.begin()));
+
+    LockFreeSet<std::string> copy(reference.rbegin(), reference.rend());
+    EXPECT_TRUE(std::equal(reference.begin(), reference.end(), copy.begin()));
+    for (LockFreeSet<std::string>::iterator it = copy.begin(); it != copy.end();)
+        it = copy.erase(it);
+    EXPECT_TRUE(copy.empty());
+    EXPECT_TRUE(copy.begin() == copy.end());
+
+    // writers fight over a few keys while a reader scans, and every scan is in order
+    LockFreeSet<int> shared;
+    std::atomic<bool> done{false};
+    std::thread scanner([&shared, &done] {
+        while (!done.load()) {
+            int previous = -1;
+            for (int x : shared) {
+                EXPECT_LT(previous, x);
+                previous = x;
+            }
+        }
+    });
+    std::atomic<unsigned> churning{4};
+    std::vector<std::thread> writers;
+    for (unsigned t = 0; t < 4; t++)
+        writers.emplace_back([&shared, &churning, t] {
+            std::mt19937 local(t);
+            for (int i = 0; i < 50000; i++) {
+                int x = static_cast<int>(local() % 256);
+                if (local() % 2)
+                    shared.insert(x);
+                else shared.erase(x);
+            }
+            // then, once all are done, each writer leaves its own keys in
+            churning.fetch_sub(1);
+            while (churning.load() != 0)
+                std::this_thread::yield();
+            for (int x = 0; x < 256; x++)
+                if (x % 4 == static_cast<int>(t))
+                    shared.insert(x);
+        });
+    for (std::thread& writer : writers)
+        writer.join();
+    done.store(true);
+    scanner.join();
+    EXPECT_EQ(256u, shared.size());
+    EXPECT_EQ(256, std::distance(shared.begin(), shared.end()));
+    for (int x = 0; x < 256; x++)
+        EXPECT_TRUE(shared.contains(x));
+
+    // an iterator held on another thread does not hold up erases past the reclaimer's limit
+    LockFreeSet<int> held;
+    for (int x = 0; x < 10000; x++)
+        held.insert(x);
+    std::atomic<int> stage{0};
+    std::thread holder([&held, &stage] {
+        LockFreeSet<int>::iterator it = held.begin();
+        stage.store(1);
+        while (stage.load() != 2)
+            std::this_thread::yield();
+        EXPECT_EQ(0, *it);
+    });
+    while (stage.load() != 1)
+        std::this_thread::yield();
+    for (int x = 0; x < 10000; x++)
+        EXPECT_EQ(1u, held.erase(x));
+    EXPECT_TRUE(held.empty());
+    stage.store(2);
+    holder.join();
+}
+
+namespace {
+
+void count_free(void*, void* counter) {
+    ++*static_cast<std::atomic<int>*>(counter);
+}
+
+}
+
+TEST(correctness, epoch_reclaimer) {
+    std::atomic<int> freed{0};
+    {
+        EpochReclaimer reclaimer(4, 16, EpochReclaimer::WAIT);
+        int dummy[64];
+
+        // nothing retired is freed while a thread that pinned before stays pinned
+        std::atomic<int> stage{0};
+        std::thread reader([&reclaimer, &stage] {
+            EpochReclaimer::Guard guard(reclaimer);
+            stage.store(1);
+            while (stage.load() != 2)
+                std::this_thread::yield();
+        });
+        while (stage.load() != 1)
+            std::this_thread::yield();
+        for (int i = 0; i < 10; i++)
+            reclaimer.retire(&dummy[i], &count_free, &freed);
+        reclaimer.collect();
+        reclaimer.collect();
+        EXPECT_EQ(0, freed.load());
+        EXPECT_EQ(10u, reclaimer.pending());
+
+        // the list is full at 16: the retiring thread stalls until the reader lets go
+        std::thread unpinner([&reclaimer, &stage] {
+            while (reclaimer.stats().stalls == 0)
+                std::this_thread::yield();
+            stage.store(2);
+        });
+        for (int i = 10; i < 20; i++)
+            reclaimer.retire(&dummy[i], &count_free, &freed);
+        unpinner.join();
+        reader.join();
+        EpochReclaimer::Stats stats = reclaimer.stats();
+        EXPECT_LE(1u, stats.stalls);
+        EXPECT_EQ(20u, stats.retired);
+        EXPECT_LT(stats.pending, 16u);
+        EXPECT_EQ(stats.retired, stats.freed + stats.pending);
+        EXPECT_EQ(static_cast<int>(stats.freed), freed.load());
+
+        // frees come in batches, and with nobody pinned everything goes
+        for (int i = 0; i < 3; i++)
+            reclaimer.collect();
+        EXPECT_EQ(20, freed.load());
+
+        // a pinned thread does not wait on itself
+        {
+            EpochReclaimer::Guard guard(reclaimer);
+            for (int i = 0; i < 40; i++)
+                reclaimer.retire(&dummy[i], &count_free, &freed);
+            EXPECT_EQ(40u, reclaimer.pending());
+        }
+        // nor does it throw, so EpochAllocator::deallocate can be noexcept
+        EXPECT_TRUE(noexcept(reclaimer.retire(&dummy[0], &count_free, &freed)));
+
+        // what an exited thread retired is freed later, at the latest with the reclaimer
+        std::thread([&reclaimer, &dummy, &freed] {
+            for (int i = 0; i < 3; i++)
+                reclaimer.retire(&dummy[i], &count_free, &freed);
+        }).join();
+        EXPECT_EQ(43u, reclaimer.pending());
+    }
+    EXPECT_EQ(63, freed.load());
+
+    // Set's erased nodes go through the reclaimer of an EpochAllocator
+    std::shared_ptr<EpochReclaimer> reclaimer = std::make_shared<EpochReclaimer>();
+    {
+        Set<int, std::less<int>, EpochAllocator<int>> s((EpochAllocator<int>(reclaimer)));
+        std::set<int> reference;
+        std::mt19937 rnd(25);
+        for (int i = 0; i < 5000; i++) {
+            int x = static_cast<int>(rnd() % 1000);
+            s.insert(x);
+            reference.insert(x);
+        }
+        // inserting a duplicate frees a node too; erased nodes wait for the pin
+        EpochReclaimer::Stats before = reclaimer->stats();
+        EpochReclaimer::Guard guard(s.get_allocator().reclaimer());
+        std::size_t erased = 0;
+        for (int x = 0; x < 1000; x += 2) {
+            Set<int, std::less<int>, EpochAllocator<int>>::const_iterator it = s.find(x);
+            if (it != s.end()) {
+                s.erase(it);
+                reference.erase(x);
+                erased++;
+            }
+        }
+        EXPECT_TRUE(std::equal(reference.begin(), reference.end(), s.begin()));
+        EXPECT_EQ(before.retired + erased, reclaimer->stats().retired);
+        EXPECT_EQ(before.freed, reclaimer->stats().freed);
+    }
+    for (int i = 0; i < 3; i++)
+        reclaimer->collect();
+    EXPECT_EQ(0u, reclaimer->pending());
+    EXPECT_EQ(reclaimer->stats().retired, reclaimer->stats().freed);
+
+    // the reclaimer takes retirements from any thread, so clear may be deferred: the nodes
+    // then wait in the background thread's list, not in this one's
+    std::shared_ptr<EpochReclaimer> batched = std::make_shared<EpochReclaimer>(2048);
+    Set<int, std::less<int>, EpochAllocator<int>> deferred((EpochAllocator<int>(batched)));
+    deferred.set_deferred_clear(true);
+    for (int i = 0; i < 1000; i++)
+        deferred.insert(i);
+    deferred.clear();
+    set_detail::BackgroundReclaimer::drain();
+    EXPECT_EQ(1000u, batched->stats().retired);
+    for (int i = 0; i < 3; i++)
+        EXPECT_EQ(0u, batched->collect());
+    EXPECT_EQ(1000u, batched->pending());
+}
+
+TEST(correctness, settings) {
+    Set<int> s;
+    s.set_parallelism(3);
+    s.set_deferred_clear(true);
+    s.insert(1);
+
+    // the settings go wherever the elements go
+    Set<int> copy(s);
+    EXPECT_EQ(3u, copy.parallelism());
+    EXPECT_TRUE(copy.deferred_clear());
+    Set<int> moved(std::move(copy));
+    EXPECT_EQ(3u, moved.parallelism());
+    EXPECT_TRUE(moved.deferred_clear());
+    Set<int> assigned;
+    assigned = std::move(moved);
+    EXPECT_EQ(3u, assigned.parallelism());
+    EXPECT_TRUE(assigned.deferred_clear());
+
+    Set<int> other;
+    other.insert(2);
+    swap(assigned, other);
+    EXPECT_EQ(0u, assigned.parallelism());
+    EXPECT_FALSE(assigned.deferred_clear());
+    EXPECT_EQ(2, *assigned.begin());
+    EXPECT_EQ(3u, other.parallelism());
+    EXPECT_TRUE(other.deferred_clear());
+    EXPECT_EQ(1, *other.begin());
+
+    Set<int> joined = Set<int>::join(std::move(other), std::move(assigned));
+    EXPECT_EQ(3u, joined.parallelism());
+    EXPECT_TRUE(joined.deferred_clear());
+    Set<int> upper = joined.split(2);
+    EXPECT_EQ(3u, upper.parallelism());
+    EXPECT_TRUE(upper.deferred_clear());
+}